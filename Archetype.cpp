@@ -15,36 +15,67 @@
  */
 
 #include "Archetype.h"
-#include "Debug.h"
+#include "Log.h"
+#include "Clock.h"
+#include <stdio.h>
 
 namespace vengine
 {
-    Archetype::Archetype(Vector<Type const*> const& component_types) :
-        m_types(), m_entities(type_of<EntityID>(), (u64)4, CHUNK_SIZE)
+    // Archetypes are spread round-robin over the NUMA nodes. All chunks of an archetype live on its node
+    // and parallel tasks queue its jobs for that node's workers
+    static u32 home_node_of_archetype(u64 id)
     {
+        u32 node_count = CpuTopology::the().node_count();
+        return node_count < 2 ? CpuTopology::NO_NODE : (u32)(id % node_count);
+    }
+
+    Archetype::Archetype(u64 id, Vector<Type const*> const& component_types, SharedComponentList const& shared_components, void const* world) :
+        m_id(id), m_numa_node(home_node_of_archetype(id)), m_types(),
+        m_entities(type_of<EntityID>(), (u64)4, CHUNK_SIZE, MemoryOwner { MemorySubsystem::EntityIDs, id, nullptr, world }, m_numa_node), m_shared_components(shared_components)
+    {
+        TypeID max_type_id = 0;
         for (auto type : component_types)
         {
             m_types.append(type);
-            m_components.construct(type, (u64)4, CHUNK_SIZE);
+            m_components.construct(type, (u64)4, CHUNK_SIZE, MemoryOwner { MemorySubsystem::Components, id, type, world }, m_numa_node);
+            m_enable_masks.append(EnableMask {});
+            if (type->id() > max_type_id)
+                max_type_id = type->id();
+        }
+
+        if (m_types.size() > 0)
+        {
+            for (TypeID id = 0; id <= max_type_id; ++id)
+                m_column_by_type_id.append(INVALID_COLUMN);
+            for (size_t i = 0; i < m_types.size(); ++i)
+                m_column_by_type_id[m_types[i]->id()] = i;
         }
-        static Atomic<u64> next_id { 1 };
-        m_id = next_id.fetch_add(1, MemoryOrder::Relaxed);
     }
 
-    bool Archetype::has_type(Type const* type)
+    bool Archetype::has_type(Type const* type) const
     {
-        return m_components
-            .to_iterable_collection()
-            .contains(type, [](ChunkedBuffer<u8> const& a, Type const* b)
-                { return a.type() == b; });
+        return column_of_type(type) != INVALID_COLUMN;
+    }
+
+    SharedComponent const* Archetype::shared_component(Type const* type) const
+    {
+        for (auto* shared : m_shared_components)
+        {
+            if (shared->type == type)
+                return shared;
+        }
+        return nullptr;
+    }
+
+    SharedComponentList const& Archetype::shared_components() const
+    {
+        return m_shared_components;
     }
 
     void Archetype::set_component_data(EntityID entity, Type const* component_type, u8 const* data)
     {
         ENSURE(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity) == m_id);
-        auto& buffer = *m_components.to_iterable_collection()
-                            .find(component_type, [](ChunkedBuffer<u8> const& buffer, Type const* type)
-                                { return buffer.type() == type; });
+        auto& buffer = m_components[index_of_type(component_type)];
         component_type->copy_assignment(data, buffer[GET_INDEX_FROM_ENTITY_ID(entity)]);
     }
 
@@ -54,8 +85,7 @@ namespace vengine
         auto index = GET_INDEX_FROM_ENTITY_ID(entity);
         if (index >= size())
         {
-            if constexpr (DebugMessages)
-                __builtin_printf("Tried to destroy nonexistent entity %lx!!!\n", entity);
+            log_debug("Tried to destroy nonexistent entity %lx!!!", entity);
             return;
         }
         for (auto& buffer : m_components)
@@ -63,6 +93,17 @@ namespace vengine
             buffer.remove_at(index);
         }
         m_entities.remove_at(index);
+        remove_enable_row(index, m_entities.size());
+
+        // References to the destroyed entity go first, the moved entity takes over its id below
+        for (size_t i = m_stable_references.size(); i > 0; --i)
+        {
+            if (m_stable_references[i - 1].id() != entity)
+                continue;
+            m_stable_references[i - 1].update(0);
+            m_stable_references.remove_at(i - 1);
+            MemoryTracker::the().record_free({ MemorySubsystem::StableReferences }, STABLE_ENTITY_ID_BYTES);
+        }
 
         if (m_entities.size() > 0 && index != m_entities.size())
         {
@@ -70,30 +111,129 @@ namespace vengine
             auto old_entity = moved_entity;
             moved_entity = MAKE_ENTITY_ID(m_id, index);
 
-            auto maybe_iterator = m_stable_references.to_iterable_collection().find(old_entity, [](StableEntityID const& stableId, EntityID id)
-                { return stableId.id() == id; });
-            if (!maybe_iterator.is_end())
-                maybe_iterator->update(moved_entity);
+            for (auto& reference : m_stable_references)
+            {
+                if (reference.id() == old_entity)
+                    reference.update(moved_entity);
+            }
+        }
+    }
+
+    void Archetype::set_enabled(EntityID entity, size_t column, bool enabled)
+    {
+        ENSURE(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity) == m_id);
+        size_t row = GET_INDEX_FROM_ENTITY_ID(entity);
+        auto& mask = m_enable_masks[column];
+        if (mask.bits.size() == 0)
+        {
+            if (enabled)
+                return;
+            grow_enable_mask(mask);
+        }
+        if (get_bit(mask.bits, row) == enabled)
+            return;
+
+        set_bit(mask.bits, row, enabled);
+        if (enabled)
+        {
+            mask.disabled--;
+            mask.disabled_per_chunk[row / CHUNK_SIZE]--;
+        }
+        else
+        {
+            mask.disabled++;
+            mask.disabled_per_chunk[row / CHUNK_SIZE]++;
+        }
+    }
+
+    bool Archetype::is_enabled(EntityID entity, size_t column) const
+    {
+        ENSURE(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity) == m_id);
+        auto const& mask = m_enable_masks[column];
+        return mask.disabled == 0 || get_bit(mask.bits, GET_INDEX_FROM_ENTITY_ID(entity));
+    }
+
+    // Makes room for every existing row plus one, new rows start out enabled
+    void Archetype::grow_enable_mask(EnableMask& mask)
+    {
+        size_t chunk_count = size() / CHUNK_SIZE + 1;
+        bool was_allocated = mask.bits.size() > 0;
+        while (mask.disabled_per_chunk.size() < chunk_count)
+        {
+            mask.disabled_per_chunk.append(0);
+            for (size_t word = 0; word < ENABLE_WORDS_PER_CHUNK; ++word)
+                mask.bits.append(0);
+        }
+        if (!was_allocated)
+        {
+            for (size_t row = 0; row < size(); ++row)
+                set_bit(mask.bits, row, true);
+        }
+    }
+
+    void Archetype::enable_new_row()
+    {
+        size_t row = size() - 1;
+        for (auto& mask : m_enable_masks)
+        {
+            if (mask.bits.size() == 0)
+                continue;
+            if (row / CHUNK_SIZE >= mask.disabled_per_chunk.size())
+                grow_enable_mask(mask);
+            set_bit(mask.bits, row, true);
         }
+    }
 
-        auto maybe_iterator = m_stable_references.to_iterable_collection().find(entity, [](StableEntityID const& stableId, EntityID id)
-            { return stableId.id() == id; });
-        if (!maybe_iterator.is_end())
+    // Mirrors the swap with the last row done by the column buffers
+    void Archetype::remove_enable_row(size_t index, size_t last)
+    {
+        for (auto& mask : m_enable_masks)
         {
-            maybe_iterator->update(0);
-            m_stable_references.remove_at(maybe_iterator.index());
+            if (mask.bits.size() == 0)
+                continue;
+
+            if (!get_bit(mask.bits, index))
+            {
+                mask.disabled--;
+                mask.disabled_per_chunk[index / CHUNK_SIZE]--;
+            }
+            if (index == last)
+            {
+                set_bit(mask.bits, index, false);
+                continue;
+            }
+
+            bool last_enabled = get_bit(mask.bits, last);
+            if (!last_enabled)
+            {
+                mask.disabled_per_chunk[last / CHUNK_SIZE]--;
+                mask.disabled_per_chunk[index / CHUNK_SIZE]++;
+            }
+            set_bit(mask.bits, index, last_enabled);
+            set_bit(mask.bits, last, false);
         }
     }
 
     u8* Archetype::get_component_data(EntityID id, Type const* type)
     {
         ENSURE(GET_ARCHETYPE_ID_FROM_ENTITY_ID(id) == m_id);
-        return m_components
-            .to_iterable_collection()
-            .find(type, [](ChunkedBuffer<u8> const& buffer, Type const* type)
-                { return buffer.type() == type; })
-            ->
-            operator[](GET_INDEX_FROM_ENTITY_ID(id));
+        return m_components[index_of_type(type)][GET_INDEX_FROM_ENTITY_ID(id)];
+    }
+
+    u64 Archetype::compact()
+    {
+        u64 released = m_entities.release_unused_buffers();
+        for (auto& buffer : m_components)
+            released += buffer.release_unused_buffers();
+        return released;
+    }
+
+    u64 Archetype::allocated_bytes() const
+    {
+        u64 bytes = m_entities.allocated_bytes();
+        for (auto const& buffer : m_components)
+            bytes += buffer.allocated_bytes();
+        return bytes;
     }
 
     u64 Archetype::id() const
@@ -116,14 +256,222 @@ namespace vengine
         return m_stable_references;
     }
 
-    size_t Archetype::index_of_type(Type const* type)
+    size_t Archetype::index_of_type(Type const* type) const
     {
-        for (size_t i = 0; i < m_types.size(); ++i)
+        auto column = column_of_type(type);
+        VERIFY(column != INVALID_COLUMN);
+        return column;
+    }
+
+    static u64 hash_bytes(u64 hash, u8 const* data, size_t size)
+    {
+        // FNV-1a
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ data[i]) * 0x100000001b3ull;
+        return hash;
+    }
+
+    ArchetypeManager::~ArchetypeManager()
+    {
+        // Another world may get the same address later
+        MemoryTracker::the().forget_world(this);
+    }
+
+    SharedComponent const* ArchetypeManager::intern_shared_component(Type const* type, u8 const* data)
+    {
+        VERIFY(type->is_trivially_copyable());
+        TypeID type_id = type->id();
+        u64 hash = hash_bytes(hash_bytes(0xcbf29ce484222325ull, (u8 const*)&type_id, sizeof(type_id)), data, type->size());
+
+        auto bucket = m_shared_components_by_hash.get(hash);
+        SharedComponent* head = bucket.has_value() ? bucket.value() : nullptr;
+        for (auto* shared = head; shared != nullptr; shared = shared->next_in_bucket)
+        {
+            if (shared->type == type && __builtin_memcmp(shared->data, data, type->size()) == 0)
+                return shared;
+        }
+
+        Optional<Buffer<u8>> storage = Buffer<u8>::create_uninitialized(type->size(), type->alignment());
+        ENSURE(storage.has_value());
+        u8* copy = storage.value().data();
+        __builtin_memcpy(copy, data, type->size());
+        auto* shared = create<SharedComponent>(SharedComponent { type, copy, hash, std::move(storage.value()), head }).release_nonnull().release();
+        m_shared_components_by_hash.remove(hash);
+        m_shared_components_by_hash.insert(hash, shared);
+        return shared;
+    }
+
+    u64 ArchetypeManager::shared_signature_hash(ComponentList const& component_types, SharedComponentList const& shared_components)
+    {
+        u64 hash = 0xcbf29ce484222325ull;
+        for (Type const* type : component_types)
+        {
+            TypeID id = type->id();
+            hash = hash_bytes(hash, (u8 const*)&id, sizeof(id));
+        }
+        for (auto* shared : shared_components)
+            hash = hash_bytes(hash, (u8 const*)&shared, sizeof(shared));
+        return hash;
+    }
+
+    Archetype* ArchetypeManager::get_or_create_archetype(ComponentList const& component_types, SharedComponentList const& shared_components)
+    {
+        if (shared_components.size() == 0)
+            return get_or_create_archetype(component_types);
+
+        auto bucket = m_shared_archetypes_by_signature.get(shared_signature_hash(component_types, shared_components));
+        for (Archetype* archetype = bucket.has_value() ? bucket.value() : nullptr; archetype != nullptr; archetype = archetype->m_next_in_shared_bucket)
         {
-            if (type == m_types[i])
-                return i;
+            auto const& types = archetype->component_types();
+            auto const& shared = archetype->shared_components();
+            if (types.size() != component_types.size() || shared.size() != shared_components.size())
+                continue;
+
+            bool matches = true;
+            for (size_t i = 0; i < types.size() && matches; ++i)
+                matches = types[i] == component_types[i];
+            for (size_t i = 0; i < shared.size() && matches; ++i)
+                matches = shared[i] == shared_components[i];
+            if (matches)
+                return archetype;
+        }
+
+        return create_archetype(m_next_archetype_id++, component_types, shared_components);
+    }
+
+    void ArchetypeManager::link_shared_archetype(Archetype* archetype)
+    {
+        u64 hash = shared_signature_hash(archetype->component_types(), archetype->shared_components());
+        auto bucket = m_shared_archetypes_by_signature.get(hash);
+        archetype->m_next_in_shared_bucket = bucket.has_value() ? bucket.value() : nullptr;
+        m_shared_archetypes_by_signature.remove(hash);
+        m_shared_archetypes_by_signature.insert(hash, archetype);
+    }
+
+    void ArchetypeManager::unlink_shared_archetype(Archetype* archetype)
+    {
+        u64 hash = shared_signature_hash(archetype->component_types(), archetype->shared_components());
+        auto bucket = m_shared_archetypes_by_signature.get(hash);
+        VERIFY(bucket.has_value());
+        if (bucket.value() == archetype)
+        {
+            m_shared_archetypes_by_signature.remove(hash);
+            if (archetype->m_next_in_shared_bucket != nullptr)
+                m_shared_archetypes_by_signature.insert(hash, archetype->m_next_in_shared_bucket);
+            return;
+        }
+
+        Archetype* previous = bucket.value();
+        while (previous->m_next_in_shared_bucket != archetype)
+            previous = previous->m_next_in_shared_bucket;
+        previous->m_next_in_shared_bucket = archetype->m_next_in_shared_bucket;
+    }
+
+    void ArchetypeManager::release_shared_component(SharedComponent const* shared)
+    {
+        auto* released = const_cast<SharedComponent*>(shared);
+        VERIFY(released->reference_count > 0);
+        if (--released->reference_count > 0)
+            return;
+
+        auto bucket = m_shared_components_by_hash.get(released->hash);
+        VERIFY(bucket.has_value());
+        if (bucket.value() == released)
+        {
+            m_shared_components_by_hash.remove(released->hash);
+            if (released->next_in_bucket != nullptr)
+                m_shared_components_by_hash.insert(released->hash, released->next_in_bucket);
+        }
+        else
+        {
+            SharedComponent* previous = bucket.value();
+            while (previous->next_in_bucket != released)
+                previous = previous->next_in_bucket;
+            previous->next_in_bucket = released->next_in_bucket;
+        }
+        delete released;
+    }
+
+    void ArchetypeManager::retire_archetype(size_t index)
+    {
+        Archetype* archetype = m_archetypes[index];
+        if (archetype->shared_components().size() > 0)
+        {
+            unlink_shared_archetype(archetype);
+            for (auto* shared : archetype->shared_components())
+                release_shared_component(shared);
+        }
+        else
+        {
+            auto* node = m_archetypes_by_components.get_node(archetype->component_types());
+            if (node != nullptr)
+                node->data = {};
+        }
+        m_archetypes_by_id.remove(archetype->id());
+        m_archetypes.remove_at(index);
+        m_generation++;
+        delete archetype;
+    }
+
+    void ArchetypeManager::print_archetype_hierarchy()
+    {
+        if constexpr (LogLevel::Debug >= MinimumLogLevel)
+        {
+            Vector<char> line;
+            auto append = [&](char const* text)
+                {
+                for (; *text != '\0'; ++text)
+                    line.append(*text); };
+            m_archetypes_by_components.debug_print([&](auto& types)
+                {
+                for (auto& type : types)
+                {
+                    append(type->name().data());
+                    append(",");
+                } },
+                [&](auto& archetype)
+                {
+                char address[32];
+                snprintf(address, sizeof(address), "@%p ", (void*)archetype.value_or(nullptr));
+                append(address); });
+            line.append('\0');
+            // The record owns a copy, so the logger thread never reads the line after it is gone
+            char* text = new char[line.size()];
+            __builtin_memcpy(text, line.data(), line.size());
+            log_debug("Archetype hierarchy: %s", OwnedLogString { text });
+        }
+    }
+
+    CompactionResult ArchetypeManager::compact(u64 time_budget_ns)
+    {
+        CompactionResult result;
+        u64 deadline = monotonic_time_ns() + time_budget_ns;
+
+        if (m_compaction_cursor >= m_archetypes.size())
+            m_compaction_cursor = 0;
+
+        while (m_compaction_cursor < m_archetypes.size())
+        {
+            Archetype* archetype = m_archetypes[m_compaction_cursor];
+            if (archetype->size() == 0 && archetype->stable_entity_references().size() == 0)
+            {
+                result.reclaimed_bytes += archetype->allocated_bytes();
+                result.retired_archetypes++;
+                retire_archetype(m_compaction_cursor);
+            }
+            else
+            {
+                result.reclaimed_bytes += archetype->compact();
+                m_compaction_cursor++;
+            }
+
+            if (monotonic_time_ns() >= deadline)
+                break;
         }
 
-        VERIFY_NOT_REACHED();
+        result.finished = m_compaction_cursor >= m_archetypes.size();
+        if (result.reclaimed_bytes > 0)
+            log_debug("Compaction reclaimed %lu bytes and retired %lu archetypes", result.reclaimed_bytes, result.retired_archetypes);
+        return result;
     }
 }
\ No newline at end of file
@@ -24,18 +24,52 @@
 #include "ChunkedBuffer.h"
 #include "Badges.h"
 #include "Types.h"
+#include "Log.h"
 #include <Tree.h>
 #include <Array.h>
 
 namespace vengine
 {
+    // Interned value of a shared component. Entities with equal shared values are grouped into the same archetype,
+    // so the value is stored once per archetype instead of once per entity. Only trivially copyable types can be shared
+    struct SharedComponent
+    {
+        Type const* type;
+        u8 const* data;
+        u64 hash;
+        Buffer<u8> storage;
+        SharedComponent* next_in_bucket;
+        // Archetypes using the value, it is released when the last one retires
+        u64 reference_count { 0 };
+    };
+
+    // Sorted by type id, at most one value per type
+    using SharedComponentList = Vector<SharedComponent const*>;
+
     class Archetype
     {
+        friend class ArchetypeManager;
+
     public:
         static constexpr size_t CHUNK_SIZE = 4094;
+        static constexpr u32 INVALID_COLUMN = -1;
+        static constexpr size_t ENABLE_WORDS_PER_CHUNK = (CHUNK_SIZE + 63) / 64;
+
+        // world is the owning ArchetypeManager, memory is charged to it
+        Archetype(u64 id, Vector<Type const*> const& component_types, SharedComponentList const& shared_components = {}, void const* world = nullptr);
+        bool has_type(Type const* type) const;
+
+        // Returns null if the archetype has no shared value of the type
+        SharedComponent const* shared_component(Type const* type) const;
+
+        template<typename TComponent>
+        TComponent const* shared() const
+        {
+            auto* shared = shared_component(type_of<TComponent>());
+            return shared == nullptr ? nullptr : (TComponent const*)shared->data;
+        }
 
-        explicit Archetype(Vector<Type const*> const& component_types);
-        bool has_type(Type const* type);
+        SharedComponentList const& shared_components() const;
 
     private:
         template<typename TComponent>
@@ -72,6 +106,7 @@ namespace vengine
             EntityID entity = MAKE_ENTITY_ID(m_id, m_entities.size());
             (set_component_data_at_index(m_entities.size(), components), ...);
             m_entities.append(entity);
+            enable_new_row();
             return entity;
         }
 
@@ -81,6 +116,7 @@ namespace vengine
             for (auto [type, data] : components)
                 set_component_data_at_index(m_entities.size(), type, data);
             m_entities.append(entity);
+            enable_new_row();
             return entity;
         }
 
@@ -93,19 +129,118 @@ namespace vengine
             return (T*)m_components[index_of_type(type_of<T>())].get_buffer_data(chunk_index);
         }
 
-        size_t index_of_type(Type const* type);
+        u8* get_column_data(size_t column, size_t index)
+        {
+            return m_components[column][index];
+        }
+
+        // Use when the column has already been resolved with index_of_type, e.g. by a query
+        u8* get_column_buffer(size_t column, size_t chunk_index)
+        {
+            return (u8*)m_components[column].get_buffer_data(chunk_index);
+        }
+
+        // O(1), returns INVALID_COLUMN if the archetype doesn't have the type
+        u32 column_of_type(Type const* type) const
+        {
+            if (type->id() >= m_column_by_type_id.size())
+                return INVALID_COLUMN;
+            return m_column_by_type_id[type->id()];
+        }
+
+        size_t index_of_type(Type const* type) const;
+
+        // Disabled components stay in place, queries skip their rows. Toggling is a bit flip, not an archetype move
+        void set_enabled(EntityID entity, size_t column, bool enabled);
+        bool is_enabled(EntityID entity, size_t column) const;
+
+        // ENABLE_WORDS_PER_CHUNK words with a set bit for every enabled row of the chunk,
+        // or null if every row of the column is enabled
+        u64 const* enabled_bits(size_t column, size_t chunk) const
+        {
+            auto const& mask = m_enable_masks[column];
+            if (mask.disabled == 0)
+                return nullptr;
+            return &mask.bits[chunk * ENABLE_WORDS_PER_CHUNK];
+        }
+
+        u32 disabled_count(size_t column, size_t chunk) const
+        {
+            auto const& mask = m_enable_masks[column];
+            if (mask.disabled == 0)
+                return 0;
+            return mask.disabled_per_chunk[chunk];
+        }
+
+        // Releases the spare chunks kept around by remove_at. Returns the number of bytes released
+        u64 compact();
+        u64 allocated_bytes() const;
 
         u64 id() const;
+        // NUMA node holding the archetype's chunks, CpuTopology::NO_NODE on single node machines
+        u32 numa_node() const
+        {
+            return m_numa_node;
+        }
         size_t size() const;
         Vector<Type const*> const& component_types() const;
         Vector<StableEntityID>& stable_entity_references();
 
+        // Raw column access for serialization
+        ChunkedBuffer<EntityID>& entity_buffer()
+        {
+            return m_entities;
+        }
+
+        ChunkedBuffer<u8>& component_buffer(size_t column)
+        {
+            return m_components[column];
+        }
+
     private:
+        // Allocated on the first disable, until then every row is enabled. Bits past the last row are always clear
+        struct EnableMask
+        {
+            Vector<u64> bits;
+            Vector<u32> disabled_per_chunk;
+            u64 disabled { 0 };
+        };
+
+        static void set_bit(Vector<u64>& bits, size_t row, bool value)
+        {
+            u64& word = bits[row / CHUNK_SIZE * ENABLE_WORDS_PER_CHUNK + row % CHUNK_SIZE / 64];
+            u64 bit = 1ull << (row % CHUNK_SIZE % 64);
+            word = value ? word | bit : word & ~bit;
+        }
+
+        static bool get_bit(Vector<u64> const& bits, size_t row)
+        {
+            return bits[row / CHUNK_SIZE * ENABLE_WORDS_PER_CHUNK + row % CHUNK_SIZE / 64] >> (row % CHUNK_SIZE % 64) & 1;
+        }
+
+        void grow_enable_mask(EnableMask& mask);
+        void enable_new_row();
+        void remove_enable_row(size_t index, size_t last);
+
         u64 m_id;
+        u32 m_numa_node;
         ChunkedBuffer<EntityID> m_entities;
         Vector<StableEntityID> m_stable_references;
         Vector<ChunkedBuffer<u8>> m_components;
         Vector<Type const*> m_types;
+        SharedComponentList m_shared_components;
+        Vector<EnableMask> m_enable_masks;
+        Archetype* m_next_in_shared_bucket { nullptr };
+        // Indexed by TypeID. Type ids are handed out sequentially so this stays small
+        Vector<u32> m_column_by_type_id;
+    };
+
+    struct CompactionResult
+    {
+        u64 reclaimed_bytes { 0 };
+        u64 retired_archetypes { 0 };
+        // False if the time budget ran out before every archetype was visited
+        bool finished { false };
     };
 
     class ArchetypeManager
@@ -116,7 +251,9 @@ namespace vengine
         ArchetypeManager& operator=(ArchetypeManager const&) = delete;
 
         explicit ArchetypeManager(Context& context, detail::ContextBadge) :
-                m_context(context), m_archetypes(), m_archetypes_by_components(), m_archetypes_by_id(16, 64) {};
+                m_context(context), m_archetypes(), m_archetypes_by_components(), m_archetypes_by_id(16, 64), m_shared_archetypes_by_signature(16, 64), m_shared_components_by_hash(16, 64) {};
+
+        ~ArchetypeManager();
 
         Archetype* get_or_create_archetype(ComponentList const& component_types)
         {
@@ -128,14 +265,36 @@ namespace vengine
                     return maybe_archetypes.value();
             }
 
-            auto new_archetype = create<Archetype>(component_types).release_nonnull().release();
-#if DEBUG_ASSERTS == 1
-            print_archetype_hierarchy();
-#endif
-            m_archetypes.append(new_archetype);
-            m_archetypes_by_id.insert(new_archetype->id(), new_archetype);
-            m_archetypes_by_components.insert(component_types, new_archetype);
-            return new_archetype;
+            return create_archetype(m_next_archetype_id++, component_types, {});
+        }
+
+        // Archetypes with shared components are keyed by their component types and the interned shared values
+        Archetype* get_or_create_archetype(ComponentList const& component_types, SharedComponentList const& shared_components);
+
+        // Returns the unique instance equal to the given value, creating it if needed.
+        // Interned values live as long as an archetype uses them, the caller is expected to create or look up one right away
+        SharedComponent const* intern_shared_component(Type const* type, u8 const* data);
+
+        // Used when restoring a world so entity ids stay valid. component_types must be sorted by type id
+        Archetype* create_archetype_with_id(u64 id, ComponentList const& component_types, SharedComponentList const& shared_components = {})
+        {
+            if (id >= m_next_archetype_id)
+                m_next_archetype_id = id + 1;
+            return create_archetype(id, component_types, shared_components);
+        }
+
+        // Destroys every archetype and the entities in them
+        void clear()
+        {
+            while (m_archetypes.size() > 0)
+                retire_archetype(m_archetypes.size() - 1);
+            m_compaction_cursor = 0;
+        }
+
+        // Changes every time an archetype is added or removed. Queries use it to know when to rematch
+        u64 generation() const
+        {
+            return m_generation;
         }
 
         Vector<Archetype*>& archetypes()
@@ -150,19 +309,50 @@ namespace vengine
             return archetype.value();
         }
         
-        void print_archetype_hierarchy()
+        // Releases spare chunks and retires empty archetypes until time_budget_ns runs out.
+        // Resumes from where the previous call stopped. Must not run concurrently with structural changes or tasks,
+        // Context::end_frame runs it between frames
+        CompactionResult compact(u64 time_budget_ns);
+
+        // Logs the archetype tree as a single record and waits until it's written
+        void print_archetype_hierarchy();
+
+    private:
+        Archetype* create_archetype(u64 id, ComponentList const& component_types, SharedComponentList const& shared_components)
         {
-            m_archetypes_by_components.debug_print([](auto& p) {
-                for (auto& ptr : p)
-                    __builtin_printf("%s,", ptr->name().data());
-                },[](auto& opt) { __builtin_printf("@%p", opt.value_or(nullptr)); });
+            auto new_archetype = create<Archetype>(id, component_types, shared_components, this).release_nonnull().release();
+#if DEBUG_ASSERTS == 1
+            print_archetype_hierarchy();
+#endif
+            for (auto* shared : shared_components)
+                const_cast<SharedComponent*>(shared)->reference_count++;
+            m_archetypes.append(new_archetype);
+            m_archetypes_by_id.insert(new_archetype->id(), new_archetype);
+            if (shared_components.size() == 0)
+                m_archetypes_by_components.insert(component_types, new_archetype);
+            else
+                link_shared_archetype(new_archetype);
+            m_generation++;
+            return new_archetype;
         }
 
-    private:
+        static u64 shared_signature_hash(ComponentList const& component_types, SharedComponentList const& shared_components);
+        void link_shared_archetype(Archetype* archetype);
+        void unlink_shared_archetype(Archetype* archetype);
+        void release_shared_component(SharedComponent const* shared);
+        void retire_archetype(size_t index);
+
         Context& m_context;
         Vector<Archetype*> m_archetypes;
         RadixTree<ComponentList::const_iterator, Archetype*> m_archetypes_by_components;
         Hashmap<u32, Archetype*> m_archetypes_by_id;
+        // Collisions are chained through Archetype::m_next_in_shared_bucket and SharedComponent::next_in_bucket
+        Hashmap<u64, Archetype*> m_shared_archetypes_by_signature;
+        Hashmap<u64, SharedComponent*> m_shared_components_by_hash;
+        u64 m_generation { 0 };
+        // Archetype ids are only unique per world, so every ArchetypeManager hands out its own
+        u64 m_next_archetype_id { 1 };
+        size_t m_compaction_cursor { 0 };
     };
 
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AsyncTask.h"
+#include <errno.h>
+
+namespace vengine
+{
+    IoThread& IoThread::the()
+    {
+        // Never destroyed, like the logger thread
+        static IoThread* s_thread = new IoThread();
+        return *s_thread;
+    }
+
+    IoThread::IoThread()
+    {
+        ENSURE(sem_init(&m_pending, 0, 0) == 0);
+        auto thread = Thread::create([this]()
+        { run(); });
+        m_thread = std::move(thread.result());
+    }
+
+    bool IoThread::submit(Function<void>&& request)
+    {
+        {
+            ScopedLock lock(m_mutex);
+            // Counted here so a full queue never depends on what CircularBuffer does when it runs out of room
+            if (m_requests.size() >= QUEUE_CAPACITY)
+                return false;
+            m_requests.enqueue(std::move(request));
+        }
+        sem_post(&m_pending);
+        return true;
+    }
+
+    void IoThread::run()
+    {
+        while (true)
+        {
+            if (sem_wait(&m_pending) != 0)
+            {
+                VERIFY(errno == EINTR);
+                continue;
+            }
+            Optional<Function<void>> request;
+            {
+                ScopedLock lock(m_mutex);
+                request = m_requests.dequeue();
+            }
+            VERIFY(request.has_value());
+            request.value()();
+        }
+    }
+}
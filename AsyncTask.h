@@ -0,0 +1,359 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <Optional.h>
+#include <Atomic.h>
+#include <Function.h>
+#include <CircularBuffer.h>
+#include <Mutex.h>
+#include <Thread.h>
+#include <semaphore.h>
+#include "Tasks.h"
+#include "Log.h"
+#include "Serialization.h"
+
+namespace vengine
+{
+    // Runs blocking calls, mostly file I/O, on a dedicated thread so workers never wait on the disk.
+    // The thread sleeps on a semaphore while there is nothing to do
+    class IoThread
+    {
+    public:
+        static constexpr size_t QUEUE_CAPACITY = 1024;
+
+        static IoThread& the();
+
+        // Returns false without taking the request if QUEUE_CAPACITY requests are already waiting
+        bool submit(Function<void>&& request);
+
+    private:
+        IoThread();
+        void run();
+
+        CircularBuffer<Function<void>> m_requests { QUEUE_CAPACITY };
+        neo::SpinlockMutex m_mutex {};
+        // Posted once per queued request
+        sem_t m_pending;
+        RefPtr<Thread> m_thread;
+    };
+
+    template<typename T = void>
+    class AsyncTask;
+
+    namespace detail
+    {
+        inline void resume_on(WorkQueue& queue, std::coroutine_handle<> handle)
+        {
+            queue.enqueue([handle]()
+                { handle.resume(); });
+        }
+
+        struct AsyncPromiseBase
+        {
+            struct FinalAwaiter
+            {
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                // The owner may destroy the frame as soon as complete is set, so the promise isn't touched afterwards
+                template<typename TPromise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> handle) noexcept
+                {
+                    AsyncPromiseBase& promise = handle.promise();
+                    std::coroutine_handle<> continuation = promise.continuation;
+                    promise.complete.store(true, MemoryOrder::Release);
+                    if (continuation)
+                        return continuation;
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept
+                {
+                }
+            };
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            FinalAwaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void unhandled_exception()
+            {
+                VERIFY_NOT_REACHED();
+            }
+
+            // The awaiting coroutine, resumed on the same thread once this one returns
+            std::coroutine_handle<> continuation;
+            // Where the coroutine is resumed after waiting on a task or on I/O. Inherited from the awaiting coroutine
+            WorkQueue* queue { nullptr };
+            Atomic<bool> complete { false };
+        };
+
+        template<typename T>
+        struct AsyncPromise : AsyncPromiseBase
+        {
+            AsyncTask<T> get_return_object();
+
+            void return_value(T value)
+            {
+                result = std::move(value);
+            }
+
+            Optional<T> result;
+        };
+
+        template<>
+        struct AsyncPromise<void> : AsyncPromiseBase
+        {
+            AsyncTask<void> get_return_object();
+
+            void return_void()
+            {
+            }
+        };
+
+        template<typename TPromise>
+        concept AsyncPromiseType = ConvertibleTo<TPromise*, AsyncPromiseBase*>;
+    }
+
+    // Coroutine running on the WorkManager's workers. It starts suspended: a top level coroutine is started with start()
+    // and polled with is_complete(), and the AsyncTask must outlive it. co_await on another AsyncTask runs it inline and
+    // continues once it returns. co_await run_task(...) or an I/O request suspends without holding a thread, a worker
+    // resumes the coroutine once the result is there.
+    // Suspended coroutines don't hold up Context::end_frame, so they must not keep frame arena memory across an await
+    template<typename T>
+    class AsyncTask
+    {
+    public:
+        using promise_type = detail::AsyncPromise<T>;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        struct Awaiter
+        {
+            Handle handle;
+
+            bool await_ready() const
+            {
+                return false;
+            }
+
+            template<detail::AsyncPromiseType TPromise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> awaiting)
+            {
+                handle.promise().continuation = awaiting;
+                handle.promise().queue = awaiting.promise().queue;
+                return handle;
+            }
+
+            T await_resume()
+            {
+                if constexpr (requires { handle.promise().result; })
+                    return std::move(handle.promise().result.value());
+            }
+        };
+
+        explicit AsyncTask(Handle handle) :
+            m_handle(handle) { }
+
+        AsyncTask(AsyncTask&& other) :
+            m_handle(other.m_handle), m_started(other.m_started)
+        {
+            other.m_handle = nullptr;
+        }
+
+        AsyncTask(AsyncTask const&) = delete;
+        AsyncTask& operator=(AsyncTask const&) = delete;
+
+        ~AsyncTask()
+        {
+            if (!m_handle)
+                return;
+            VERIFY(!m_started || is_complete());
+            m_handle.destroy();
+        }
+
+        // Enqueues the first resume, the coroutine then runs on the workers
+        void start(WorkQueue& queue)
+        {
+            VERIFY(!m_started);
+            m_started = true;
+            m_handle.promise().queue = &queue;
+            detail::resume_on(queue, m_handle);
+        }
+
+        void start(Context& context)
+        {
+            start(context.task_queue());
+        }
+
+        bool is_complete() const
+        {
+            return m_handle.promise().complete.load(MemoryOrder::Acquire);
+        }
+
+        // Only valid once is_complete() returns true
+        auto& result()
+        {
+            return m_handle.promise().result.value();
+        }
+
+        Awaiter operator co_await()
+        {
+            VERIFY(!m_started);
+            m_started = true;
+            return { m_handle };
+        }
+
+    private:
+        Handle m_handle;
+        bool m_started { false };
+    };
+
+    namespace detail
+    {
+        template<typename T>
+        AsyncTask<T> AsyncPromise<T>::get_return_object()
+        {
+            return AsyncTask<T>(AsyncTask<T>::Handle::from_promise(*this));
+        }
+
+        inline AsyncTask<void> AsyncPromise<void>::get_return_object()
+        {
+            return AsyncTask<void>(AsyncTask<void>::Handle::from_promise(*this));
+        }
+    }
+
+    // Submits the task with its dependencies and resumes the awaiting coroutine on a worker once the task completes
+    template<typename TTask>
+    requires ConvertibleTo<TTask*, Task*>
+    class TaskAwaiter
+    {
+    public:
+        TaskAwaiter(TTask& task, Context& context) :
+            m_task(task), m_context(context) { }
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        // The coroutine can be resumed on another worker before submit returns, nothing here runs after it
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            m_handle = handle;
+            m_task.on_complete([](void* user_data)
+                {
+                auto* awaiter = static_cast<TaskAwaiter*>(user_data);
+                detail::resume_on(awaiter->m_context.task_queue(), awaiter->m_handle); }, this);
+            m_task.submit(m_context);
+        }
+
+        void await_resume() const
+        {
+        }
+
+    private:
+        TTask& m_task;
+        Context& m_context;
+        std::coroutine_handle<> m_handle;
+    };
+
+    template<typename TTask>
+    requires ConvertibleTo<TTask*, Task*>
+    TaskAwaiter<TTask> run_task(TTask& task, Context& context)
+    {
+        return TaskAwaiter<TTask>(task, context);
+    }
+
+    // Runs call on the IoThread, the awaiting coroutine is resumed on a worker with its result
+    template<typename TResult, typename TCall>
+    class IoAwaiter
+    {
+    public:
+        explicit IoAwaiter(TCall&& call) :
+            m_call(std::move(call)) { }
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        // With the IoThread's queue full the call runs right here and the coroutine doesn't suspend
+        template<detail::AsyncPromiseType TPromise>
+        bool await_suspend(std::coroutine_handle<TPromise> handle)
+        {
+            WorkQueue* queue = handle.promise().queue;
+            VERIFY(queue != nullptr);
+            bool submitted = IoThread::the().submit([this, queue, handle]()
+                {
+                m_result = m_call();
+                detail::resume_on(*queue, handle); });
+            if (submitted)
+                return true;
+            log_warning("IoThread queue is full, running the call on the worker");
+            m_result = m_call();
+            return false;
+        }
+
+        TResult await_resume()
+        {
+            return std::move(m_result.value());
+        }
+
+    private:
+        TCall m_call;
+        Optional<TResult> m_result;
+    };
+
+    template<typename TCall>
+    auto on_io_thread(TCall call)
+    {
+        return IoAwaiter<decltype(call()), TCall>(std::move(call));
+    }
+
+    struct FileContents
+    {
+        Optional<Buffer<u8>> data;
+        u64 size { 0 };
+    };
+
+    // The path must stay valid until the coroutine resumes
+    inline auto read_file_async(char const* path)
+    {
+        return on_io_thread([path]()
+            {
+            FileContents contents;
+            contents.data = read_file(path, contents.size);
+            return contents; });
+    }
+
+    // The path and the data must stay valid until the coroutine resumes
+    inline auto write_file_async(char const* path, u8 const* data, u64 size)
+    {
+        return on_io_thread([=]()
+            { return write_file(path, data, size); });
+    }
+}
@@ -0,0 +1,359 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <Buffer.h>
+#include <Atomic.h>
+#include <immintrin.h>
+#include "Tasks.h"
+
+namespace vengine
+{
+    // Sweep and prune broadphase over every entity with an enabled TAabb component.
+    // TAabb needs float min_x, min_y, min_z, max_x, max_y and max_z members.
+    // Runs in parallel steps chained by the worker that finishes each one last:
+    //   1. every chunk copies its enabled boxes and their sort keys into a flat array
+    //   2. the boxes are radix sorted by min_x, four passes that each count and scatter in parallel jobs
+    //   3. the jobs copy their range of boxes into sorted structure of arrays
+    //   4. the jobs sweep their range along x and test y and z 8 boxes at a time with AVX2, each writing to its own pair buffer
+    // Finally the job buffers are concatenated in job order into pairs(), so the output is deterministic.
+    // pairs() is valid once is_ready() returns true and until the next submit.
+    template<typename TAabb>
+    class Broadphase : public Task
+    {
+    public:
+        struct Pair
+        {
+            EntityID a;
+            EntityID b;
+        };
+
+        explicit Broadphase(u32 boxes_per_job = 1024) :
+            m_boxes_per_job(boxes_per_job) { }
+
+        void schedule_self(Context& context, WorkQueue& queue) override
+        {
+            m_pairs.clear();
+            m_query.update(context.archetype_manager());
+            // Entities with TAabb disabled don't take part
+            u64 chunk_count = 0;
+            m_count = 0;
+            detail::for_each_chunk(m_query, [&](auto const& match, size_t chunk, u64 rows)
+                {
+                u64 enabled = Query::enabled_row_count(match, chunk, rows);
+                chunk_count += enabled != 0;
+                m_count += enabled; });
+            ensure_capacity(m_count);
+            if (chunk_count == 0)
+            {
+                notify_complete();
+                return;
+            }
+
+            m_pending.store(chunk_count, MemoryOrder::Release);
+            WorkQueue* work_queue = &queue;
+            u64 base_index = 0;
+            detail::for_each_chunk(m_query, [&](auto const& match, size_t chunk, u64 rows)
+                {
+                u64 enabled = Query::enabled_row_count(match, chunk, rows);
+                if (enabled == 0)
+                    return;
+                EntityID const* entities = Query::entities(match, chunk);
+                TAabb const* boxes = Query::template buffer<TAabb>(match, chunk);
+                queue.enqueue([=, this]()
+                    {
+                    u64 index = base_index;
+                    Query::for_each_enabled_row(match, chunk, 0, rows, [&](u64 i)
+                        {
+                        m_unsorted[index] = boxes[i];
+                        m_unsorted_entities[index] = entities[i];
+                        m_keys[index] = sort_key(boxes[i].min_x);
+                        m_order[index] = (u32)index;
+                        index++; });
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        sort_and_sweep(*work_queue); });
+                base_index += enabled; });
+        }
+
+        void component_access(Vector<ComponentAccess>& access) const override
+        {
+            access.append(ComponentAccess { type_of<TAabb>(), true });
+        }
+
+        bool is_ready() const
+        {
+            return is_complete();
+        }
+
+        Vector<Pair> const& pairs() const
+        {
+            return m_pairs;
+        }
+
+    private:
+        // Boxes past the end of the sorted arrays, so 8 wide loads never need a bounds check
+        static constexpr u64 PADDING = 8;
+        static constexpr u32 RADIX = 256;
+
+        // Maps floats to unsigned integers with the same ordering
+        static u32 sort_key(float value)
+        {
+            u32 bits = __builtin_bit_cast(u32, value);
+            return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+        }
+
+        u64 job_count() const
+        {
+            return (m_count + m_boxes_per_job - 1) / m_boxes_per_job;
+        }
+
+        u64 job_end(u64 job) const
+        {
+            return (job + 1) * m_boxes_per_job < m_count ? (job + 1) * m_boxes_per_job : m_count;
+        }
+
+        // Runs job(index) for every job of the sorted range, the worker that finishes last calls next()
+        template<typename TJob, typename TNext>
+        void run_jobs(WorkQueue& queue, TJob job, TNext next)
+        {
+            u64 count = job_count();
+            m_pending.store(count, MemoryOrder::Release);
+            for (u64 index = 0; index < count; ++index)
+            {
+                queue.enqueue([=, this]()
+                    {
+                    job(index);
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        next(); });
+            }
+        }
+
+        // Least significant digit first radix sort by min_x, 8 bits per pass. Every pass counts the digits of each job's
+        // range in parallel, turns the counts into per job offsets, then scatters in parallel. Jobs write to disjoint
+        // slots and keep their order, so the sort is stable and the result doesn't depend on the job count
+        void sort_and_sweep(WorkQueue& queue)
+        {
+            while (m_histograms.size() < job_count() * RADIX)
+                m_histograms.append(0);
+            count_digits(queue, 0);
+        }
+
+        void count_digits(WorkQueue& queue, u32 shift)
+        {
+            WorkQueue* work_queue = &queue;
+            run_jobs(queue, [this, shift](u64 job)
+                {
+                u32* histogram = m_histograms.data() + job * RADIX;
+                __builtin_memset(histogram, 0, RADIX * sizeof(u32));
+                for (u64 i = job * m_boxes_per_job; i < job_end(job); ++i)
+                    histogram[(m_keys[i] >> shift) & 0xff]++; },
+                [this, work_queue, shift]()
+                { scatter_digits(*work_queue, shift); });
+        }
+
+        void scatter_digits(WorkQueue& queue, u32 shift)
+        {
+            // The counts become the first destination of every job and digit: all smaller digits first, then the same digit
+            // of the jobs before
+            u64 jobs = job_count();
+            u32 offset = 0;
+            for (u32 digit = 0; digit < RADIX; ++digit)
+            {
+                for (u64 job = 0; job < jobs; ++job)
+                {
+                    u32 count = m_histograms[job * RADIX + digit];
+                    m_histograms[job * RADIX + digit] = offset;
+                    offset += count;
+                }
+            }
+
+            WorkQueue* work_queue = &queue;
+            run_jobs(queue, [this, shift](u64 job)
+                {
+                u32* offsets = m_histograms.data() + job * RADIX;
+                for (u64 i = job * m_boxes_per_job; i < job_end(job); ++i)
+                {
+                    u32 destination = offsets[(m_keys[i] >> shift) & 0xff]++;
+                    m_keys_swap[destination] = m_keys[i];
+                    m_order_swap[destination] = m_order[i];
+                } },
+                [this, work_queue, shift]()
+                {
+                auto* temporary_keys = m_keys;
+                m_keys = m_keys_swap;
+                m_keys_swap = temporary_keys;
+                auto* temporary_order = m_order;
+                m_order = m_order_swap;
+                m_order_swap = temporary_order;
+                if (shift + 8 < 32)
+                    count_digits(*work_queue, shift + 8);
+                else
+                    lay_out(*work_queue); });
+        }
+
+        // Copies the boxes into sorted structure of arrays, every job its own range
+        void lay_out(WorkQueue& queue)
+        {
+            for (u64 i = m_count; i < m_count + PADDING; ++i)
+            {
+                m_min_x[i] = __builtin_inff();
+                m_max_x[i] = -__builtin_inff();
+                m_min_y[i] = __builtin_inff();
+                m_max_y[i] = -__builtin_inff();
+                m_min_z[i] = __builtin_inff();
+                m_max_z[i] = -__builtin_inff();
+            }
+
+            u64 jobs = job_count();
+            while (m_job_pairs.size() < jobs)
+                m_job_pairs.append(Vector<Pair> {});
+            for (u64 job = 0; job < jobs; ++job)
+                m_job_pairs[job].clear();
+
+            WorkQueue* work_queue = &queue;
+            run_jobs(queue, [this](u64 job)
+                {
+                for (u64 i = job * m_boxes_per_job; i < job_end(job); ++i)
+                {
+                    TAabb const& box = m_unsorted[m_order[i]];
+                    m_min_x[i] = box.min_x;
+                    m_max_x[i] = box.max_x;
+                    m_min_y[i] = box.min_y;
+                    m_max_y[i] = box.max_y;
+                    m_min_z[i] = box.min_z;
+                    m_max_z[i] = box.max_z;
+                    m_entities[i] = m_unsorted_entities[m_order[i]];
+                } },
+                [this, work_queue]()
+                { sweep_all(*work_queue); });
+        }
+
+        void sweep_all(WorkQueue& queue)
+        {
+            run_jobs(queue, [this](u64 job)
+                { sweep(job); },
+                [this]()
+                { gather_pairs(job_count()); });
+        }
+
+        void sweep(u64 job)
+        {
+            Vector<Pair>& out = m_job_pairs[job];
+            u64 end = job_end(job);
+            for (u64 i = job * m_boxes_per_job; i < end; ++i)
+            {
+                __m256 max_x = _mm256_set1_ps(m_max_x[i]);
+                __m256 min_y = _mm256_set1_ps(m_min_y[i]);
+                __m256 max_y = _mm256_set1_ps(m_max_y[i]);
+                __m256 min_z = _mm256_set1_ps(m_min_z[i]);
+                __m256 max_z = _mm256_set1_ps(m_max_z[i]);
+                for (u64 j = i + 1;; j += 8)
+                {
+                    __m256 x_overlap = _mm256_cmp_ps(_mm256_loadu_ps(m_min_x + j), max_x, _CMP_LE_OQ);
+                    __m256 y_overlap = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(m_min_y + j), max_y, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(m_max_y + j), min_y, _CMP_GE_OQ));
+                    __m256 z_overlap = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(m_min_z + j), max_z, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(m_max_z + j), min_z, _CMP_GE_OQ));
+                    u32 x_mask = _mm256_movemask_ps(x_overlap);
+                    u32 mask = _mm256_movemask_ps(_mm256_and_ps(x_overlap, _mm256_and_ps(y_overlap, z_overlap)));
+                    while (mask != 0)
+                    {
+                        u32 lane = __builtin_ctz(mask);
+                        out.append(Pair { m_entities[i], m_entities[j + lane] });
+                        mask &= mask - 1;
+                    }
+                    // Boxes are sorted by min_x, once one starts past max_x so does every box after it
+                    if (x_mask != 0xff)
+                        break;
+                }
+            }
+        }
+
+        void gather_pairs(u64 job_count)
+        {
+            for (u64 job = 0; job < job_count; ++job)
+            {
+                for (auto const& pair : m_job_pairs[job])
+                    m_pairs.append(pair);
+            }
+            notify_complete();
+        }
+
+        template<typename T>
+        static T* allocate(Optional<Buffer<T>>& buffer, u64 count)
+        {
+            buffer = Buffer<T>::create_uninitialized(count, ChunkedBuffer<u8>::DATA_ALIGNMENT);
+            ENSURE(buffer.has_value());
+            return buffer.value().data();
+        }
+
+        void ensure_capacity(u64 count)
+        {
+            if (count <= m_capacity && m_min_x != nullptr)
+                return;
+            u64 capacity = count > 1024 ? count + count / 2 : 1024;
+            m_unsorted = allocate(m_unsorted_buffer, capacity);
+            m_unsorted_entities = allocate(m_unsorted_entities_buffer, capacity);
+            m_entities = allocate(m_entities_buffer, capacity);
+            m_keys = allocate(m_keys_buffer, capacity * 4);
+            m_keys_swap = m_keys + capacity;
+            m_order = m_keys + capacity * 2;
+            m_order_swap = m_keys + capacity * 3;
+            m_min_x = allocate(m_bounds_buffer, (capacity + PADDING) * 6);
+            m_max_x = m_min_x + (capacity + PADDING);
+            m_min_y = m_max_x + (capacity + PADDING);
+            m_max_y = m_min_y + (capacity + PADDING);
+            m_min_z = m_max_y + (capacity + PADDING);
+            m_max_z = m_min_z + (capacity + PADDING);
+            m_capacity = capacity;
+        }
+
+        using Query = detail::ArchetypeQuery<TAabb>;
+        Query m_query;
+        u32 m_boxes_per_job;
+        u64 m_count { 0 };
+        u64 m_capacity { 0 };
+
+        Optional<Buffer<TAabb>> m_unsorted_buffer;
+        Optional<Buffer<EntityID>> m_unsorted_entities_buffer;
+        Optional<Buffer<EntityID>> m_entities_buffer;
+        Optional<Buffer<u32>> m_keys_buffer;
+        Optional<Buffer<float>> m_bounds_buffer;
+
+        // Indexed by query-global entity index, filled by the gather jobs
+        TAabb* m_unsorted { nullptr };
+        EntityID* m_unsorted_entities { nullptr };
+        // Radix sort scratch
+        u32* m_keys { nullptr };
+        u32* m_keys_swap { nullptr };
+        u32* m_order { nullptr };
+        u32* m_order_swap { nullptr };
+        // Sorted by min_x
+        EntityID* m_entities { nullptr };
+        float* m_min_x { nullptr };
+        float* m_max_x { nullptr };
+        float* m_min_y { nullptr };
+        float* m_max_y { nullptr };
+        float* m_min_z { nullptr };
+        float* m_max_z { nullptr };
+
+        // RADIX digit counts per job, turned into scatter offsets in place
+        Vector<u32> m_histograms;
+        Vector<Vector<Pair>> m_job_pairs;
+        Vector<Pair> m_pairs;
+        Atomic<u64> m_pending { 0 };
+    };
+}
@@ -19,6 +19,8 @@
 #include <Vector.h>
 #include <Buffer.h>
 #include "RTTI.h"
+#include "MemoryTracker.h"
+#include "CpuTopology.h"
 
 namespace vengine
 {
@@ -27,14 +29,24 @@ namespace vengine
     {
     public:
         static constexpr size_t DATA_ALIGNMENT = 64;
-        ChunkedBuffer(Type const* type, u64 max_unused_buffers, u64 chunk_size) :
-            m_buffers(), m_type(type), m_max_unused_buffers(max_unused_buffers), m_chunk_size(chunk_size), m_size() { }
+        // Chunks are placed on numa_node when it isn't CpuTopology::NO_NODE
+        ChunkedBuffer(Type const* type, u64 max_unused_buffers, u64 chunk_size, MemoryOwner owner = {}, u32 numa_node = CpuTopology::NO_NODE) :
+            m_chunks(), m_buffers(), m_type(type), m_max_unused_buffers(max_unused_buffers), m_chunk_size(chunk_size), m_size(), m_owner(owner), m_numa_node(numa_node) { }
+        ChunkedBuffer(ChunkedBuffer&& other) :
+            m_chunks(std::move(other.m_chunks)), m_mapped_chunks(other.m_mapped_chunks), m_buffers(std::move(other.m_buffers)), m_type(other.m_type),
+            m_max_unused_buffers(other.m_max_unused_buffers), m_chunk_size(other.m_chunk_size), m_size(other.m_size), m_owner(other.m_owner), m_numa_node(other.m_numa_node)
+        {
+            other.m_mapped_chunks = 0;
+            other.m_size = 0;
+        }
         ~ChunkedBuffer()
         {
+            for (size_t i = 0; i < m_buffers.size(); i++)
+                MemoryTracker::the().record_free(m_owner, chunk_bytes());
         }
         u8* operator[](u64 index)
         {
-            return (u8*)&m_buffers[index / m_chunk_size][(index % m_chunk_size) * m_type->size()];
+            return m_chunks[index / m_chunk_size] + (index % m_chunk_size) * m_type->size();
         }
 
         template<typename K = T>
@@ -55,20 +67,16 @@ namespace vengine
 
             m_type->move_assignment((*this)[m_size - 1], (*this)[index]);
 
-            auto unused_buffers = m_buffers.size() - m_size / m_chunk_size;
+            auto unused_buffers = m_chunks.size() - m_size / m_chunk_size;
             while (unused_buffers-- > m_max_unused_buffers)
-                m_buffers.take_last();
+                release_last_chunk();
             m_size--;
         }
 
         void append(u8 const* data)
         {
-            if (m_size % m_chunk_size == 0)
-            {
-                Optional<Buffer<T>> buffer = Buffer<T>::create_uninitialized(m_chunk_size * m_type->size(), DATA_ALIGNMENT);
-                ENSURE(buffer.has_value());
-                m_buffers.append(std::move(buffer.value()));
-            }
+            if (m_size == m_chunks.size() * m_chunk_size)
+                allocate_chunk();
 
             m_type->move_assignment((void*)data, (*this)[m_size]);
             m_size++;
@@ -77,20 +85,58 @@ namespace vengine
         template<typename K>
         void append(K const& element)
         {
-            if (m_size % m_chunk_size == 0)
-            {
-                Optional<Buffer<T>> buffer = Buffer<T>::create_uninitialized(m_chunk_size * m_type->size(), DATA_ALIGNMENT);
-                ENSURE(buffer.has_value());
-                m_buffers.append(std::move(buffer.value()));
-            }
+            if (m_size == m_chunks.size() * m_chunk_size)
+                allocate_chunk();
 
             at<K>(m_size) = element;
             m_size++;
         }
 
+        // Grows the buffer by count elements without constructing them. The caller fills them in
+        void append_uninitialized(u64 count)
+        {
+            u64 new_size = m_size + count;
+            while (m_chunks.size() * m_chunk_size < new_size)
+                allocate_chunk();
+            m_size = new_size;
+        }
+
+        // Uses memory the buffer doesn't own as its next chunk, e.g. a chunk in a memory mapped save file.
+        // The memory must hold a whole chunk, stay valid for the lifetime of the buffer and be writable.
+        // Mapped chunks can only be added before any owned chunk
+        void append_mapped_chunk(u8* data, u64 rows)
+        {
+            VERIFY(m_chunks.size() == m_mapped_chunks);
+            VERIFY(m_size == m_chunks.size() * m_chunk_size);
+            VERIFY(rows <= m_chunk_size);
+            m_chunks.append(data);
+            m_mapped_chunks++;
+            m_size += rows;
+        }
+
+        // Frees every chunk past the last one in use. Returns the number of bytes released
+        u64 release_unused_buffers()
+        {
+            u64 used_buffers = (m_size + m_chunk_size - 1) / m_chunk_size;
+            u64 released = 0;
+            while (m_chunks.size() > used_buffers)
+            {
+                if (m_chunks.size() > m_mapped_chunks)
+                    released += m_chunk_size * m_type->size();
+                release_last_chunk();
+            }
+            return released;
+        }
+
+        // Mapped chunks aren't counted
+        u64 allocated_bytes() const
+        {
+            return m_buffers.size() * m_chunk_size * m_type->size();
+        }
+
         void* get_buffer_data(size_t chunk_index)
         {
-            return m_buffers[chunk_index].data();
+            return m_chunks[chunk_index];
         }
 
         u64 size() const
@@ -98,16 +144,59 @@ namespace vengine
             return m_size;
         }
 
+        u64 chunk_size() const
+        {
+            return m_chunk_size;
+        }
+
+        u64 chunk_count() const
+        {
+            return m_chunks.size();
+        }
+
         Type const* type() const
         {
             return m_type;
         }
 
     private:
+        u64 chunk_bytes() const
+        {
+            return m_chunk_size * m_type->size();
+        }
+
+        void allocate_chunk()
+        {
+            Optional<Buffer<T>> buffer = Buffer<T>::create_uninitialized(m_chunk_size * m_type->size(), DATA_ALIGNMENT);
+            ENSURE(buffer.has_value());
+            MemoryTracker::the().record_allocation(m_owner, chunk_bytes());
+            if (m_numa_node != CpuTopology::NO_NODE)
+                bind_memory_to_node(buffer.value().data(), chunk_bytes(), m_numa_node);
+            m_buffers.append(std::move(buffer.value()));
+            m_chunks.append((u8*)m_buffers[m_buffers.size() - 1].data());
+        }
+
+        void release_last_chunk()
+        {
+            if (m_chunks.size() > m_mapped_chunks)
+            {
+                m_buffers.take_last();
+                MemoryTracker::the().record_free(m_owner, chunk_bytes());
+            }
+            else
+                m_mapped_chunks--;
+            m_chunks.take_last();
+        }
+
+        // Data of every chunk. The first m_mapped_chunks are external memory, the rest live in m_buffers
+        Vector<u8*> m_chunks;
+        u64 m_mapped_chunks { 0 };
         Vector<Buffer<T>> m_buffers;
         Type const* m_type;
         u64 m_max_unused_buffers;
         u64 m_chunk_size;
         u64 m_size;
+        MemoryOwner m_owner;
+        u32 m_numa_node;
     };
 }
\ No newline at end of file
@@ -0,0 +1,30 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Types.h>
+#include <time.h>
+
+namespace vengine
+{
+    inline u64 monotonic_time_ns()
+    {
+        timespec time {};
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return (u64)time.tv_sec * 1'000'000'000ull + (u64)time.tv_nsec;
+    }
+}
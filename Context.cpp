@@ -19,17 +19,49 @@
 #include "Archetype.h"
 #include "SystemManager.h"
 #include "WorkManager.h"
+#include "FrameArena.h"
 
 namespace vengine
 {
+    static constexpr u64 DEFAULT_COMPACTION_BUDGET_NS = 100'000;
+
     Context::Context(SubsystemData&& subsystems) :  m_entity_manager(create<EntityManager>(*this, detail::ContextBadge {}).release_nonnull()),
                                                             m_system_manager(create<SystemManager>(*this, detail::ContextBadge {}).release_nonnull()),
                                                             m_archetype_manager(create<ArchetypeManager>(*this, detail::ContextBadge {}).release_nonnull()),
-                                                            m_work_manager(create<WorkManager>(*this, detail::ContextBadge {}).release_nonnull()),
+                                                            m_owned_work_manager(create<WorkManager>(1u).release_nonnull()),
+                                                            m_work_manager(&*m_owned_work_manager),
+                                                            m_task_queue(create<WorkQueue>().release_nonnull()),
+                                                            m_frame_arena(create<FrameArena>().release_nonnull()),
+                                                            m_background_budget_ns(WorkQueue::DEFAULT_BACKGROUND_BUDGET_NS),
+                                                            m_compaction_budget_ns(DEFAULT_COMPACTION_BUDGET_NS),
                                                             m_input(std::move(subsystems.input_subsystem)),
                                                             m_window(std::move(subsystems.window_subsystem))
     {
-    
+        m_work_manager->register_queue(&task_queue());
+    }
+
+    Context::Context(SubsystemData&& subsystems, WorkManager& shared_work_manager) :  m_entity_manager(create<EntityManager>(*this, detail::ContextBadge {}).release_nonnull()),
+                                                            m_system_manager(create<SystemManager>(*this, detail::ContextBadge {}).release_nonnull()),
+                                                            m_archetype_manager(create<ArchetypeManager>(*this, detail::ContextBadge {}).release_nonnull()),
+                                                            m_owned_work_manager(),
+                                                            m_work_manager(&shared_work_manager),
+                                                            m_task_queue(create<WorkQueue>().release_nonnull()),
+                                                            m_frame_arena(create<FrameArena>().release_nonnull()),
+                                                            m_background_budget_ns(WorkQueue::DEFAULT_BACKGROUND_BUDGET_NS),
+                                                            m_compaction_budget_ns(DEFAULT_COMPACTION_BUDGET_NS),
+                                                            m_input(std::move(subsystems.input_subsystem)),
+                                                            m_window(std::move(subsystems.window_subsystem))
+    {
+        m_work_manager->register_queue(&task_queue());
+    }
+
+    Context::~Context()
+    {
+        task_queue().wait_until_idle();
+        // Lets the remaining background work finish instead of waiting for budget that never comes
+        task_queue().set_background_budget(-1ull >> 1);
+        task_queue().wait_for_background();
+        m_work_manager->unregister_queue(&task_queue());
     }
     
     EntityManager& Context::entity_manager()
@@ -61,4 +93,45 @@ namespace vengine
     {
         return *m_work_manager;
     }
+
+    WorkQueue& Context::task_queue()
+    {
+        return *m_task_queue;
+    }
+
+    FrameArena& Context::frame_arena()
+    {
+        return *m_frame_arena;
+    }
+
+    void Context::end_frame()
+    {
+        task_queue().wait_until_idle();
+        // No frame task is running and the next frame's structural changes haven't started, so archetypes can be retired
+        // once no background slice is running either
+        u64 compaction_budget = task_queue().background_budget_remaining();
+        if (compaction_budget > m_compaction_budget_ns)
+            compaction_budget = m_compaction_budget_ns;
+        if (compaction_budget > 0)
+        {
+            task_queue().pause_background();
+            u64 start = monotonic_time_ns();
+            archetype_manager().compact(compaction_budget);
+            task_queue().charge_background(monotonic_time_ns() - start);
+            task_queue().resume_background();
+        }
+        m_frame_arena->reset();
+        task_queue().refill_background_budget(m_background_budget_ns);
+    }
+
+    void Context::set_compaction_budget(u64 budget_ns)
+    {
+        m_compaction_budget_ns = budget_ns;
+    }
+
+    void Context::set_background_budget(u64 budget_ns)
+    {
+        m_background_budget_ns = budget_ns;
+        task_queue().set_background_budget(budget_ns);
+    }
 }
\ No newline at end of file
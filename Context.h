@@ -27,23 +27,46 @@ namespace vengine
     class SystemManager;
     class Input;
     class WorkManager;
+    class WorkQueue;
+    class FrameArena;
 
     class Context
     {
     public:
         Context(SubsystemData&& subsystems);
+        // Every Context is an independent world. Pass a WorkManager to share its workers with other worlds
+        Context(SubsystemData&& subsystems, WorkManager& shared_work_manager);
+        ~Context();
         EntityManager& entity_manager();
         SystemManager& system_manager();
         ArchetypeManager& archetype_manager();
         WorkManager& work_manager();
+        WorkQueue& task_queue();
+        // Scratch memory that lives until end_frame
+        FrameArena& frame_arena();
         Input& input();
         Window& window();
+
+        // Waits for the frame's tasks to finish, compacts archetypes, releases the frame arena and refills the background budget.
+        // Background tasks keep running and must not use the frame arena or hold on to archetypes across slices. Compaction
+        // waits for the running slices and holds off new ones while it runs, its time is charged to the background budget
+        void end_frame();
+        // Worker time per frame background tasks may use
+        void set_background_budget(u64 budget_ns);
+        // Time end_frame may spend compacting archetypes, taken out of what is left of the frame's background budget.
+        // 0 disables compaction
+        void set_compaction_budget(u64 budget_ns);
     
     private:
         OwnPtr<EntityManager> m_entity_manager;
         OwnPtr<SystemManager> m_system_manager;
         OwnPtr<ArchetypeManager> m_archetype_manager;
-        OwnPtr<WorkManager> m_work_manager;
+        OwnPtr<WorkManager> m_owned_work_manager;
+        WorkManager* m_work_manager;
+        OwnPtr<WorkQueue> m_task_queue;
+        OwnPtr<FrameArena> m_frame_arena;
+        u64 m_background_budget_ns;
+        u64 m_compaction_budget_ns;
         OwnPtr<Input> m_input;
         OwnPtr<Window> m_window;
     };
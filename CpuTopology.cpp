@@ -0,0 +1,173 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "CpuTopology.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+
+namespace vengine
+{
+    static constexpr u32 MAX_NODES = 64;
+    // From linux/mempolicy.h
+    static constexpr int MPOL_PREFERRED_POLICY = 1;
+    static constexpr unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+
+    static thread_local u32 t_current_node = CpuTopology::NO_NODE;
+
+    // Reads a small sysfs file into buffer, null terminated
+    static bool read_small_file(char const* path, char* buffer, size_t capacity)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        auto length = read(fd, buffer, capacity - 1);
+        close(fd);
+        if (length <= 0)
+            return false;
+        buffer[length] = '\0';
+        return true;
+    }
+
+    // Parses a cpulist like "0-3,8-11"
+    static void parse_cpu_list(char const* text, Vector<u32>& cpus)
+    {
+        while (*text != '\0' && *text != '\n')
+        {
+            u32 first = 0;
+            while (*text >= '0' && *text <= '9')
+                first = first * 10 + (*text++ - '0');
+            u32 last = first;
+            if (*text == '-')
+            {
+                text++;
+                last = 0;
+                while (*text >= '0' && *text <= '9')
+                    last = last * 10 + (*text++ - '0');
+            }
+            for (u32 cpu = first; cpu <= last; ++cpu)
+                cpus.append(cpu);
+            if (*text == ',')
+                text++;
+            else if (*text != '\0' && *text != '\n')
+                return;
+        }
+    }
+
+    CpuTopology const& CpuTopology::the()
+    {
+        static CpuTopology s_topology;
+        return s_topology;
+    }
+
+    CpuTopology::CpuTopology()
+    {
+        char path[64];
+        char buffer[1024];
+        for (u32 node = 0; node < MAX_NODES; ++node)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            if (!read_small_file(path, buffer, sizeof(buffer)))
+                continue;
+            NumaNode numa_node { node, {} };
+            parse_cpu_list(buffer, numa_node.cpus);
+            // Memory-only nodes can't run workers
+            if (numa_node.cpus.size() == 0)
+                continue;
+            m_cpu_count += numa_node.cpus.size();
+            m_nodes.append(std::move(numa_node));
+        }
+
+        if (m_nodes.size() == 0)
+        {
+            NumaNode numa_node { 0, {} };
+            long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+            for (long cpu = 0; cpu < (cpu_count > 0 ? cpu_count : 1); ++cpu)
+                numa_node.cpus.append((u32)cpu);
+            m_cpu_count = numa_node.cpus.size();
+            m_nodes.append(std::move(numa_node));
+        }
+    }
+
+    u32 CpuTopology::node_of_cpu(u32 cpu) const
+    {
+        for (u32 i = 0; i < m_nodes.size(); ++i)
+        {
+            for (u32 node_cpu : m_nodes[i].cpus)
+            {
+                if (node_cpu == cpu)
+                    return i;
+            }
+        }
+        return 0;
+    }
+
+    bool set_current_thread_affinity(Vector<u32> const& cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (u32 cpu : cpus)
+        {
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    bool pin_current_thread_to_node(u32 node)
+    {
+        auto const& topology = CpuTopology::the();
+        VERIFY(node < topology.node_count());
+        if (!set_current_thread_affinity(topology.node(node).cpus))
+            return false;
+        t_current_node = node;
+        return true;
+    }
+
+    bool pin_current_thread_to_cpu(u32 cpu)
+    {
+        Vector<u32> cpus;
+        cpus.append(cpu);
+        if (!set_current_thread_affinity(cpus))
+            return false;
+        t_current_node = CpuTopology::the().node_of_cpu(cpu);
+        return true;
+    }
+
+    u32 current_thread_node()
+    {
+        return t_current_node;
+    }
+
+    bool bind_memory_to_node(void* data, u64 size, u32 node)
+    {
+        auto const& topology = CpuTopology::the();
+        if (topology.node_count() < 2 || node >= topology.node_count())
+            return false;
+
+        u64 page_size = (u64)sysconf(_SC_PAGESIZE);
+        u64 start = ((u64)data + page_size - 1) & ~(page_size - 1);
+        u64 end = ((u64)data + size) & ~(page_size - 1);
+        if (end <= start)
+            return false;
+
+        unsigned long mask = 1ul << topology.node(node).id;
+        return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED_POLICY, &mask, MAX_NODES + 1, MPOL_MF_MOVE_FLAG) == 0;
+    }
+}
@@ -0,0 +1,74 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Types.h>
+#include <Vector.h>
+
+namespace vengine
+{
+    struct NumaNode
+    {
+        u32 id;
+        Vector<u32> cpus;
+    };
+
+    // CPUs grouped by NUMA node, read from sysfs once. Machines without NUMA information report one node with every CPU
+    class CpuTopology
+    {
+    public:
+        static constexpr u32 NO_NODE = -1u;
+
+        static CpuTopology const& the();
+
+        u32 node_count() const
+        {
+            return m_nodes.size();
+        }
+
+        NumaNode const& node(u32 index) const
+        {
+            return m_nodes[index];
+        }
+
+        u32 cpu_count() const
+        {
+            return m_cpu_count;
+        }
+
+        // Index of the node owning cpu, 0 if it's unknown
+        u32 node_of_cpu(u32 cpu) const;
+
+    private:
+        CpuTopology();
+
+        Vector<NumaNode> m_nodes;
+        u32 m_cpu_count { 0 };
+    };
+
+    // Restricts the calling thread to the given CPUs
+    bool set_current_thread_affinity(Vector<u32> const& cpus);
+    // Restricts the calling thread to the CPUs of one node and remembers the node for current_thread_node
+    bool pin_current_thread_to_node(u32 node);
+    bool pin_current_thread_to_cpu(u32 cpu);
+    // Node index the calling thread was pinned to, NO_NODE if it isn't pinned
+    u32 current_thread_node();
+
+    // Asks the kernel to prefer node for the pages fully inside [data, data + size). Pages this process already touched
+    // are migrated, so it's cheapest right after allocating. Does nothing on single node machines
+    bool bind_memory_to_node(void* data, u64 size, u32 node);
+}
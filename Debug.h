@@ -16,8 +16,34 @@
 
 #pragma once
 
+#include <Types.h>
+
 #ifdef VENGINE_DEBUG_MESSAGES
 static constexpr bool DebugMessages = true;
 #else
 static constexpr bool DebugMessages = false;
-#endif
\ No newline at end of file
+#endif
+
+namespace vengine
+{
+    enum class LogLevel : u8
+    {
+        Trace,
+        Debug,
+        Info,
+        Warning,
+        Error,
+        None
+    };
+}
+
+// Records below this level are compiled out. Override with -DVENGINE_LOG_LEVEL=Trace (or Info, Warning, ...)
+#ifndef VENGINE_LOG_LEVEL
+#ifdef VENGINE_DEBUG_MESSAGES
+#define VENGINE_LOG_LEVEL Debug
+#else
+#define VENGINE_LOG_LEVEL Info
+#endif
+#endif
+
+static constexpr vengine::LogLevel MinimumLogLevel = vengine::LogLevel::VENGINE_LOG_LEVEL;
\ No newline at end of file
@@ -0,0 +1,326 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Delta.h"
+#include "Snapshot.h"
+#include "Archetype.h"
+#include <Hashmap.h>
+
+namespace vengine
+{
+    // 64 bit FNV-1a, identifies the baseline a delta was made against
+    static u64 hash_image(u8 const* data, u64 size)
+    {
+        u64 hash = 0xcbf29ce484222325ull;
+        for (u64 i = 0; i < size; ++i)
+        {
+            hash ^= data[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // Byte ranges of one archetype inside a snapshot image
+    struct ArchetypeImage
+    {
+        u64 id;
+        u8 const* signature;
+        u64 signature_size;
+        u64 entity_count;
+        // Entity ids first, then the components in stored order
+        Vector<u8 const*> columns;
+        Vector<u64> column_sizes;
+    };
+
+    static u8 const* skip_column(BinaryReader& reader, Type const* type, u64 count, u64& size)
+    {
+        u8 const* start = reader.position();
+        if (type->is_trivially_copyable())
+        {
+            reader.read_in_place(count * type->size());
+        }
+        else
+        {
+            // Hook serialized rows have no fixed size, the only way to find the end is to read them
+            Optional<Buffer<u8>> scratch = Buffer<u8>::create_uninitialized(type->size(), ChunkedBuffer<u8>::DATA_ALIGNMENT);
+            ENSURE(scratch.has_value());
+            for (u64 i = 0; i < count && !reader.has_error(); ++i)
+            {
+                type->deserialize(reader, scratch.value().data());
+                if (!type->is_trivially_destructible())
+                    type->destructor(scratch.value().data());
+            }
+        }
+        size = reader.position() - start;
+        return start;
+    }
+
+    static bool parse_image(u8 const* data, u64 size, Vector<ArchetypeImage>& archetypes)
+    {
+        BinaryReader reader(data, size);
+        if (reader.read<u32>() != WorldSnapshot::MAGIC || reader.read<u32>() != WorldSnapshot::VERSION)
+            return false;
+
+        u64 archetype_count = reader.read<u64>();
+        for (u64 a = 0; a < archetype_count && !reader.has_error(); ++a)
+        {
+            ArchetypeImage archetype;
+            archetype.id = reader.read<u64>();
+            archetype.signature = reader.position();
+            ComponentList types;
+            if (!detail::read_archetype_signature(reader, types))
+                return false;
+            archetype.signature_size = reader.position() - archetype.signature;
+            archetype.entity_count = reader.read<u64>();
+
+            u64 column_size;
+            archetype.columns.append(skip_column(reader, type_of<EntityID>(), archetype.entity_count, column_size));
+            archetype.column_sizes.append(column_size);
+            for (Type const* type : types)
+            {
+                archetype.columns.append(skip_column(reader, type, archetype.entity_count, column_size));
+                archetype.column_sizes.append(column_size);
+            }
+            archetypes.append(std::move(archetype));
+        }
+        return !reader.has_error();
+    }
+
+    // Encodes current XOR baseline as (zero run, literal run, literal bytes) triplets.
+    // Zero runs never extend past the end of the baseline, the rest of the column is one literal
+    static void encode_column(u8 const* current, u64 current_size, u8 const* baseline, u64 baseline_size, BinaryWriter& writer)
+    {
+        // Short runs of zeros are cheaper to keep inside a literal than to split it
+        static constexpr u64 MIN_ZERO_RUN = 4;
+
+        auto delta_at = [&](u64 i) -> u8
+        { return current[i] ^ (i < baseline_size ? baseline[i] : 0); };
+
+        writer.write_varint(current_size);
+        u64 i = 0;
+        while (i < current_size)
+        {
+            u64 zero_start = i;
+            u64 common = current_size < baseline_size ? current_size : baseline_size;
+            while (i + 8 <= common && __builtin_memcmp(current + i, baseline + i, 8) == 0)
+                i += 8;
+            while (i < common && delta_at(i) == 0)
+                i++;
+            u64 zero_run = i - zero_start;
+
+            u64 literal_start = i;
+            u64 zeros = 0;
+            while (i < current_size && zeros < MIN_ZERO_RUN)
+            {
+                zeros = i < common && delta_at(i) == 0 ? zeros + 1 : 0;
+                i++;
+            }
+            if (zeros == MIN_ZERO_RUN)
+                i -= zeros;
+
+            writer.write_varint(zero_run);
+            writer.write_varint(i - literal_start);
+            u8* literal = writer.allocate(i - literal_start);
+            for (u64 k = literal_start; k < i; ++k)
+                literal[k - literal_start] = delta_at(k);
+        }
+    }
+
+    // Fixed size columns must have exactly expected_size bytes. Every byte past the baseline comes from a literal,
+    // so no column can be larger than the baseline plus what's left of the delta
+    static bool decode_column(BinaryReader& reader, u8 const* baseline, u64 baseline_size, Optional<u64> expected_size, BinaryWriter& writer)
+    {
+        u64 size = reader.read_varint();
+        if (reader.has_error() || size > baseline_size + reader.remaining() || (expected_size.has_value() && size != expected_size.value()))
+            return false;
+
+        u8* out = writer.allocate(size);
+        u64 i = 0;
+        while (i < size && !reader.has_error())
+        {
+            u64 zero_run = reader.read_varint();
+            u64 literal_size = reader.read_varint();
+            if (zero_run > size - i || literal_size > size - i - zero_run || i + zero_run > baseline_size)
+                return false;
+
+            for (u64 end = i + zero_run; i < end; ++i)
+                out[i] = baseline[i];
+
+            u8 const* literal = reader.read_in_place(literal_size);
+            if (literal == nullptr)
+                return false;
+            for (u64 k = 0; k < literal_size; ++k, ++i)
+                out[i] = literal[k] ^ (i < baseline_size ? baseline[i] : 0);
+        }
+        return !reader.has_error();
+    }
+
+    static Hashmap<u64, ArchetypeImage*> index_by_id(Vector<ArchetypeImage>& archetypes)
+    {
+        Hashmap<u64, ArchetypeImage*> index(16, 64);
+        for (auto& archetype : archetypes)
+            index.insert(archetype.id, &archetype);
+        return index;
+    }
+
+    // Only archetypes with the same id and signature are diffed, anything else is diffed against nothing
+    static ArchetypeImage* find_baseline(Hashmap<u64, ArchetypeImage*>& baseline_by_id, ArchetypeImage const& archetype)
+    {
+        auto maybe_baseline = baseline_by_id.get(archetype.id);
+        if (!maybe_baseline.has_value())
+            return nullptr;
+        ArchetypeImage* baseline = maybe_baseline.value();
+        if (baseline->signature_size != archetype.signature_size || __builtin_memcmp(baseline->signature, archetype.signature, archetype.signature_size) != 0)
+            return nullptr;
+        return baseline;
+    }
+
+    bool WorldDelta::write(u8 const* baseline, u64 baseline_size, u8 const* current, u64 current_size, BinaryWriter& writer)
+    {
+        Vector<ArchetypeImage> baseline_archetypes;
+        Vector<ArchetypeImage> current_archetypes;
+        if (!parse_image(baseline, baseline_size, baseline_archetypes) || !parse_image(current, current_size, current_archetypes))
+            return false;
+
+        auto baseline_by_id = index_by_id(baseline_archetypes);
+        auto current_by_id = index_by_id(current_archetypes);
+
+        writer.write(MAGIC);
+        writer.write(VERSION);
+        writer.write<u64>(baseline_size);
+        writer.write<u64>(hash_image(baseline, baseline_size));
+
+        // Structural stream
+        Vector<u64> retired;
+        for (auto const& archetype : baseline_archetypes)
+        {
+            if (!current_by_id.get(archetype.id).has_value())
+                retired.append(archetype.id);
+        }
+        writer.write_varint(retired.size());
+        for (u64 id : retired)
+            writer.write_varint(id);
+
+        writer.write_varint(current_archetypes.size());
+        for (auto const& archetype : current_archetypes)
+        {
+            writer.write_varint(archetype.id);
+            writer.write_varint(archetype.signature_size);
+            writer.write(archetype.signature, archetype.signature_size);
+            writer.write_varint(archetype.entity_count);
+            writer.write_varint(archetype.columns.size());
+        }
+
+        // Data stream
+        for (auto const& archetype : current_archetypes)
+        {
+            ArchetypeImage* base = find_baseline(baseline_by_id, archetype);
+            for (size_t column = 0; column < archetype.columns.size(); ++column)
+            {
+                if (base != nullptr)
+                    encode_column(archetype.columns[column], archetype.column_sizes[column], base->columns[column], base->column_sizes[column], writer);
+                else
+                    encode_column(archetype.columns[column], archetype.column_sizes[column], nullptr, 0, writer);
+            }
+        }
+        return true;
+    }
+
+    bool WorldDelta::write(u8 const* baseline, u64 baseline_size, Context& current, BinaryWriter& writer)
+    {
+        BinaryWriter image;
+        WorldSnapshot::write(current, image);
+        return write(baseline, baseline_size, image.data(), image.size(), writer);
+    }
+
+    bool WorldDelta::apply(u8 const* baseline, u64 baseline_size, BinaryReader& delta, BinaryWriter& image)
+    {
+        Vector<ArchetypeImage> baseline_archetypes;
+        if (!parse_image(baseline, baseline_size, baseline_archetypes))
+            return false;
+        auto baseline_by_id = index_by_id(baseline_archetypes);
+
+        if (delta.read<u32>() != MAGIC || delta.read<u32>() != VERSION || delta.read<u64>() != baseline_size)
+            return false;
+        if (delta.read<u64>() != hash_image(baseline, baseline_size))
+            return false;
+
+        u64 retired_count = delta.read_varint();
+        for (u64 i = 0; i < retired_count && !delta.has_error(); ++i)
+            delta.read_varint();
+
+        // Structural records are small, read them all before streaming the columns
+        Vector<ArchetypeImage> archetypes;
+        u64 archetype_count = delta.read_varint();
+        for (u64 a = 0; a < archetype_count && !delta.has_error(); ++a)
+        {
+            ArchetypeImage archetype;
+            archetype.id = delta.read_varint();
+            archetype.signature_size = delta.read_varint();
+            archetype.signature = delta.read_in_place(archetype.signature_size);
+            archetype.entity_count = delta.read_varint();
+            u64 column_count = delta.read_varint();
+            if (column_count > delta.remaining())
+                return false;
+            for (u64 c = 0; c < column_count; ++c)
+            {
+                archetype.columns.append(nullptr);
+                archetype.column_sizes.append(0);
+            }
+            archetypes.append(std::move(archetype));
+        }
+        if (delta.has_error())
+            return false;
+
+        image.write(WorldSnapshot::MAGIC);
+        image.write(WorldSnapshot::VERSION);
+        image.write<u64>(archetypes.size());
+        for (auto const& archetype : archetypes)
+        {
+            image.write(archetype.id);
+            image.write(archetype.signature, archetype.signature_size);
+            image.write(archetype.entity_count);
+
+            // The signature gives the exact size of every fixed size column
+            ComponentList types;
+            BinaryReader signature(archetype.signature, archetype.signature_size);
+            if (archetype.signature == nullptr || !detail::read_archetype_signature(signature, types) || types.size() + 1 != archetype.columns.size())
+                return false;
+
+            ArchetypeImage* base = find_baseline(baseline_by_id, archetype);
+            if (base != nullptr && base->columns.size() != archetype.columns.size())
+                return false;
+            for (size_t column = 0; column < archetype.columns.size(); ++column)
+            {
+                Type const* type = column == 0 ? type_of<EntityID>() : types[column - 1];
+                Optional<u64> expected_size;
+                if (type->is_trivially_copyable())
+                {
+                    if (type->size() != 0 && archetype.entity_count > (-1ull) / type->size())
+                        return false;
+                    expected_size = archetype.entity_count * type->size();
+                }
+                bool decoded = base != nullptr
+                    ? decode_column(delta, base->columns[column], base->column_sizes[column], expected_size, image)
+                    : decode_column(delta, nullptr, 0, expected_size, image);
+                if (!decoded)
+                    return false;
+            }
+        }
+        return true;
+    }
+}
\ No newline at end of file
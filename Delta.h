@@ -0,0 +1,46 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "Context.h"
+#include "Serialization.h"
+
+namespace vengine
+{
+    // Differences between two WorldSnapshot images.
+    // The delta starts with a structural stream (retired archetype ids, then the id, signature and size of every
+    // archetype in the new state) followed by a data stream with every column XORed against the same column of the
+    // baseline and run length encoded, so unchanged rows cost a couple of bytes per run. Bytes past the end of the
+    // baseline column are always stored as literals, which bounds every decoded column by the delta's own size.
+    // The header carries the size and a hash of the baseline, and applying a delta to the baseline rebuilds the new
+    // image in a single pass over the delta.
+    class WorldDelta
+    {
+    public:
+        static constexpr u32 MAGIC = 0x544c4456; // "VDLT"
+        static constexpr u32 VERSION = 2;
+
+        // Returns false if either image is malformed
+        static bool write(u8 const* baseline, u64 baseline_size, u8 const* current, u64 current_size, BinaryWriter& writer);
+        // Diffs the live world against a baseline image
+        static bool write(u8 const* baseline, u64 baseline_size, Context& current, BinaryWriter& writer);
+
+        // Writes the new image into image. Returns false if the delta is malformed or was made against another baseline
+        static bool apply(u8 const* baseline, u64 baseline_size, BinaryReader& delta, BinaryWriter& image);
+    };
+}
@@ -39,6 +39,7 @@ namespace vengine
     {
         friend class Archetype;
         friend class EntityManager;
+        friend class Hierarchy;
 
     public:
         EntityID id() const
@@ -59,6 +60,15 @@ namespace vengine
             *m_current_id = new_id;
         }
 
+        // Shared by every copy of this reference
+        EntityID const* shared_id() const
+        {
+            return &*m_current_id;
+        }
+
         RefPtr<EntityID> m_current_id;
     };
+
+    // Memory charged for a stable reference, the archetype's list entry plus the shared id it points to
+    static constexpr u64 STABLE_ENTITY_ID_BYTES = sizeof(StableEntityID) + sizeof(EntityID);
 }
\ No newline at end of file
@@ -19,6 +19,15 @@
 vengine::EntityManager::EntityManager(vengine::Context& context, vengine::detail::ContextBadge) :
     m_context(context) { }
 
+vengine::EntityManager::~EntityManager()
+{
+    for (auto& singleton : m_singletons)
+    {
+        if (singleton.data != nullptr)
+            singleton.destroy(singleton.data);
+    }
+}
+
 vengine::StableEntityID vengine::EntityManager::get_stable_entity_reference(vengine::EntityID entity)
 {
     StableEntityID ref(entity);
@@ -26,6 +35,7 @@ vengine::StableEntityID vengine::EntityManager::get_stable_entity_reference(veng
         .get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity))
         ->stable_entity_references()
         .append(ref);
+    MemoryTracker::the().record_allocation({ MemorySubsystem::StableReferences }, STABLE_ENTITY_ID_BYTES);
 
     return ref;
 }
@@ -20,6 +20,7 @@
 #include "RTTI.h"
 #include "Badges.h"
 #include "Context.h"
+#include "Hierarchy.h"
 
 namespace vengine
 {
@@ -27,6 +28,9 @@ namespace vengine
     class EntityManager
     {
     public:
+        // How many entities ahead get_many prefetches component data
+        static constexpr size_t PREFETCH_DISTANCE = 8;
+
         EntityManager() = delete;
         EntityManager& operator=(EntityManager&&) = delete;
         EntityManager& operator=(EntityManager const) = delete;
@@ -35,6 +39,19 @@ namespace vengine
         ;
         StableEntityID get_stable_entity_reference(EntityID entity);
 
+        // Adds the entity to the transform hierarchy, under parent if given. Any entity can be attached: a propagation
+        // task treats a node without its local transform like a disabled one, and propagates the children of a node
+        // without its world transform from that node's parent
+        HierarchyNode attach(EntityID entity, HierarchyNode parent = Hierarchy::NO_PARENT)
+        {
+            return m_hierarchy.add(get_stable_entity_reference(entity), parent);
+        }
+
+        Hierarchy& hierarchy()
+        {
+            return m_hierarchy;
+        }
+
         template<typename... TComponents>
         EntityID create(TComponents const&... components)
         {
@@ -48,12 +65,98 @@ namespace vengine
             return id;
         }
 
+        // A destroyed entity leaves the hierarchy, its children become roots
         void destroy(EntityID entity)
         {
             auto archetype = m_context.archetype_manager().get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+            for (auto const& reference : archetype->stable_entity_references())
+            {
+                if (reference.id() != entity)
+                    continue;
+                auto node = m_hierarchy.node_of(reference);
+                if (node.has_value())
+                    m_hierarchy.remove(node.value());
+            }
             archetype->destroy(entity);
         }
 
+        // The entity must have TComponent, a missing one fails a VERIFY
+        template<typename TComponent>
+        TComponent& get(EntityID entity)
+        {
+            auto* archetype = m_context.archetype_manager().get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+            return *(TComponent*)archetype->get_component_data(entity, type_of<TComponent>());
+        }
+
+        // Disabled components keep their data and archetype, tasks just skip the entity
+        template<typename TComponent>
+        void set_enabled(EntityID entity, bool enabled)
+        {
+            auto* archetype = m_context.archetype_manager().get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+            archetype->set_enabled(entity, archetype->index_of_type(type_of<TComponent>()), enabled);
+        }
+
+        template<typename TComponent>
+        bool is_enabled(EntityID entity)
+        {
+            auto* archetype = m_context.archetype_manager().get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+            return archetype->is_enabled(entity, archetype->index_of_type(type_of<TComponent>()));
+        }
+
+        // Copies the TComponent of every entity into out, in the same order as entities.
+        // Lookups are grouped by archetype and chunk, so each archetype is resolved once per batch,
+        // and component data is prefetched PREFETCH_DISTANCE entities ahead of the loads.
+        // Every entity must have TComponent, a missing one fails a VERIFY
+        template<typename TComponent>
+        void get_many(EntityID const* entities, size_t count, TComponent* out)
+        {
+            Vector<u32> order;
+            get_many(entities, count, out, order);
+        }
+
+        // order is scratch space for the batch, reusing it between calls keeps its capacity
+        template<typename TComponent>
+        void get_many(EntityID const* entities, size_t count, TComponent* out, Vector<u32>& order)
+        {
+            // Loads trail the lookups by PREFETCH_DISTANCE so each one finds its prefetched line
+            Array<TComponent const*, PREFETCH_DISTANCE> pending {};
+            Array<u32, PREFETCH_DISTANCE> pending_index {};
+            size_t resolved = 0;
+            resolve_many<TComponent>(entities, count, order, [&](u32 index, TComponent* source, bool)
+                {
+                VERIFY(source != nullptr);
+                __builtin_prefetch(source);
+                size_t slot = resolved % PREFETCH_DISTANCE;
+                if (resolved >= PREFETCH_DISTANCE)
+                    out[pending_index[slot]] = *pending[slot];
+                pending[slot] = source;
+                pending_index[slot] = index;
+                ++resolved; });
+            size_t first = resolved > PREFETCH_DISTANCE ? resolved - PREFETCH_DISTANCE : 0;
+            for (size_t i = first; i < resolved; ++i)
+                out[pending_index[i % PREFETCH_DISTANCE]] = *pending[i % PREFETCH_DISTANCE];
+        }
+
+        // Same batched lookup as get_many, but hands out pointers to the components so they can be written.
+        // An entity without TComponent gets a null pointer and counts as disabled.
+        // If enabled isn't null it receives whether each entity's TComponent is enabled
+        template<typename TComponent>
+        void get_many_pointers(EntityID const* entities, size_t count, TComponent** out, u8* enabled = nullptr)
+        {
+            Vector<u32> order;
+            get_many_pointers(entities, count, out, enabled, order);
+        }
+
+        template<typename TComponent>
+        void get_many_pointers(EntityID const* entities, size_t count, TComponent** out, u8* enabled, Vector<u32>& order)
+        {
+            resolve_many<TComponent>(entities, count, order, [&](u32 index, TComponent* component, bool is_enabled)
+                {
+                out[index] = component;
+                if (enabled != nullptr)
+                    enabled[index] = is_enabled; });
+        }
+
         template<typename TComponent>
         Optional<EntityID> add_component(EntityID entity, TComponent const& data)
         {
@@ -66,22 +169,164 @@ namespace vengine
             sort(new_component_list, [](Type const* a, Type const* b)
                 { return a->id() < b->id(); });
 
-            auto* new_archetype = m_context.archetype_manager().get_or_create_archetype(new_component_list);
+            auto* new_archetype = m_context.archetype_manager().get_or_create_archetype(new_component_list, archetype->shared_components());
 
             Vector<Tuple<Type const*, u8*>> new_data;
             for (auto const& component_type : archetype->component_types())
                 new_data.append(make_tuple(component_type, archetype->get_component_data(entity, component_type)));
             new_data.append(make_tuple(type_of<TComponent>(), (u8*)&data));
 
+            return move_entity(entity, archetype, new_archetype, new_data);
+        }
+
+        // Entities are grouped by the value of their shared components, which is stored once per archetype
+        template<typename TShared, typename... TComponents>
+        EntityID create_with_shared(TShared const& shared, TComponents const&... components)
+        {
+            auto& archetype_manager = m_context.archetype_manager();
+            Vector<Type const*> component_types { type_of<TComponents>()... };
+            sort(component_types, [](Type const* a, Type const* b)
+                { return a->id() < b->id(); });
+            SharedComponentList shared_components { archetype_manager.intern_shared_component(type_of<TShared>(), (u8 const*)&shared) };
+
+            auto* archetype = archetype_manager.get_or_create_archetype(component_types, shared_components);
+            return archetype->template create(components...);
+        }
+
+        template<typename TShared>
+        TShared const& get_shared(EntityID entity)
+        {
+            auto* archetype = m_context.archetype_manager().get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+            auto* shared = archetype->template shared<TShared>();
+            VERIFY(shared != nullptr);
+            return *shared;
+        }
+
+        // Moves the entity to the archetype of the new value. Returns the new entity id
+        template<typename TShared>
+        EntityID set_shared(EntityID entity, TShared const& value)
+        {
+            auto& archetype_manager = m_context.archetype_manager();
+            auto* archetype = archetype_manager.get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+            auto* shared = archetype_manager.intern_shared_component(type_of<TShared>(), (u8 const*)&value);
+
+            SharedComponentList shared_components;
+            bool inserted = false;
+            for (auto* current : archetype->shared_components())
+            {
+                if (current->type == shared->type)
+                    continue;
+                if (!inserted && current->type->id() > shared->type->id())
+                {
+                    shared_components.append(shared);
+                    inserted = true;
+                }
+                shared_components.append(current);
+            }
+            if (!inserted)
+                shared_components.append(shared);
+
+            auto* new_archetype = archetype_manager.get_or_create_archetype(archetype->component_types(), shared_components);
+            if (new_archetype == archetype)
+                return entity;
+
+            Vector<Tuple<Type const*, u8*>> new_data;
+            for (auto const& component_type : archetype->component_types())
+                new_data.append(make_tuple(component_type, archetype->get_component_data(entity, component_type)));
+            return move_entity(entity, archetype, new_archetype, new_data);
+        }
+
+        // World wide single instance of TSingleton. Setting one is a structural change and must not overlap running tasks,
+        // reading is an indexed load so tasks can use singleton() without locking
+        template<typename TSingleton>
+        void set_singleton(TSingleton const& value)
+        {
+            TypeID id = type_of<TSingleton>()->id();
+            while (m_singletons.size() <= id)
+                m_singletons.append(Singleton {});
+
+            auto& singleton = m_singletons[id];
+            if (singleton.data != nullptr)
+            {
+                *(TSingleton*)singleton.data = value;
+                return;
+            }
+            singleton.data = neo::create<TSingleton>(value).release_nonnull().release();
+            singleton.destroy = [](void* data)
+            { delete (TSingleton*)data; };
+        }
+
+        template<typename TSingleton>
+        bool has_singleton() const
+        {
+            TypeID id = type_of<TSingleton>()->id();
+            return id < m_singletons.size() && m_singletons[id].data != nullptr;
+        }
+
+        template<typename TSingleton>
+        TSingleton& singleton()
+        {
+            VERIFY(has_singleton<TSingleton>());
+            return *(TSingleton*)m_singletons[type_of<TSingleton>()->id()].data;
+        }
+
+        ~EntityManager();
+
+    private:
+        // Calls visit(index, component, enabled) for every entity, grouped by archetype and chunk. index is the
+        // entity's position in entities, component is null and enabled false if the entity has no TComponent
+        template<typename TComponent, typename TVisit>
+        void resolve_many(EntityID const* entities, size_t count, Vector<u32>& order, TVisit&& visit)
+        {
+            order.clear();
+            order.ensure_capacity(count);
+            for (u32 i = 0; i < count; ++i)
+                order.append(i);
+            // The archetype id lives in the upper bits and the index in the lower ones,
+            // so sorting by id groups by archetype first and by chunk second
+            sort(order, [entities](u32 a, u32 b)
+                { return entities[a] < entities[b]; });
+
+            Archetype* archetype = nullptr;
+            u32 column = Archetype::INVALID_COLUMN;
+            for (u32 i : order)
+            {
+                EntityID entity = entities[i];
+                if (archetype == nullptr || archetype->id() != GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity))
+                {
+                    archetype = m_context.archetype_manager().get_archetype_by_id(GET_ARCHETYPE_ID_FROM_ENTITY_ID(entity));
+                    column = archetype->column_of_type(type_of<TComponent>());
+                }
+                if (column == Archetype::INVALID_COLUMN)
+                {
+                    visit(i, nullptr, false);
+                    continue;
+                }
+                visit(i, (TComponent*)archetype->get_column_data(column, GET_INDEX_FROM_ENTITY_ID(entity)), archetype->is_enabled(entity, column));
+            }
+        }
+
+        EntityID move_entity(EntityID entity, Archetype* archetype, Archetype* new_archetype, Vector<Tuple<Type const*, u8*>> const& new_data)
+        {
             auto new_entity_id = new_archetype->template create(new_data);
+            for (size_t column = 0; column < archetype->component_types().size(); ++column)
+            {
+                if (archetype->is_enabled(entity, column))
+                    continue;
+                auto new_column = new_archetype->column_of_type(archetype->component_types()[column]);
+                if (new_column != Archetype::INVALID_COLUMN)
+                    new_archetype->set_enabled(new_entity_id, new_column, false);
+            }
 
-            auto maybe_stable_reference = archetype->stable_entity_references().to_iterable_collection().find(entity, [](StableEntityID const& stableId, EntityID id)
-                { return stableId.id() == id; });
-            if (!maybe_stable_reference.is_end())
+            // Every reference moves along, or destroy would invalidate the ones left behind
+            auto& references = archetype->stable_entity_references();
+            for (size_t i = references.size(); i > 0; --i)
             {
-                maybe_stable_reference->update(new_entity_id);
-                new_archetype->stable_entity_references().append(*maybe_stable_reference);
-                archetype->stable_entity_references().remove_at(maybe_stable_reference.index());
+                if (references[i - 1].id() != entity)
+                    continue;
+                references[i - 1].update(new_entity_id);
+                new_archetype->stable_entity_references().append(references[i - 1]);
+                references.remove_at(i - 1);
             }
 
             archetype->destroy(entity);
@@ -89,7 +334,15 @@ namespace vengine
             return new_entity_id;
         }
 
-    private:
+        struct Singleton
+        {
+            void* data { nullptr };
+            void (*destroy)(void*) { nullptr };
+        };
+
         Context& m_context;
+        Hierarchy m_hierarchy;
+        // Indexed by TypeID
+        Vector<Singleton> m_singletons;
     };
 }
@@ -0,0 +1,161 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "FrameArena.h"
+#include "MemoryTracker.h"
+
+namespace vengine
+{
+    static_assert(FrameArena::MAX_THREADS == 64, "thread slots are tracked in a u64");
+
+    // Shared by every arena, a thread uses the same slot in all of them
+    static Atomic<u64> s_used_thread_slots { 0 };
+
+    struct ThreadSlot
+    {
+        static constexpr u32 SHARED = FrameArena::MAX_THREADS;
+
+        u32 index { SHARED };
+        bool owned { false };
+
+        // Threads without a slot retry on every allocation, one may have been released since
+        u32 acquire()
+        {
+            if (owned)
+                return index;
+            u64 used = s_used_thread_slots.load(MemoryOrder::Relaxed);
+            while (used != ~0ull)
+            {
+                u32 slot = __builtin_ctzll(~used);
+                if (s_used_thread_slots.compare_exchange_strong(used, used | (1ull << slot), MemoryOrder::Acquire))
+                {
+                    index = slot;
+                    owned = true;
+                    break;
+                }
+            }
+            return index;
+        }
+
+        // The next owner keeps bumping where this thread stopped, its allocations stay valid until the next reset
+        ~ThreadSlot()
+        {
+            if (owned)
+                s_used_thread_slots.fetch_and(~(1ull << index), MemoryOrder::Release);
+        }
+    };
+
+    static thread_local ThreadSlot t_thread_slot;
+
+    FrameArena::FrameArena(u64 block_size) :
+        m_block_size(block_size)
+    {
+    }
+
+    FrameArena::~FrameArena()
+    {
+        reset();
+        for (auto& sub_arena : m_sub_arenas)
+        {
+            for (size_t i = 0; i < sub_arena.blocks.size(); i++)
+                MemoryTracker::the().record_free({ MemorySubsystem::FrameArenas }, m_block_size);
+            for (auto& allocation : sub_arena.large_allocations)
+                MemoryTracker::the().record_free({ MemorySubsystem::FrameArenas }, allocation.size());
+        }
+    }
+
+    void FrameArena::rewind(SubArena& sub_arena, u64 generation)
+    {
+        for (auto& allocation : sub_arena.large_allocations)
+            MemoryTracker::the().record_free({ MemorySubsystem::FrameArenas }, allocation.size());
+        sub_arena.large_allocations.clear();
+        sub_arena.block = 0;
+        sub_arena.offset = 0;
+        sub_arena.generation = generation;
+    }
+
+    void* FrameArena::allocate(u64 size, u64 alignment)
+    {
+        VERIFY(alignment <= BLOCK_ALIGNMENT);
+        u32 slot = t_thread_slot.acquire();
+        if (slot != ThreadSlot::SHARED)
+            return allocate(m_sub_arenas[slot], size, alignment);
+        ScopedLock lock(m_shared_mutex);
+        return allocate(m_sub_arenas[slot], size, alignment);
+    }
+
+    void* FrameArena::allocate(SubArena& sub, u64 size, u64 alignment)
+    {
+        u64 generation = m_generation.load(MemoryOrder::Acquire);
+        if (sub.generation != generation)
+            rewind(sub, generation);
+
+        if (size > m_block_size)
+        {
+            Optional<Buffer<u8>> buffer = Buffer<u8>::create_uninitialized(size, BLOCK_ALIGNMENT);
+            ENSURE(buffer.has_value());
+            MemoryTracker::the().record_allocation({ MemorySubsystem::FrameArenas }, size);
+            sub.large_allocations.append(std::move(buffer.value()));
+            return sub.large_allocations[sub.large_allocations.size() - 1].data();
+        }
+
+        u64 offset = (sub.offset + alignment - 1) & ~(alignment - 1);
+        if (sub.block >= sub.blocks.size() || offset + size > m_block_size)
+        {
+            if (sub.block < sub.blocks.size())
+                sub.block++;
+            if (sub.block == sub.blocks.size())
+            {
+                Optional<Buffer<u8>> buffer = Buffer<u8>::create_uninitialized(m_block_size, BLOCK_ALIGNMENT);
+                ENSURE(buffer.has_value());
+                MemoryTracker::the().record_allocation({ MemorySubsystem::FrameArenas }, m_block_size);
+                sub.blocks.append(std::move(buffer.value()));
+            }
+            offset = 0;
+        }
+
+        sub.offset = offset + size;
+        return sub.blocks[sub.block].data() + offset;
+    }
+
+    void FrameArena::add_finalizer(void* object, void (*destroy)(void*))
+    {
+        u32 slot = t_thread_slot.acquire();
+        SubArena& sub = m_sub_arenas[slot];
+        if (slot != ThreadSlot::SHARED)
+        {
+            auto* finalizer = (Finalizer*)allocate(sub, sizeof(Finalizer), alignof(Finalizer));
+            *finalizer = { destroy, object, sub.finalizers };
+            sub.finalizers = finalizer;
+            return;
+        }
+        ScopedLock lock(m_shared_mutex);
+        auto* finalizer = (Finalizer*)allocate(sub, sizeof(Finalizer), alignof(Finalizer));
+        *finalizer = { destroy, object, sub.finalizers };
+        sub.finalizers = finalizer;
+    }
+
+    void FrameArena::reset()
+    {
+        for (auto& sub_arena : m_sub_arenas)
+        {
+            for (auto* finalizer = sub_arena.finalizers; finalizer != nullptr; finalizer = finalizer->next)
+                finalizer->destroy(finalizer->object);
+            sub_arena.finalizers = nullptr;
+        }
+        m_generation.fetch_add(1, MemoryOrder::Release);
+    }
+}
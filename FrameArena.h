@@ -0,0 +1,101 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Types.h>
+#include <Atomic.h>
+#include <Vector.h>
+#include <Buffer.h>
+#include <TypeTraits.h>
+#include <Mutex.h>
+#include <new>
+
+namespace vengine
+{
+    // Linear allocator for memory that only lives until the end of the frame (tasks, scratch arrays, ...).
+    // Every thread bumps its own sub-arena, so allocating from tasks running on workers never takes a lock.
+    // A thread gives its slot back when it exits. Past MAX_THREADS live threads, the extra ones share a locked sub-arena.
+    // reset() releases everything at once: the blocks stay allocated and each sub-arena rewinds the next time its thread
+    // allocates, only objects with a non-trivial destructor are visited. Nothing may be freed individually
+    class FrameArena
+    {
+    public:
+        static constexpr u64 DEFAULT_BLOCK_SIZE = 256 * 1024;
+        static constexpr u64 BLOCK_ALIGNMENT = 64;
+        static constexpr u32 MAX_THREADS = 64;
+
+        explicit FrameArena(u64 block_size = DEFAULT_BLOCK_SIZE);
+        ~FrameArena();
+
+        void* allocate(u64 size, u64 alignment);
+
+        // Uninitialized storage for count elements
+        template<typename T>
+        T* allocate_array(u64 count)
+        {
+            return (T*)allocate(count * sizeof(T), alignof(T));
+        }
+
+        // The destructor runs at reset
+        template<typename T, typename... TArguments>
+        T* create(TArguments&&... arguments)
+        {
+            T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<TArguments>(arguments)...);
+            if constexpr (!neo::IsTriviallyDestructible<T>)
+                add_finalizer(object, [](void* pointer)
+                    { static_cast<T*>(pointer)->~T(); });
+            return object;
+        }
+
+        // Frees everything allocated since the previous reset. Nothing allocated from the arena may still be in use
+        void reset();
+
+        u64 generation() const
+        {
+            return m_generation.load(MemoryOrder::Relaxed);
+        }
+
+    private:
+        struct Finalizer
+        {
+            void (*destroy)(void*);
+            void* object;
+            Finalizer* next;
+        };
+
+        struct alignas(64) SubArena
+        {
+            Vector<Buffer<u8>> blocks;
+            // Allocations bigger than a block, freed when the sub-arena rewinds
+            Vector<Buffer<u8>> large_allocations;
+            size_t block { 0 };
+            u64 offset { 0 };
+            u64 generation { 0 };
+            Finalizer* finalizers { nullptr };
+        };
+
+        void* allocate(SubArena& sub, u64 size, u64 alignment);
+        void rewind(SubArena& sub_arena, u64 generation);
+        void add_finalizer(void* object, void (*destroy)(void*));
+
+        u64 m_block_size;
+        Atomic<u64> m_generation { 0 };
+        // The last one is shared by the threads that didn't get a slot, guarded by m_shared_mutex
+        SubArena m_sub_arenas[MAX_THREADS + 1];
+        neo::SpinlockMutex m_shared_mutex {};
+    };
+}
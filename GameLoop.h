@@ -3,18 +3,33 @@
 #include "Context.h"
 #include "SystemManager.h"
 #include "Input.h"
+#include "Log.h"
+#include "MemoryTracker.h"
 
 namespace vengine
 {
+    enum class InputMode
+    {
+        // Events are pumped at the start of every iteration
+        Synchronous,
+        // Events are pumped and timestamped on a dedicated thread, iterations only drain them
+        Asynchronous
+    };
+
     class MainLoop
     {
     public:
-        static void main_loop(Context& ctx)
+        static void main_loop(Context& ctx, InputMode input_mode = InputMode::Synchronous)
         {
+            if (input_mode == InputMode::Asynchronous && !ctx.input().start_async_polling())
+                log_debug("Input backend can't poll asynchronously, polling every frame instead");
+
             while (true)
             {
                 ctx.input().update_inputs();
                 ctx.system_manager().run();
+                ctx.end_frame();
+                MemoryTracker::the().end_frame();
             }
         }
     };
@@ -0,0 +1,193 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Hierarchy.h"
+
+namespace vengine
+{
+    HierarchyNode Hierarchy::add(StableEntityID entity, HierarchyNode parent)
+    {
+        HierarchyNode node;
+        if (m_free_nodes.size() > 0)
+        {
+            node = m_free_nodes.take_last();
+            m_nodes[node] = Node { entity, NO_PARENT, NO_PARENT, NO_PARENT, true, ++m_version };
+        }
+        else
+        {
+            node = m_nodes.size();
+            m_nodes.append(Node { entity, NO_PARENT, NO_PARENT, NO_PARENT, true, ++m_version });
+        }
+        m_nodes_by_reference.insert(entity.shared_id(), node);
+
+        if (parent != NO_PARENT)
+            link(node, parent);
+        m_levels_dirty = true;
+        return node;
+    }
+
+    void Hierarchy::remove(HierarchyNode node)
+    {
+        VERIFY(m_nodes[node].alive);
+        u64 version = ++m_version;
+        while (m_nodes[node].first_child != NO_PARENT)
+        {
+            HierarchyNode child = m_nodes[node].first_child;
+            unlink(child);
+            m_nodes[child].changed_version = version;
+        }
+        unlink(node);
+        m_nodes_by_reference.remove(m_nodes[node].entity.shared_id());
+        m_nodes[node].alive = false;
+        m_free_nodes.append(node);
+        m_levels_dirty = true;
+    }
+
+    void Hierarchy::set_parent(HierarchyNode node, HierarchyNode parent)
+    {
+        for (HierarchyNode ancestor = parent; ancestor != NO_PARENT; ancestor = m_nodes[ancestor].parent)
+            VERIFY(ancestor != node);
+
+        unlink(node);
+        if (parent != NO_PARENT)
+            link(node, parent);
+        m_nodes[node].changed_version = ++m_version;
+        m_levels_dirty = true;
+    }
+
+    HierarchyNode Hierarchy::parent_of(HierarchyNode node) const
+    {
+        return m_nodes[node].parent;
+    }
+
+    EntityID Hierarchy::entity_of(HierarchyNode node) const
+    {
+        return m_nodes[node].entity.id();
+    }
+
+    Optional<HierarchyNode> Hierarchy::node_of(StableEntityID const& entity)
+    {
+        return m_nodes_by_reference.get(entity.shared_id());
+    }
+
+    void Hierarchy::mark_dirty(HierarchyNode node)
+    {
+        m_nodes[node].changed_version = ++m_version;
+    }
+
+    bool Hierarchy::update_levels()
+    {
+        if (!m_levels_dirty)
+            return false;
+
+        m_level_order.clear();
+        m_parent_positions.clear();
+        m_level_starts.clear();
+
+        // Breadth first from every root, so each level ends up contiguous after the previous one
+        m_level_starts.append(0);
+        for (HierarchyNode node = 0; node < m_nodes.size(); ++node)
+        {
+            if (m_nodes[node].alive && m_nodes[node].parent == NO_PARENT)
+            {
+                m_level_order.append(node);
+                m_parent_positions.append(NO_PARENT);
+            }
+        }
+
+        u32 level_begin = 0;
+        while (level_begin < m_level_order.size())
+        {
+            u32 level_end = m_level_order.size();
+            m_level_starts.append(level_end);
+            for (u32 position = level_begin; position < level_end; ++position)
+            {
+                for_each_child(m_level_order[position], [&](HierarchyNode child)
+                    {
+                    m_level_order.append(child);
+                    m_parent_positions.append(position); });
+            }
+            level_begin = level_end;
+        }
+
+        // Positions moved, so every consumer has to redo everything
+        u64 version = ++m_version;
+        for (auto& node : m_nodes)
+            node.changed_version = version;
+        m_levels_dirty = false;
+        return true;
+    }
+
+    Vector<HierarchyNode> const& Hierarchy::level_order() const
+    {
+        return m_level_order;
+    }
+
+    Vector<u32> const& Hierarchy::parent_positions() const
+    {
+        return m_parent_positions;
+    }
+
+    u32 Hierarchy::level_count() const
+    {
+        return m_level_starts.size() - 1;
+    }
+
+    u32 Hierarchy::level_start(u32 level) const
+    {
+        return m_level_starts[level];
+    }
+
+    u64 Hierarchy::version() const
+    {
+        return m_version;
+    }
+
+    bool Hierarchy::is_dirty(HierarchyNode node, u64 since_version) const
+    {
+        return m_nodes[node].changed_version > since_version;
+    }
+
+    void Hierarchy::link(HierarchyNode node, HierarchyNode parent)
+    {
+        VERIFY(m_nodes[parent].alive);
+        m_nodes[node].parent = parent;
+        m_nodes[node].next_sibling = m_nodes[parent].first_child;
+        m_nodes[parent].first_child = node;
+    }
+
+    void Hierarchy::unlink(HierarchyNode node)
+    {
+        HierarchyNode parent = m_nodes[node].parent;
+        if (parent == NO_PARENT)
+            return;
+
+        if (m_nodes[parent].first_child == node)
+        {
+            m_nodes[parent].first_child = m_nodes[node].next_sibling;
+        }
+        else
+        {
+            HierarchyNode sibling = m_nodes[parent].first_child;
+            while (m_nodes[sibling].next_sibling != node)
+                sibling = m_nodes[sibling].next_sibling;
+            m_nodes[sibling].next_sibling = m_nodes[node].next_sibling;
+        }
+        m_nodes[node].parent = NO_PARENT;
+        m_nodes[node].next_sibling = NO_PARENT;
+    }
+}
\ No newline at end of file
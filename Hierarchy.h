@@ -0,0 +1,102 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <Vector.h>
+#include <Hashmap.h>
+#include <Optional.h>
+#include "Entity.h"
+
+namespace vengine
+{
+    using HierarchyNode = u32;
+
+    // Parent/child relationships between entities. Entity ids change when entities move between archetypes,
+    // so nodes hold stable references and are addressed by HierarchyNode handles instead.
+    // The hierarchy keeps its nodes in breadth first order, which groups them by depth: every node in a level only
+    // depends on nodes of the previous level, so a level can be processed in parallel over a contiguous range.
+    // Changes are tracked with a version counter instead of a flag, so several consumers can each ask what changed
+    // since they last looked without consuming each other's changes.
+    class Hierarchy
+    {
+    public:
+        static constexpr HierarchyNode NO_PARENT = -1;
+
+        Hierarchy() :
+            m_nodes_by_reference(16, 64) {};
+
+        HierarchyNode add(StableEntityID entity, HierarchyNode parent = NO_PARENT);
+        // Children of a removed node become roots
+        void remove(HierarchyNode node);
+        void set_parent(HierarchyNode node, HierarchyNode parent);
+
+        HierarchyNode parent_of(HierarchyNode node) const;
+        EntityID entity_of(HierarchyNode node) const;
+        // The node added for this reference or a copy of it
+        Optional<HierarchyNode> node_of(StableEntityID const& entity);
+
+        template<typename TCallback>
+        void for_each_child(HierarchyNode node, TCallback&& callback) const
+        {
+            for (HierarchyNode child = m_nodes[node].first_child; child != NO_PARENT; child = m_nodes[child].next_sibling)
+                callback(child);
+        }
+
+        // Flags the node, and therefore its subtree, as changed
+        void mark_dirty(HierarchyNode node);
+
+        // Recomputes the level order if the structure changed. Returns true if it did, in which case every node is dirty
+        bool update_levels();
+
+        // Increases with every change. A consumer remembers the version it last processed and passes it to is_dirty
+        u64 version() const;
+        // True if the node changed after the given version
+        bool is_dirty(HierarchyNode node, u64 since_version) const;
+
+        // Nodes sorted by depth. Level d spans [level_start(d), level_start(d + 1))
+        Vector<HierarchyNode> const& level_order() const;
+        // Position in level_order() of the parent of the node at the given position, or NO_PARENT for roots
+        Vector<u32> const& parent_positions() const;
+        u32 level_count() const;
+        u32 level_start(u32 level) const;
+
+    private:
+        struct Node
+        {
+            StableEntityID entity;
+            HierarchyNode parent;
+            HierarchyNode first_child;
+            HierarchyNode next_sibling;
+            bool alive;
+            // Version of the last change to the node
+            u64 changed_version;
+        };
+
+        void link(HierarchyNode node, HierarchyNode parent);
+        void unlink(HierarchyNode node);
+
+        Vector<Node> m_nodes;
+        Vector<HierarchyNode> m_free_nodes;
+        Vector<HierarchyNode> m_level_order;
+        Vector<u32> m_parent_positions;
+        Vector<u32> m_level_starts;
+        Hashmap<EntityID const*, HierarchyNode> m_nodes_by_reference;
+        u64 m_version { 0 };
+        bool m_levels_dirty { false };
+    };
+}
@@ -19,6 +19,7 @@
 #include <Types.h>
 #include <Mutex.h>
 #include <String.h>
+#include <Vector.h>
 #undef NEO_DO_NOT_DEFINE_STD
 
 namespace vengine
@@ -83,7 +84,8 @@ namespace vengine
             KeyW,
             KeyX,
             KeyY,
-            KeyZ
+            KeyZ,
+            Count
         };
     
         enum class KeyboardScancode
@@ -123,13 +125,157 @@ namespace vengine
             KeyW,
             KeyX,
             KeyY,
-            KeyZ
+            KeyZ,
+            Count
         };
         
         struct KeyboardEvent
         {
         
         };
+
+        // A keyboard event and the time it was pumped, for code that wants sub-frame timing
+        struct InputEvent
+        {
+            static constexpr u8 NO_KEY = 0xff;
+
+            u64 timestamp_ns;
+            u16 modifiers;
+            // KeyboardKey and KeyboardScancode values, NO_KEY if the backend has no mapping for the event
+            u8 key;
+            u8 scancode;
+            bool down;
+            bool repeat;
+        };
+
+        // None matches any modifier state. The Any* groups match if either side is held, other flags must all be held
+        inline bool modifiers_match(KeyboardModifiers required, u16 held)
+        {
+            u16 bits = static_cast<u16>(required);
+            if (bits == static_cast<u16>(KeyboardModifiers::None))
+                return true;
+
+            u16 groups[] = {
+                static_cast<u16>(KeyboardModifiers::AnyShift),
+                static_cast<u16>(KeyboardModifiers::AnyControl),
+                static_cast<u16>(KeyboardModifiers::AnyAlt),
+                static_cast<u16>(KeyboardModifiers::AnyCommand),
+            };
+            for (u16 group : groups)
+            {
+                u16 wanted = bits & group;
+                if (wanted == group)
+                {
+                    if ((held & group) == 0)
+                        return false;
+                    bits &= ~group;
+                }
+            }
+            return (held & bits) == bits;
+        }
+
+        // One frame of keyboard state with a bit per key and scancode, so queries are a single bit test
+        struct KeyboardState
+        {
+            static constexpr size_t KEY_WORDS = (static_cast<size_t>(KeyboardKey::Count) + 63) / 64;
+            static constexpr size_t SCANCODE_WORDS = (static_cast<size_t>(KeyboardScancode::Count) + 63) / 64;
+
+            u64 held_keys[KEY_WORDS] {};
+            u64 pressed_keys[KEY_WORDS] {};
+            u64 released_keys[KEY_WORDS] {};
+            u64 held_scancodes[SCANCODE_WORDS] {};
+            u64 pressed_scancodes[SCANCODE_WORDS] {};
+            u64 released_scancodes[SCANCODE_WORDS] {};
+            u16 modifiers { 0 };
+
+            static bool test(u64 const* bits, size_t index)
+            {
+                return bits[index / 64] >> (index % 64) & 1;
+            }
+
+            static void set(u64* bits, size_t index, bool value)
+            {
+                u64 bit = 1ull << (index % 64);
+                bits[index / 64] = value ? bits[index / 64] | bit : bits[index / 64] & ~bit;
+            }
+
+            // Held state carries over, pressed and released only last one frame
+            void begin_frame(KeyboardState const& previous)
+            {
+                for (size_t i = 0; i < KEY_WORDS; ++i)
+                {
+                    held_keys[i] = previous.held_keys[i];
+                    pressed_keys[i] = 0;
+                    released_keys[i] = 0;
+                }
+                for (size_t i = 0; i < SCANCODE_WORDS; ++i)
+                {
+                    held_scancodes[i] = previous.held_scancodes[i];
+                    pressed_scancodes[i] = 0;
+                    released_scancodes[i] = 0;
+                }
+                modifiers = previous.modifiers;
+            }
+
+            void apply(InputEvent const& event)
+            {
+                if (event.key != InputEvent::NO_KEY)
+                    key_event(static_cast<KeyboardKey>(event.key), event.down, event.repeat);
+                if (event.scancode != InputEvent::NO_KEY)
+                    scancode_event(static_cast<KeyboardScancode>(event.scancode), event.down, event.repeat);
+                modifiers = event.modifiers;
+            }
+
+            void key_event(KeyboardKey key, bool down, bool repeat)
+            {
+                size_t index = static_cast<size_t>(key);
+                if (down && !repeat)
+                    set(pressed_keys, index, true);
+                if (!down)
+                    set(released_keys, index, true);
+                set(held_keys, index, down);
+            }
+
+            void scancode_event(KeyboardScancode scancode, bool down, bool repeat)
+            {
+                size_t index = static_cast<size_t>(scancode);
+                if (down && !repeat)
+                    set(pressed_scancodes, index, true);
+                if (!down)
+                    set(released_scancodes, index, true);
+                set(held_scancodes, index, down);
+            }
+
+            bool key_down(KeyboardKey key, KeyboardModifiers required) const
+            {
+                return test(pressed_keys, static_cast<size_t>(key)) && modifiers_match(required, modifiers);
+            }
+
+            bool key_up(KeyboardKey key, KeyboardModifiers required) const
+            {
+                return test(released_keys, static_cast<size_t>(key)) && modifiers_match(required, modifiers);
+            }
+
+            bool key(KeyboardKey key, KeyboardModifiers required) const
+            {
+                return test(held_keys, static_cast<size_t>(key)) && modifiers_match(required, modifiers);
+            }
+
+            bool physical_key_down(KeyboardScancode scancode, KeyboardModifiers required) const
+            {
+                return test(pressed_scancodes, static_cast<size_t>(scancode)) && modifiers_match(required, modifiers);
+            }
+
+            bool physical_key_up(KeyboardScancode scancode, KeyboardModifiers required) const
+            {
+                return test(released_scancodes, static_cast<size_t>(scancode)) && modifiers_match(required, modifiers);
+            }
+
+            bool physical_key(KeyboardScancode scancode, KeyboardModifiers required) const
+            {
+                return test(held_scancodes, static_cast<size_t>(scancode)) && modifiers_match(required, modifiers);
+            }
+        };
     }
     
     using namespace input;
@@ -137,17 +283,59 @@ namespace vengine
     class Input
     {
         friend class MainLoop;
+        friend class InputRecorder;
     private:
         virtual void update_inputs() = 0;
     public:
         virtual ~Input() = default;
         
-        virtual bool get_key_down(KeyboardKey key, KeyboardModifiers modifiers) = 0;
-        virtual bool get_key_up(KeyboardKey key, KeyboardModifiers modifiers) = 0;
-        virtual bool get_key(KeyboardKey key, KeyboardModifiers modifiers) = 0;
-        virtual bool get_physical_key_down(KeyboardScancode scancode, KeyboardModifiers modifiers) = 0;
-        virtual bool get_physical_key_up(KeyboardScancode scancode, KeyboardModifiers modifiers) =  0;
-        virtual bool get_physical_key(KeyboardScancode scancode, KeyboardModifiers modifiers) = 0;
+        // State collected by the last update_inputs. Implementations must keep it readable from worker tasks
+        virtual KeyboardState const& keyboard_state() const = 0;
+
+        // Events folded into the last update_inputs, oldest first. Empty for backends without timestamps
+        virtual Vector<InputEvent> const& frame_events() const
+        {
+            static Vector<InputEvent> const no_events;
+            return no_events;
+        }
+
+        // Moves event pumping to a dedicated thread and makes update_inputs only drain what it collected.
+        // Returns false if the backend can't do that
+        virtual bool start_async_polling()
+        {
+            return false;
+        }
+
+        virtual bool get_key_down(KeyboardKey key, KeyboardModifiers modifiers)
+        {
+            return keyboard_state().key_down(key, modifiers);
+        }
+
+        virtual bool get_key_up(KeyboardKey key, KeyboardModifiers modifiers)
+        {
+            return keyboard_state().key_up(key, modifiers);
+        }
+
+        virtual bool get_key(KeyboardKey key, KeyboardModifiers modifiers)
+        {
+            return keyboard_state().key(key, modifiers);
+        }
+
+        virtual bool get_physical_key_down(KeyboardScancode scancode, KeyboardModifiers modifiers)
+        {
+            return keyboard_state().physical_key_down(scancode, modifiers);
+        }
+
+        virtual bool get_physical_key_up(KeyboardScancode scancode, KeyboardModifiers modifiers)
+        {
+            return keyboard_state().physical_key_up(scancode, modifiers);
+        }
+
+        virtual bool get_physical_key(KeyboardScancode scancode, KeyboardModifiers modifiers)
+        {
+            return keyboard_state().physical_key(scancode, modifiers);
+        }
+
         virtual String get_key_name(KeyboardKey key) = 0;
         virtual String get_scancode_name(KeyboardScancode scancode) = 0;
     
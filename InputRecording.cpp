@@ -0,0 +1,252 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "InputRecording.h"
+
+namespace vengine
+{
+    static constexpr size_t STATE_WORD_COUNT = KeyboardState::KEY_WORDS * 3 + KeyboardState::SCANCODE_WORDS * 3 + 1;
+    static_assert(STATE_WORD_COUNT <= 64, "The changed word mask is a single u64");
+
+    static void pack_state(KeyboardState const& state, u64* words)
+    {
+        auto append = [&](u64 const* source, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                *words++ = source[i];
+        };
+        append(state.held_keys, KeyboardState::KEY_WORDS);
+        append(state.pressed_keys, KeyboardState::KEY_WORDS);
+        append(state.released_keys, KeyboardState::KEY_WORDS);
+        append(state.held_scancodes, KeyboardState::SCANCODE_WORDS);
+        append(state.pressed_scancodes, KeyboardState::SCANCODE_WORDS);
+        append(state.released_scancodes, KeyboardState::SCANCODE_WORDS);
+        *words = state.modifiers;
+    }
+
+    static void unpack_state(u64 const* words, KeyboardState& state)
+    {
+        auto extract = [&](u64* target, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                target[i] = *words++;
+        };
+        extract(state.held_keys, KeyboardState::KEY_WORDS);
+        extract(state.pressed_keys, KeyboardState::KEY_WORDS);
+        extract(state.released_keys, KeyboardState::KEY_WORDS);
+        extract(state.held_scancodes, KeyboardState::SCANCODE_WORDS);
+        extract(state.pressed_scancodes, KeyboardState::SCANCODE_WORDS);
+        extract(state.released_scancodes, KeyboardState::SCANCODE_WORDS);
+        state.modifiers = *words;
+    }
+
+    void detail::write_input_frame(KeyboardState const& previous, KeyboardState const& current, BinaryWriter& writer)
+    {
+        u64 previous_words[STATE_WORD_COUNT];
+        u64 current_words[STATE_WORD_COUNT];
+        pack_state(previous, previous_words);
+        pack_state(current, current_words);
+
+        u64 changed = 0;
+        for (size_t i = 0; i < STATE_WORD_COUNT; ++i)
+        {
+            if (previous_words[i] != current_words[i])
+                changed |= 1ull << i;
+        }
+        writer.write_varint(changed);
+        for (size_t i = 0; i < STATE_WORD_COUNT; ++i)
+        {
+            if (changed & (1ull << i))
+                writer.write_varint(current_words[i]);
+        }
+    }
+
+    bool detail::read_input_frame(BinaryReader& reader, KeyboardState& state)
+    {
+        u64 words[STATE_WORD_COUNT];
+        pack_state(state, words);
+        u64 changed = reader.read_varint();
+        for (size_t i = 0; i < STATE_WORD_COUNT && !reader.has_error(); ++i)
+        {
+            if (changed & (1ull << i))
+                words[i] = reader.read_varint();
+        }
+        if (reader.has_error() || changed >> STATE_WORD_COUNT != 0)
+            return false;
+        unpack_state(words, state);
+        return true;
+    }
+
+    // Key names are the same on every backend for now, which keeps replays independent of SDL
+    static String default_key_name(u32 index)
+    {
+        char name[2] = { static_cast<char>(index < 10 ? '0' + index : 'A' + index - 10), 0 };
+        return String { name };
+    }
+
+    static void write_log_header(BinaryWriter& writer)
+    {
+        writer.write(InputRecorder::MAGIC);
+        writer.write(InputRecorder::VERSION);
+        // Logs are only valid for the enum layout they were recorded with
+        writer.write<u32>(static_cast<u32>(KeyboardKey::Count));
+        writer.write<u32>(static_cast<u32>(KeyboardScancode::Count));
+    }
+
+    InputRecorder::InputRecorder(OwnPtr<Input>&& source) :
+        m_source(std::move(source))
+    {
+        m_input = m_source.leak_ptr();
+        write_log_header(m_log);
+    }
+
+    void InputRecorder::update_inputs()
+    {
+        m_input->update_inputs();
+        KeyboardState const& state = m_input->keyboard_state();
+        detail::write_input_frame(m_previous, state, m_log);
+        m_previous = state;
+        m_frame_count++;
+    }
+
+    KeyboardState const& InputRecorder::keyboard_state() const
+    {
+        return m_input->keyboard_state();
+    }
+
+    Vector<InputEvent> const& InputRecorder::frame_events() const
+    {
+        return m_input->frame_events();
+    }
+
+    bool InputRecorder::start_async_polling()
+    {
+        return m_input->start_async_polling();
+    }
+
+    String InputRecorder::get_key_name(KeyboardKey key)
+    {
+        return m_input->get_key_name(key);
+    }
+
+    String InputRecorder::get_scancode_name(KeyboardScancode scancode)
+    {
+        return m_input->get_scancode_name(scancode);
+    }
+
+    BinaryWriter& InputRecorder::log()
+    {
+        return m_log;
+    }
+
+    u64 InputRecorder::frame_count() const
+    {
+        return m_frame_count;
+    }
+
+    bool InputRecorder::write_to_file(char const* path)
+    {
+        return write_file(path, m_log.data(), m_log.size());
+    }
+
+    InputReplay::InputReplay(Buffer<u8>&& log, u64 size) :
+        m_log(std::move(log)), m_size(size)
+    {
+        m_data = m_log.data();
+    }
+
+    ResultOrError<OwnPtr<InputReplay>, String> InputReplay::load(char const* path)
+    {
+        u64 size = 0;
+        auto maybe_log = read_file(path, size);
+        if (!maybe_log.has_value())
+            return "Couldn't read input log"_s;
+        return validate(neo::create<InputReplay>(std::move(maybe_log.value()), size));
+    }
+
+    ResultOrError<OwnPtr<InputReplay>, String> InputReplay::create(u8 const* log, u64 size)
+    {
+        Optional<Buffer<u8>> copy = Buffer<u8>::create_uninitialized(size > 0 ? size : 1, 16);
+        if (!copy.has_value())
+            return "Couldn't allocate input log"_s;
+        __builtin_memcpy(copy.value().data(), log, size);
+        return validate(neo::create<InputReplay>(std::move(copy.value()), size));
+    }
+
+    ResultOrError<OwnPtr<InputReplay>, String> InputReplay::validate(OwnPtr<InputReplay>&& replay)
+    {
+        if (!replay.leak_ptr())
+            return "Couldn't allocate input replay"_s;
+
+        BinaryReader reader(replay->m_data, replay->m_size);
+        if (reader.read<u32>() != InputRecorder::MAGIC || reader.read<u32>() != InputRecorder::VERSION)
+            return "Not an input log or unsupported version"_s;
+        if (reader.read<u32>() != static_cast<u32>(KeyboardKey::Count) || reader.read<u32>() != static_cast<u32>(KeyboardScancode::Count))
+            return "Input log was recorded with a different key layout"_s;
+        if (reader.has_error())
+            return "Truncated input log"_s;
+
+        replay->m_offset = reader.offset();
+        return replay.release_nonnull();
+    }
+
+    void InputReplay::update_inputs()
+    {
+        u32 next_index = 1 - m_current_state.load(MemoryOrder::Relaxed);
+        KeyboardState& next = m_states[next_index];
+        next = m_states[1 - next_index];
+
+        BinaryReader reader(m_data + m_offset, m_size - m_offset);
+        if (m_finished || reader.remaining() == 0 || !detail::read_input_frame(reader, next))
+        {
+            m_finished = true;
+            // Nothing new happens once the log runs out, held keys stay held
+            next.begin_frame(m_states[1 - next_index]);
+        }
+        else
+        {
+            m_offset += reader.offset();
+            m_frame++;
+        }
+        m_current_state.store(next_index, MemoryOrder::Release);
+    }
+
+    KeyboardState const& InputReplay::keyboard_state() const
+    {
+        return m_states[m_current_state.load(MemoryOrder::Acquire)];
+    }
+
+    String InputReplay::get_key_name(KeyboardKey key)
+    {
+        return default_key_name(static_cast<u32>(key));
+    }
+
+    String InputReplay::get_scancode_name(KeyboardScancode scancode)
+    {
+        return default_key_name(static_cast<u32>(scancode));
+    }
+
+    bool InputReplay::finished() const
+    {
+        return m_finished;
+    }
+
+    u64 InputReplay::frame() const
+    {
+        return m_frame;
+    }
+}
\ No newline at end of file
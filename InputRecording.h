@@ -0,0 +1,100 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <ResultOrError.h>
+#include <Memory.h>
+#include <Atomic.h>
+#include "Input.h"
+#include "Serialization.h"
+
+namespace vengine
+{
+    namespace detail
+    {
+        // A frame is a varint mask of the KeyboardState words that changed since the previous frame,
+        // followed by the new value of every changed word as a varint. Frames without input take a single byte
+        void write_input_frame(KeyboardState const& previous, KeyboardState const& current, BinaryWriter& writer);
+        // Applies a frame on top of the previous state. Pressed and released bits are part of the frame
+        bool read_input_frame(BinaryReader& reader, KeyboardState& state);
+    }
+
+    // Wraps another Input and logs the keyboard state it produces every update_inputs, one frame per call.
+    // Queries go straight to the wrapped Input
+    class InputRecorder : public Input
+    {
+    public:
+        static constexpr u32 MAGIC = 0x504e4956; // "VINP"
+        static constexpr u32 VERSION = 1;
+
+        explicit InputRecorder(OwnPtr<Input>&& source);
+
+        KeyboardState const& keyboard_state() const override;
+        Vector<InputEvent> const& frame_events() const override;
+        bool start_async_polling() override;
+        String get_key_name(KeyboardKey key) override;
+        String get_scancode_name(KeyboardScancode scancode) override;
+
+        BinaryWriter& log();
+        u64 frame_count() const;
+        bool write_to_file(char const* path);
+
+    private:
+        void update_inputs() override;
+
+        OwnPtr<Input> m_source;
+        Input* m_input;
+        BinaryWriter m_log;
+        KeyboardState m_previous;
+        u64 m_frame_count { 0 };
+    };
+
+    // Plays a log written by InputRecorder back through the Input interface, one recorded frame per update_inputs.
+    // It needs neither SDL nor a window, so replays can run headless. Together with a fixed tick this reproduces
+    // a recorded session exactly. Once the log runs out the last held keys stay held and finished() returns true
+    class InputReplay : public Input
+    {
+    public:
+        static ResultOrError<OwnPtr<InputReplay>, String> load(char const* path);
+        static ResultOrError<OwnPtr<InputReplay>, String> create(u8 const* log, u64 size);
+
+        // Use load or create, they check the log header
+        InputReplay(Buffer<u8>&& log, u64 size);
+
+        KeyboardState const& keyboard_state() const override;
+        String get_key_name(KeyboardKey key) override;
+        String get_scancode_name(KeyboardScancode scancode) override;
+
+        bool finished() const;
+        u64 frame() const;
+
+    private:
+        static ResultOrError<OwnPtr<InputReplay>, String> validate(OwnPtr<InputReplay>&& replay);
+        void update_inputs() override;
+
+        Buffer<u8> m_log;
+        u8 const* m_data;
+        u64 m_size;
+        u64 m_offset { 0 };
+        u64 m_frame { 0 };
+        bool m_finished { false };
+        // Double buffered like SDLInput so tasks can read the published state while the next frame is decoded
+        KeyboardState m_states[2];
+        Atomic<u32> m_current_state { 0 };
+    };
+}
\ No newline at end of file
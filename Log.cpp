@@ -0,0 +1,279 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Log.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+
+namespace vengine
+{
+    static char const* level_name(LogLevel level)
+    {
+        switch (level)
+        {
+            case LogLevel::Trace: return "trace";
+            case LogLevel::Debug: return "debug";
+            case LogLevel::Info: return "info";
+            case LogLevel::Warning: return "warning";
+            case LogLevel::Error: return "error";
+            case LogLevel::None: break;
+        }
+        VERIFY_NOT_REACHED();
+    }
+
+    static void append(Vector<char>& output, char const* text, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+            output.append(text[i]);
+    }
+
+    template<typename T>
+    static void append_formatted(Vector<char>& output, char const* specifier, T value)
+    {
+        char buffer[256];
+        int length = snprintf(buffer, sizeof(buffer), specifier, value);
+        if (length > 0)
+            append(output, buffer, (size_t)length < sizeof(buffer) ? (size_t)length : sizeof(buffer) - 1);
+    }
+
+    // printf can't take the arguments as an array, so every conversion is formatted on its own with the type its
+    // specifier asks for. Missing arguments print as the specifier itself
+    static void format_record(Vector<char>& output, LogRecord const& record)
+    {
+        char prefix[64];
+        int prefix_length = snprintf(prefix, sizeof(prefix), "[%5lu.%06lu] %s: ", (unsigned long)(record.timestamp_ns / 1'000'000'000ull),
+            (unsigned long)(record.timestamp_ns % 1'000'000'000ull / 1000), level_name(record.level));
+        append(output, prefix, (size_t)prefix_length);
+        size_t message_start = output.size();
+
+        u32 argument = 0;
+        char const* cursor = record.format;
+        while (*cursor != '\0')
+        {
+            if (*cursor != '%')
+            {
+                output.append(*cursor++);
+                continue;
+            }
+            if (cursor[1] == '%')
+            {
+                output.append('%');
+                cursor += 2;
+                continue;
+            }
+
+            char specifier[32];
+            size_t length = 0;
+            bool wide = false;
+            specifier[length++] = *cursor++;
+            while (*cursor != '\0' && length < sizeof(specifier) - 2 && __builtin_strchr("diouxXcspfFeEgGaA", *cursor) == nullptr)
+            {
+                if (*cursor == 'l' || *cursor == 'j' || *cursor == 'z' || *cursor == 't')
+                    wide = true;
+                specifier[length++] = *cursor++;
+            }
+            if (*cursor == '\0')
+                break;
+            char conversion = *cursor++;
+            specifier[length++] = conversion;
+            specifier[length] = '\0';
+
+            if (argument >= record.argument_count)
+            {
+                append(output, specifier, length);
+                continue;
+            }
+
+            u64 bits = record.arguments[argument];
+            bool is_double = (record.double_arguments & (1u << argument)) != 0;
+            argument++;
+            switch (conversion)
+            {
+                case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                {
+                    double value = 0.0;
+                    if (is_double)
+                        __builtin_memcpy(&value, &bits, sizeof(value));
+                    else
+                        value = (double)bits;
+                    append_formatted(output, specifier, value);
+                    break;
+                }
+                case 's':
+                    append_formatted(output, specifier, bits == 0 ? "(null)" : (char const*)bits);
+                    break;
+                case 'p':
+                    append_formatted(output, specifier, (void const*)bits);
+                    break;
+                case 'c':
+                    append_formatted(output, specifier, (int)bits);
+                    break;
+                default:
+                    if (wide)
+                        append_formatted(output, specifier, bits);
+                    else
+                        append_formatted(output, specifier, (unsigned)bits);
+                    break;
+            }
+        }
+
+        // Records are lines, a trailing newline in the format isn't required
+        if (output.size() == message_start || output[output.size() - 1] != '\n')
+            output.append('\n');
+    }
+
+    static void release_owned_arguments(LogRecord const& record)
+    {
+        for (u32 i = 0; i < record.argument_count; i++)
+        {
+            if ((record.owned_arguments & (1u << i)) != 0)
+                delete[] (char*)record.arguments[i];
+        }
+    }
+
+    Logger& Logger::the()
+    {
+        // Never destroyed, the flush thread keeps running until the process exits
+        static Logger* s_logger = new Logger();
+        return *s_logger;
+    }
+
+    Logger::Logger()
+    {
+        auto thread = Thread::create([this]()
+        { run(); });
+        m_thread = std::move(thread.result());
+    }
+
+    Logger::ThreadBuffer& Logger::thread_buffer()
+    {
+        thread_local ThreadBuffer* t_buffer = nullptr;
+        if (t_buffer == nullptr)
+        {
+            t_buffer = new ThreadBuffer();
+            ScopedLock lock(m_buffers_mutex);
+            m_buffers.append(t_buffer);
+        }
+        return *t_buffer;
+    }
+
+    void Logger::submit(LogRecord const& record)
+    {
+        ThreadBuffer& buffer = thread_buffer();
+        if (!buffer.ring.try_push(record))
+        {
+            buffer.dropped.fetch_add(1, MemoryOrder::Relaxed);
+            release_owned_arguments(record);
+        }
+    }
+
+    u64 Logger::dropped_records()
+    {
+        u64 dropped = 0;
+        ScopedLock lock(m_buffers_mutex);
+        for (size_t i = 0; i < m_buffers.size(); i++)
+            dropped += m_buffers[i]->dropped.load(MemoryOrder::Relaxed);
+        return dropped;
+    }
+
+    // Returns true if anything was written
+    bool Logger::drain(Vector<char>& output)
+    {
+        bool wrote = false;
+        size_t buffer_count;
+        {
+            ScopedLock lock(m_buffers_mutex);
+            buffer_count = m_buffers.size();
+        }
+
+        for (size_t i = 0; i < buffer_count; i++)
+        {
+            ThreadBuffer* buffer;
+            {
+                ScopedLock lock(m_buffers_mutex);
+                buffer = m_buffers[i];
+            }
+
+            output.clear();
+            LogRecord record;
+            // Bounded so a thread that logs nonstop can't starve the others
+            for (u32 count = 0; count < RING_CAPACITY && buffer->ring.try_pop(record); count++)
+            {
+                format_record(output, record);
+                release_owned_arguments(record);
+            }
+
+            u64 dropped = buffer->dropped.load(MemoryOrder::Relaxed);
+            if (dropped != buffer->reported_dropped)
+            {
+                char message[96];
+                int length = snprintf(message, sizeof(message), "logger: %lu records dropped\n", (unsigned long)(dropped - buffer->reported_dropped));
+                append(output, message, (size_t)length);
+                buffer->reported_dropped = dropped;
+            }
+
+            if (output.size() == 0)
+                continue;
+            size_t written = 0;
+            while (written < output.size())
+            {
+                ssize_t result = write(STDOUT_FILENO, &output[written], output.size() - written);
+                if (result <= 0)
+                    break;
+                written += (size_t)result;
+            }
+            wrote = true;
+        }
+        return wrote;
+    }
+
+    void Logger::run()
+    {
+        Vector<char> output;
+        while (true)
+        {
+            if (!drain(output))
+            {
+                timespec idle { 0, 1'000'000 };
+                nanosleep(&idle, nullptr);
+            }
+            m_passes.fetch_add(1, MemoryOrder::Release);
+        }
+    }
+
+    void Logger::flush()
+    {
+        while (true)
+        {
+            bool empty = true;
+            {
+                ScopedLock lock(m_buffers_mutex);
+                for (size_t i = 0; i < m_buffers.size() && empty; i++)
+                    empty = m_buffers[i]->ring.is_empty();
+            }
+            if (empty)
+                break;
+            sched_yield();
+        }
+
+        // A record popped in the pass that's still running may not be written yet, two pass boundaries guarantee it is
+        u64 passes = m_passes.load(MemoryOrder::Acquire);
+        while (m_passes.load(MemoryOrder::Acquire) < passes + 2)
+            sched_yield();
+    }
+}
@@ -0,0 +1,156 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Types.h>
+#include <Atomic.h>
+#include <Vector.h>
+#include <Mutex.h>
+#include <Thread.h>
+#include <SmartPtr.h>
+#include "Debug.h"
+#include "Clock.h"
+#include "SPSCRing.h"
+
+namespace vengine
+{
+    // Fixed size binary log entry. The format string is only formatted on the logger thread
+    struct LogRecord
+    {
+        static constexpr u32 MAX_ARGUMENTS = 6;
+
+        char const* format { nullptr };
+        u64 timestamp_ns { 0 };
+        u64 arguments[MAX_ARGUMENTS] {};
+        u8 argument_count { 0 };
+        // Bit i is set when argument i holds the bits of a double
+        u8 double_arguments { 0 };
+        // Bit i is set when argument i is an OwnedLogString's text
+        u8 owned_arguments { 0 };
+        LogLevel level { LogLevel::Info };
+    };
+
+    // A %s argument built at runtime. The logger takes the text and frees it with delete[] once it is written or dropped
+    struct OwnedLogString
+    {
+        char* text;
+    };
+
+    // Asynchronous logger. Every thread pushes records into its own lock-free ring and a background thread formats and
+    // writes them, so logging from parallel tasks never takes a lock or touches stdio.
+    // Formats must be string literals and %s arguments must outlive the flush (literals, Type names, ...) or be passed as
+    // an OwnedLogString.
+    // When a thread's ring is full its records are dropped and counted rather than blocking the caller
+    class Logger
+    {
+    public:
+        static constexpr u32 RING_CAPACITY = 1024;
+
+        static Logger& the();
+
+        void submit(LogRecord const& record);
+        // Waits until everything submitted before the call has been written
+        void flush();
+        u64 dropped_records();
+
+    private:
+        struct ThreadBuffer
+        {
+            SPSCRing<LogRecord, RING_CAPACITY> ring;
+            Atomic<u64> dropped { 0 };
+            u64 reported_dropped { 0 };
+        };
+
+        Logger();
+
+        ThreadBuffer& thread_buffer();
+        void run();
+        bool drain(Vector<char>& output);
+
+        // Buffers are registered once per thread and never freed, a thread that exits just leaves an idle ring behind
+        Vector<ThreadBuffer*> m_buffers;
+        neo::SpinlockMutex m_buffers_mutex {};
+        Atomic<u64> m_passes { 0 };
+        RefPtr<Thread> m_thread;
+    };
+
+    namespace detail
+    {
+        // Pointers, enums and integers are stored as their bits
+        template<typename T>
+        void pack_log_argument(LogRecord& record, T value)
+        {
+            record.arguments[record.argument_count++] = (u64)value;
+        }
+
+        inline void pack_log_argument(LogRecord& record, double value)
+        {
+            __builtin_memcpy(&record.arguments[record.argument_count], &value, sizeof(value));
+            record.double_arguments |= (u8)(1u << record.argument_count++);
+        }
+
+        inline void pack_log_argument(LogRecord& record, float value)
+        {
+            pack_log_argument(record, (double)value);
+        }
+
+        inline void pack_log_argument(LogRecord& record, OwnedLogString value)
+        {
+            record.owned_arguments |= (u8)(1u << record.argument_count);
+            record.arguments[record.argument_count++] = (u64)value.text;
+        }
+
+        // Arguments of a level that is compiled out are never submitted, owned text still has to be freed
+        template<typename T>
+        void discard_log_argument(T) {}
+
+        inline void discard_log_argument(OwnedLogString value)
+        {
+            delete[] value.text;
+        }
+    }
+
+    template<LogLevel Level, typename... TArguments>
+    void log(char const* format, TArguments... arguments)
+    {
+        if constexpr (Level >= MinimumLogLevel)
+        {
+            static_assert(sizeof...(TArguments) <= LogRecord::MAX_ARGUMENTS, "Too many log arguments");
+            LogRecord record;
+            record.format = format;
+            record.timestamp_ns = monotonic_time_ns();
+            record.level = Level;
+            (detail::pack_log_argument(record, arguments), ...);
+            Logger::the().submit(record);
+        }
+        else
+        {
+            (detail::discard_log_argument(arguments), ...);
+        }
+    }
+
+    template<typename... TArguments>
+    void log_trace(char const* format, TArguments... arguments) { log<LogLevel::Trace>(format, arguments...); }
+    template<typename... TArguments>
+    void log_debug(char const* format, TArguments... arguments) { log<LogLevel::Debug>(format, arguments...); }
+    template<typename... TArguments>
+    void log_info(char const* format, TArguments... arguments) { log<LogLevel::Info>(format, arguments...); }
+    template<typename... TArguments>
+    void log_warning(char const* format, TArguments... arguments) { log<LogLevel::Warning>(format, arguments...); }
+    template<typename... TArguments>
+    void log_error(char const* format, TArguments... arguments) { log<LogLevel::Error>(format, arguments...); }
+}
@@ -0,0 +1,254 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "MemoryTracker.h"
+#include "Serialization.h"
+#include <stdio.h>
+
+namespace vengine
+{
+    static char const* subsystem_name(MemorySubsystem subsystem)
+    {
+        switch (subsystem)
+        {
+            case MemorySubsystem::Components: return "components";
+            case MemorySubsystem::EntityIDs: return "entity ids";
+            case MemorySubsystem::StableReferences: return "stable references";
+            case MemorySubsystem::WorkQueues: return "work queues";
+            case MemorySubsystem::Systems: return "systems";
+            case MemorySubsystem::FrameArenas: return "frame arenas";
+            case MemorySubsystem::Count: break;
+        }
+        VERIFY_NOT_REACHED();
+    }
+
+    MemoryTracker& MemoryTracker::the()
+    {
+        // Never destroyed so buffers freed during static destruction can still report
+        static MemoryTracker* s_tracker = new MemoryTracker();
+        return *s_tracker;
+    }
+
+    void MemoryTracker::add(MemoryCounters& counters, u64 bytes)
+    {
+        counters.current_bytes += bytes;
+        counters.allocated_bytes += bytes;
+        counters.allocations++;
+        if (counters.current_bytes > counters.peak_bytes)
+            counters.peak_bytes = counters.current_bytes;
+    }
+
+    void MemoryTracker::remove(MemoryCounters& counters, u64 bytes)
+    {
+        counters.current_bytes -= bytes;
+        counters.frees++;
+    }
+
+    MemoryTracker::WorldCounters* MemoryTracker::find_world(void const* world)
+    {
+        for (auto& counters : m_worlds)
+        {
+            if (counters.world == world)
+                return &counters;
+        }
+        return nullptr;
+    }
+
+    void MemoryTracker::record_allocation(MemoryOwner const& owner, u64 bytes)
+    {
+        auto& subsystem = m_subsystems[(u8)owner.subsystem];
+        u64 current = subsystem.current_bytes.fetch_add(bytes, MemoryOrder::Relaxed) + bytes;
+        subsystem.allocated_bytes.fetch_add(bytes, MemoryOrder::Relaxed);
+        subsystem.allocations.fetch_add(1, MemoryOrder::Relaxed);
+        u64 peak = subsystem.peak_bytes.load(MemoryOrder::Relaxed);
+        while (current > peak && !subsystem.peak_bytes.compare_exchange_strong(peak, current, MemoryOrder::Relaxed))
+            ;
+
+        if (owner.archetype_id == MemoryOwner::NO_ARCHETYPE && owner.type == nullptr)
+            return;
+
+        ScopedLock lock(m_tables_mutex);
+        if (owner.archetype_id != MemoryOwner::NO_ARCHETYPE)
+        {
+            auto* world = find_world(owner.world);
+            if (world == nullptr)
+            {
+                m_worlds.append(WorldCounters { owner.world, {} });
+                world = &m_worlds[m_worlds.size() - 1];
+            }
+            while (world->archetypes.size() <= owner.archetype_id)
+                world->archetypes.append(MemoryCounters {});
+            add(world->archetypes[owner.archetype_id], bytes);
+        }
+        if (owner.type != nullptr)
+        {
+            while (m_components.size() <= owner.type->id())
+                m_components.append(ComponentCounters {});
+            m_components[owner.type->id()].type = owner.type;
+            add(m_components[owner.type->id()].counters, bytes);
+        }
+    }
+
+    void MemoryTracker::record_free(MemoryOwner const& owner, u64 bytes)
+    {
+        auto& subsystem = m_subsystems[(u8)owner.subsystem];
+        subsystem.current_bytes.fetch_sub(bytes, MemoryOrder::Relaxed);
+        subsystem.frees.fetch_add(1, MemoryOrder::Relaxed);
+
+        if (owner.archetype_id == MemoryOwner::NO_ARCHETYPE && owner.type == nullptr)
+            return;
+
+        ScopedLock lock(m_tables_mutex);
+        if (owner.archetype_id != MemoryOwner::NO_ARCHETYPE)
+        {
+            auto* world = find_world(owner.world);
+            VERIFY(world != nullptr && owner.archetype_id < world->archetypes.size());
+            remove(world->archetypes[owner.archetype_id], bytes);
+        }
+        if (owner.type != nullptr)
+        {
+            VERIFY(owner.type->id() < m_components.size());
+            remove(m_components[owner.type->id()].counters, bytes);
+        }
+    }
+
+    MemoryCounters MemoryTracker::subsystem(MemorySubsystem subsystem) const
+    {
+        auto& counters = m_subsystems[(u8)subsystem];
+        MemoryCounters result;
+        result.current_bytes = counters.current_bytes.load(MemoryOrder::Relaxed);
+        result.peak_bytes = counters.peak_bytes.load(MemoryOrder::Relaxed);
+        result.allocated_bytes = counters.allocated_bytes.load(MemoryOrder::Relaxed);
+        result.allocations = counters.allocations.load(MemoryOrder::Relaxed);
+        result.frees = counters.frees.load(MemoryOrder::Relaxed);
+        return result;
+    }
+
+    MemoryCounters MemoryTracker::archetype(void const* world, u64 archetype_id)
+    {
+        ScopedLock lock(m_tables_mutex);
+        auto* counters = find_world(world);
+        if (counters == nullptr || archetype_id >= counters->archetypes.size())
+            return {};
+        return counters->archetypes[archetype_id];
+    }
+
+    void MemoryTracker::forget_world(void const* world)
+    {
+        ScopedLock lock(m_tables_mutex);
+        for (size_t i = 0; i < m_worlds.size(); i++)
+        {
+            if (m_worlds[i].world == world)
+            {
+                m_worlds.remove_at(i);
+                return;
+            }
+        }
+    }
+
+    MemoryCounters MemoryTracker::component(Type const* type)
+    {
+        ScopedLock lock(m_tables_mutex);
+        if (type->id() >= m_components.size())
+            return {};
+        return m_components[type->id()].counters;
+    }
+
+    void MemoryTracker::end_frame()
+    {
+        for (auto& subsystem : m_subsystems)
+        {
+            u64 allocated_bytes = subsystem.allocated_bytes.load(MemoryOrder::Relaxed);
+            u64 allocations = subsystem.allocations.load(MemoryOrder::Relaxed);
+            subsystem.last_frame = { allocated_bytes - subsystem.frame_start_bytes, allocations - subsystem.frame_start_allocations };
+            subsystem.frame_start_bytes = allocated_bytes;
+            subsystem.frame_start_allocations = allocations;
+        }
+        m_frame_count++;
+    }
+
+    MemoryFrameRate MemoryTracker::last_frame(MemorySubsystem subsystem) const
+    {
+        return m_subsystems[(u8)subsystem].last_frame;
+    }
+
+    static void append_line(Vector<char>& report, char const* name, MemoryCounters const& counters)
+    {
+        char line[256];
+        int length = snprintf(line, sizeof(line), "%-32s %14lu %14lu %16lu %12lu %12lu\n", name,
+            (unsigned long)counters.current_bytes, (unsigned long)counters.peak_bytes, (unsigned long)counters.allocated_bytes,
+            (unsigned long)counters.allocations, (unsigned long)counters.frees);
+        for (int i = 0; i < length && i < (int)sizeof(line) - 1; i++)
+            report.append(line[i]);
+    }
+
+    static void append_header(Vector<char>& report, char const* title)
+    {
+        char line[256];
+        int length = snprintf(line, sizeof(line), "\n%-32s %14s %14s %16s %12s %12s\n", title, "current", "peak", "allocated", "allocations", "frees");
+        for (int i = 0; i < length; i++)
+            report.append(line[i]);
+    }
+
+    bool MemoryTracker::dump_to_file(char const* path)
+    {
+        Vector<char> report;
+        char name[64];
+
+        append_header(report, "subsystem");
+        for (u8 i = 0; i < (u8)MemorySubsystem::Count; i++)
+            append_line(report, subsystem_name((MemorySubsystem)i), subsystem((MemorySubsystem)i));
+
+        char line[256];
+        int length = snprintf(line, sizeof(line), "\n%-32s %16s %12s (frame %lu)\n", "last frame", "allocated", "allocations", (unsigned long)m_frame_count);
+        for (int i = 0; i < length; i++)
+            report.append(line[i]);
+        for (u8 i = 0; i < (u8)MemorySubsystem::Count; i++)
+        {
+            MemoryFrameRate rate = last_frame((MemorySubsystem)i);
+            length = snprintf(line, sizeof(line), "%-32s %16lu %12lu\n", subsystem_name((MemorySubsystem)i), (unsigned long)rate.allocated_bytes,
+                (unsigned long)rate.allocations);
+            for (int j = 0; j < length; j++)
+                report.append(line[j]);
+        }
+
+        {
+            ScopedLock lock(m_tables_mutex);
+            append_header(report, "component");
+            for (size_t i = 0; i < m_components.size(); i++)
+            {
+                if (m_components[i].type != nullptr)
+                    append_line(report, m_components[i].type->name().data(), m_components[i].counters);
+            }
+
+            // Named world/archetype id, worlds are numbered in the order they first allocated
+            append_header(report, "archetype");
+            for (size_t world = 0; world < m_worlds.size(); world++)
+            {
+                auto& archetypes = m_worlds[world].archetypes;
+                for (size_t i = 0; i < archetypes.size(); i++)
+                {
+                    if (archetypes[i].allocations == 0)
+                        continue;
+                    snprintf(name, sizeof(name), "%lu/%lu", (unsigned long)world, (unsigned long)i);
+                    append_line(report, name, archetypes[i]);
+                }
+            }
+        }
+
+        return write_file(path, (u8 const*)&report[0], report.size());
+    }
+}
@@ -0,0 +1,137 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Types.h>
+#include <Atomic.h>
+#include <Vector.h>
+#include <Mutex.h>
+#include "RTTI.h"
+
+namespace vengine
+{
+    using ngx::rtti::Type;
+
+    enum class MemorySubsystem : u8
+    {
+        Components,
+        EntityIDs,
+        StableReferences,
+        WorkQueues,
+        Systems,
+        FrameArenas,
+        Count
+    };
+
+    struct MemoryCounters
+    {
+        u64 current_bytes { 0 };
+        // High-water mark of current_bytes
+        u64 peak_bytes { 0 };
+        u64 allocated_bytes { 0 };
+        u64 allocations { 0 };
+        u64 frees { 0 };
+    };
+
+    struct MemoryFrameRate
+    {
+        u64 allocated_bytes { 0 };
+        u64 allocations { 0 };
+    };
+
+    // Who an allocation is charged to. Archetype and type are optional refinements of the subsystem.
+    // Archetype ids are only unique per world, so an archetype is identified by its ArchetypeManager and its id
+    struct MemoryOwner
+    {
+        static constexpr u64 NO_ARCHETYPE = -1ull;
+
+        MemorySubsystem subsystem { MemorySubsystem::Components };
+        u64 archetype_id { NO_ARCHETYPE };
+        Type const* type { nullptr };
+        void const* world { nullptr };
+    };
+
+    // Engine-wide allocation accounting. Subsystem counters are lock-free since chunks are allocated from every worker,
+    // the per archetype and per component tables take a lock but are only touched once per chunk.
+    // Only the engine's own allocations are recorded, this is not a global allocator hook
+    class MemoryTracker
+    {
+    public:
+        static MemoryTracker& the();
+
+        void record_allocation(MemoryOwner const& owner, u64 bytes);
+        void record_free(MemoryOwner const& owner, u64 bytes);
+
+        MemoryCounters subsystem(MemorySubsystem subsystem) const;
+        MemoryCounters archetype(void const* world, u64 archetype_id);
+        MemoryCounters component(Type const* type);
+
+        // Drops the archetype table of a world that is being destroyed
+        void forget_world(void const* world);
+
+        // Call once per frame, the rates are what was allocated since the previous call
+        void end_frame();
+        MemoryFrameRate last_frame(MemorySubsystem subsystem) const;
+        u64 frame_count() const
+        {
+            return m_frame_count;
+        }
+
+        // Writes a human readable report of every counter
+        bool dump_to_file(char const* path);
+
+    private:
+        struct SubsystemCounters
+        {
+            Atomic<u64> current_bytes { 0 };
+            Atomic<u64> peak_bytes { 0 };
+            Atomic<u64> allocated_bytes { 0 };
+            Atomic<u64> allocations { 0 };
+            Atomic<u64> frees { 0 };
+            u64 frame_start_bytes { 0 };
+            u64 frame_start_allocations { 0 };
+            MemoryFrameRate last_frame {};
+        };
+
+        struct ComponentCounters
+        {
+            Type const* type { nullptr };
+            MemoryCounters counters {};
+        };
+
+        struct WorldCounters
+        {
+            void const* world { nullptr };
+            // Indexed by archetype id
+            Vector<MemoryCounters> archetypes;
+        };
+
+        MemoryTracker() = default;
+
+        static void add(MemoryCounters& counters, u64 bytes);
+        static void remove(MemoryCounters& counters, u64 bytes);
+        WorldCounters* find_world(void const* world);
+
+        SubsystemCounters m_subsystems[(u8)MemorySubsystem::Count];
+        // There are only a handful of worlds, they are searched linearly
+        Vector<WorldCounters> m_worlds;
+        // Indexed by TypeID
+        Vector<ComponentCounters> m_components;
+        neo::SpinlockMutex m_tables_mutex {};
+        u64 m_frame_count { 0 };
+    };
+}
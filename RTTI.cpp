@@ -15,6 +15,8 @@
  */
 
 #include <TypeTraits.h>
+#include <Vector.h>
+#include <Mutex.h>
 #include "RTTI.h"
 
 namespace ngx::rtti
@@ -25,6 +27,26 @@ namespace ngx::rtti
         return next_id++;
     }
 
+    static Vector<Type const*> s_registered_types;
+    static neo::SpinlockMutex s_registered_types_mutex;
+
+    void register_type(Type const* type)
+    {
+        ScopedLock lock(s_registered_types_mutex);
+        s_registered_types.append(type);
+    }
+
+    Type const* find_type_by_name(char const* name, size_t length)
+    {
+        ScopedLock lock(s_registered_types_mutex);
+        for (Type const* type : s_registered_types)
+        {
+            if (__builtin_strlen(type->name().data()) == length && __builtin_memcmp(type->name().data(), name, length) == 0)
+                return type;
+        }
+        return nullptr;
+    }
+
     String const& Type::name() const
     {
         return m_name;
@@ -79,4 +101,19 @@ namespace ngx::rtti
     {
         m_destructor(ptr);
     }
+
+    bool Type::has_serialization_hooks() const
+    {
+        return m_serialize != nullptr && m_deserialize != nullptr;
+    }
+
+    void Type::serialize(void const* object, vengine::BinaryWriter& writer) const
+    {
+        m_serialize(object, writer);
+    }
+
+    void Type::deserialize(vengine::BinaryReader& reader, void* object) const
+    {
+        m_deserialize(reader, object);
+    }
 }
\ No newline at end of file
@@ -19,16 +19,34 @@
 #include <TypeTraits.h>
 #include <TypeExtras.h>
 
+namespace vengine
+{
+    class BinaryWriter;
+    class BinaryReader;
+}
+
 namespace ngx::rtti
 {
     using TypeID = u64;
 
+    class Type;
+
+    // Writes the object into the writer. Only needed for types that aren't trivially copyable
+    using SerializeFunction = void (*)(void const* object, vengine::BinaryWriter& writer);
+    // Constructs the object in place in uninitialized memory from the reader
+    using DeserializeFunction = void (*)(vengine::BinaryReader& reader, void* object);
+
     extern size_t get_next_type_id();
+    extern void register_type(Type const* type);
+    // Only finds types that have already been instantiated with type_of
+    extern Type const* find_type_by_name(char const* name, size_t length);
 
     class Type
     {
         template<typename T>
         friend Type const* type_of();
+        template<typename T>
+        friend void register_serialization_hooks(SerializeFunction serialize, DeserializeFunction deserialize);
 
     public:
         ~Type()
@@ -46,6 +64,9 @@ namespace ngx::rtti
         void move_assignment(size_t num, void* from, void* to) const;
         void destructor(void* ptr) const;
         void copy_assignment(size_t num, void const* from, void* to) const;
+        bool has_serialization_hooks() const;
+        void serialize(void const* object, vengine::BinaryWriter& writer) const;
+        void deserialize(vengine::BinaryReader& reader, void* object) const;
 
         template<typename T>
         void copy_assignment(T const& from, T& to) const
@@ -83,6 +104,8 @@ namespace ngx::rtti
             { for (size_t i = 0; i < num; ++i) *(reinterpret_cast<T*>(to)+i) = std::move(*(reinterpret_cast<T const*>(from)+i)); };
             new_type_info.m_destructor = [](void* ptr)
             { reinterpret_cast<T*>(ptr)->~T(); };
+            new_type_info.m_serialize = nullptr;
+            new_type_info.m_deserialize = nullptr;
             return new_type_info;
         }
 
@@ -97,21 +120,53 @@ namespace ngx::rtti
         void (*m_move_assignment)(void const*, void*);
         void (*m_move_assignment_many)(size_t, void const*, void*);
         void (*m_destructor)(void*);
+        SerializeFunction m_serialize;
+        DeserializeFunction m_deserialize;
     };
 
     template<typename T>
     Type const* type_of()
     {
-        static const Type type = Type::create<T>();
+        static Type type = Type::create<T>();
+        static bool registered = (register_type(&type), true);
+        (void)registered;
         return &type;
     }
 
+    // Lets snapshots store components that can't be copied with memcpy
+    template<typename T>
+    void register_serialization_hooks(SerializeFunction serialize, DeserializeFunction deserialize)
+    {
+        Type* type = const_cast<Type*>(type_of<T>());
+        type->m_serialize = serialize;
+        type->m_deserialize = deserialize;
+    }
+
     template<typename...>
     struct Pack
     {
     };
+
+    // Position of the first T in Ts...
+    template<typename T, typename... Ts>
+    struct PackIndex;
+
+    template<typename T, typename... Ts>
+    struct PackIndex<T, T, Ts...>
+    {
+        static constexpr size_t value = 0;
+    };
+
+    template<typename T, typename U, typename... Ts>
+    struct PackIndex<T, U, Ts...>
+    {
+        static constexpr size_t value = 1 + PackIndex<T, Ts...>::value;
+    };
 }
 using ngx::rtti::Pack;
+using ngx::rtti::PackIndex;
 using ngx::rtti::Type;
 using ngx::rtti::type_of;
 using ngx::rtti::TypeID;
+using ngx::rtti::register_serialization_hooks;
+using ngx::rtti::find_type_by_name;
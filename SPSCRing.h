@@ -0,0 +1,72 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <Types.h>
+#include <Atomic.h>
+
+namespace vengine
+{
+    // Lock-free ring buffer for exactly one producer thread and one consumer thread. Capacity must be a power of two
+    template<typename T, u32 Capacity>
+    class SPSCRing
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "SPSCRing capacity must be a power of two");
+
+    public:
+        // Returns false if the ring is full
+        bool try_push(T const& value)
+        {
+            u32 head = m_head.load(MemoryOrder::Relaxed);
+            if (head - m_tail.load(MemoryOrder::Acquire) == Capacity)
+                return false;
+            m_items[head & (Capacity - 1)] = value;
+            m_head.store(head + 1, MemoryOrder::Release);
+            return true;
+        }
+
+        // Returns false if the ring is empty
+        bool try_pop(T& value)
+        {
+            u32 tail = m_tail.load(MemoryOrder::Relaxed);
+            if (tail == m_head.load(MemoryOrder::Acquire))
+                return false;
+            value = m_items[tail & (Capacity - 1)];
+            m_tail.store(tail + 1, MemoryOrder::Release);
+            return true;
+        }
+
+        // Only a snapshot when called while the other side is active. The producer never sees less than the real count
+        u32 size() const
+        {
+            return m_head.load(MemoryOrder::Acquire) - m_tail.load(MemoryOrder::Acquire);
+        }
+
+        // Only a snapshot when called while the other side is active
+        bool is_empty() const
+        {
+            return m_tail.load(MemoryOrder::Acquire) == m_head.load(MemoryOrder::Acquire);
+        }
+
+    private:
+        // Producer and consumer indices live on separate cache lines
+        alignas(64) Atomic<u32> m_head { 0 };
+        alignas(64) Atomic<u32> m_tail { 0 };
+        T m_items[Capacity];
+    };
+}
\ No newline at end of file
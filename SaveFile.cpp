@@ -0,0 +1,178 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "SaveFile.h"
+#include "Snapshot.h"
+#include "Archetype.h"
+#include "Debug.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace vengine
+{
+    template<typename T>
+    static void write_chunks(ChunkedBuffer<T>& buffer, BinaryWriter& writer)
+    {
+        Type const* type = buffer.type();
+        if (!type->is_trivially_copyable())
+        {
+            VERIFY(type->has_serialization_hooks());
+            for (u64 i = 0; i < buffer.size(); ++i)
+                type->serialize(buffer[i], writer);
+            return;
+        }
+
+        u64 chunk_bytes = buffer.chunk_size() * type->size();
+        for (u64 chunk = 0; chunk * buffer.chunk_size() < buffer.size(); ++chunk)
+        {
+            u64 rows = buffer.size() - chunk * buffer.chunk_size();
+            if (rows > buffer.chunk_size())
+                rows = buffer.chunk_size();
+
+            writer.align(ChunkedBuffer<T>::DATA_ALIGNMENT);
+            writer.write(buffer.get_buffer_data(chunk), rows * type->size());
+            // Chunks are stored whole so the mapped ones can still be appended to
+            if (rows * type->size() < chunk_bytes)
+                __builtin_memset(writer.allocate(chunk_bytes - rows * type->size()), 0, chunk_bytes - rows * type->size());
+        }
+    }
+
+    template<typename T>
+    static void map_chunks(ChunkedBuffer<T>& buffer, u64 count, BinaryReader& reader)
+    {
+        Type const* type = buffer.type();
+        if (!type->is_trivially_copyable())
+        {
+            buffer.append_uninitialized(count);
+            for (u64 i = 0; i < count; ++i)
+                type->deserialize(reader, buffer[i]);
+            return;
+        }
+
+        u64 chunk_bytes = buffer.chunk_size() * type->size();
+        for (u64 chunk = 0; chunk * buffer.chunk_size() < count; ++chunk)
+        {
+            u64 rows = count - chunk * buffer.chunk_size();
+            if (rows > buffer.chunk_size())
+                rows = buffer.chunk_size();
+
+            reader.align(ChunkedBuffer<T>::DATA_ALIGNMENT);
+            u8 const* data = reader.read_in_place(chunk_bytes);
+            if (data == nullptr)
+                return;
+            // The mapping is private and writable, so handing out mutable pointers is fine
+            buffer.append_mapped_chunk(const_cast<u8*>(data), rows);
+        }
+    }
+
+    void WorldSaveFile::write(Context& context, BinaryWriter& writer)
+    {
+        auto& archetypes = context.archetype_manager().archetypes();
+        writer.write(MAGIC);
+        writer.write(VERSION);
+        writer.write<u64>(archetypes.size());
+
+        for (Archetype* archetype : archetypes)
+        {
+            writer.write(archetype->id());
+            detail::write_archetype_signature(archetype, writer);
+            writer.write<u64>(archetype->size());
+            write_chunks(archetype->entity_buffer(), writer);
+            for (size_t column = 0; column < archetype->component_types().size(); ++column)
+                write_chunks(archetype->component_buffer(column), writer);
+        }
+    }
+
+    bool WorldSaveFile::write_to_file(Context& context, char const* path)
+    {
+        BinaryWriter writer;
+        write(context, writer);
+
+        return write_file(path, writer.data(), writer.size());
+    }
+
+    ResultOrError<OwnPtr<WorldSaveFile>, String> WorldSaveFile::map(Context& context, char const* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return "Couldn't open save file"_s;
+
+        struct stat file_info {};
+        if (fstat(fd, &file_info) != 0 || file_info.st_size == 0)
+        {
+            close(fd);
+            return "Couldn't read save file size"_s;
+        }
+
+        u64 size = file_info.st_size;
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return "Couldn't map save file"_s;
+
+        OwnPtr<WorldSaveFile> file = OwnPtr<WorldSaveFile>(new WorldSaveFile((u8*)mapping, size));
+        BinaryReader reader((u8 const*)mapping, size);
+        if (reader.read<u32>() != MAGIC || reader.read<u32>() != VERSION)
+            return "Not a save file or unsupported version"_s;
+
+        auto& archetype_manager = context.archetype_manager();
+        archetype_manager.clear();
+
+        u64 archetype_count = reader.read<u64>();
+        for (u64 a = 0; a < archetype_count && !reader.has_error(); ++a)
+        {
+            u64 id = reader.read<u64>();
+            ComponentList stored_types;
+            SharedComponentList shared_components;
+            if (!detail::read_archetype_signature(reader, stored_types, &archetype_manager, &shared_components))
+            {
+                archetype_manager.clear();
+                return "Save file references unknown component types"_s;
+            }
+
+            u64 entity_count = reader.read<u64>();
+            if (reader.has_error() || entity_count > reader.remaining() / detail::minimum_row_size(stored_types))
+            {
+                archetype_manager.clear();
+                return "Save file is truncated"_s;
+            }
+
+            ComponentList sorted_types = stored_types;
+            sort(sorted_types, [](Type const* a, Type const* b)
+                { return a->id() < b->id(); });
+            Archetype* archetype = archetype_manager.create_archetype_with_id(id, sorted_types, shared_components);
+
+            map_chunks(archetype->entity_buffer(), entity_count, reader);
+            for (Type const* type : stored_types)
+                map_chunks(archetype->component_buffer(archetype->index_of_type(type)), entity_count, reader);
+        }
+
+        if (reader.has_error())
+        {
+            archetype_manager.clear();
+            return "Save file is truncated"_s;
+        }
+        return file;
+    }
+
+    WorldSaveFile::~WorldSaveFile()
+    {
+        munmap(m_data, m_size);
+    }
+}
\ No newline at end of file
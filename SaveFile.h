@@ -0,0 +1,54 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <ResultOrError.h>
+#include <Memory.h>
+#include "Context.h"
+#include "Serialization.h"
+
+namespace vengine
+{
+    // Save format that mirrors the in memory chunk layout. Every chunk of a trivially copyable column is stored whole
+    // and aligned to ChunkedBuffer::DATA_ALIGNMENT, so a mapped file can be used in place: those chunks are never
+    // copied and their pages are only read from disk when something touches them.
+    // Columns of other types go through the serialization hooks and are loaded eagerly.
+    class WorldSaveFile
+    {
+    public:
+        static constexpr u32 MAGIC = 0x56415356; // "VSAV"
+        static constexpr u32 VERSION = 2;
+
+        static void write(Context& context, BinaryWriter& writer);
+        static bool write_to_file(Context& context, char const* path);
+
+        // Maps the file and replaces the contents of the world with it. The world references the mapping,
+        // so the returned object must outlive the world's current archetypes. The mapping is private:
+        // writes to mapped chunks stay in memory and never reach the file
+        static ResultOrError<OwnPtr<WorldSaveFile>, String> map(Context& context, char const* path);
+
+        ~WorldSaveFile();
+
+    private:
+        WorldSaveFile(u8* data, u64 size) :
+            m_data(data), m_size(size) { }
+
+        u8* m_data;
+        u64 m_size;
+    };
+}
@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Serialization.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace vengine
+{
+    bool write_file(char const* path, u8 const* data, u64 size)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        u64 written = 0;
+        while (written < size)
+        {
+            auto result = ::write(fd, data + written, size - written);
+            if (result <= 0)
+            {
+                close(fd);
+                return false;
+            }
+            written += result;
+        }
+        return close(fd) == 0;
+    }
+
+    Optional<Buffer<u8>> read_file(char const* path, u64& size)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return {};
+
+        struct stat file_info {};
+        if (fstat(fd, &file_info) != 0)
+        {
+            close(fd);
+            return {};
+        }
+
+        size = file_info.st_size;
+        Optional<Buffer<u8>> buffer = Buffer<u8>::create_uninitialized(size > 0 ? size : 1, 16);
+        if (!buffer.has_value())
+        {
+            close(fd);
+            return {};
+        }
+
+        u8* data = buffer.value().data();
+        u64 read_bytes = 0;
+        while (read_bytes < size)
+        {
+            auto result = ::read(fd, data + read_bytes, size - read_bytes);
+            if (result <= 0)
+            {
+                close(fd);
+                return {};
+            }
+            read_bytes += result;
+        }
+        close(fd);
+        return buffer;
+    }
+}
\ No newline at end of file
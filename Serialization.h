@@ -0,0 +1,224 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <Types.h>
+#include <Buffer.h>
+#include <Optional.h>
+
+namespace vengine
+{
+    // Growable byte buffer used by the snapshot and save formats
+    class BinaryWriter
+    {
+    public:
+        static constexpr u64 INITIAL_CAPACITY = 4096;
+
+        void write(void const* data, u64 size)
+        {
+            ensure_capacity(m_size + size);
+            __builtin_memcpy(m_data + m_size, data, size);
+            m_size += size;
+        }
+
+        template<typename T>
+        void write(T const& value)
+        {
+            write(&value, sizeof(T));
+        }
+
+        void write_string(char const* string)
+        {
+            u32 length = __builtin_strlen(string);
+            write(length);
+            write(string, length);
+        }
+
+        // LEB128, small values take a single byte
+        void write_varint(u64 value)
+        {
+            while (value >= 0x80)
+            {
+                write<u8>((value & 0x7f) | 0x80);
+                value >>= 7;
+            }
+            write<u8>(value);
+        }
+
+        // Reserves size bytes and returns a pointer to them, valid until the next write
+        u8* allocate(u64 size)
+        {
+            ensure_capacity(m_size + size);
+            u8* data = m_data + m_size;
+            m_size += size;
+            return data;
+        }
+
+        // Pads with zeros until the size is a multiple of alignment
+        void align(u64 alignment)
+        {
+            u64 padding = (alignment - m_size % alignment) % alignment;
+            if (padding > 0)
+                __builtin_memset(allocate(padding), 0, padding);
+        }
+
+        u8 const* data() const
+        {
+            return m_data;
+        }
+
+        u8* data()
+        {
+            return m_data;
+        }
+
+        u64 size() const
+        {
+            return m_size;
+        }
+
+        void clear()
+        {
+            m_size = 0;
+        }
+
+    private:
+        void ensure_capacity(u64 capacity)
+        {
+            if (capacity <= m_capacity)
+                return;
+
+            u64 new_capacity = m_capacity == 0 ? INITIAL_CAPACITY : m_capacity * 2;
+            while (new_capacity < capacity)
+                new_capacity *= 2;
+
+            Optional<Buffer<u8>> buffer = Buffer<u8>::create_uninitialized(new_capacity, 64);
+            ENSURE(buffer.has_value());
+            if (m_size > 0)
+                __builtin_memcpy(buffer.value().data(), m_data, m_size);
+            m_buffer = std::move(buffer);
+            m_data = m_buffer.value().data();
+            m_capacity = new_capacity;
+        }
+
+        Optional<Buffer<u8>> m_buffer;
+        u8* m_data { nullptr };
+        u64 m_capacity { 0 };
+        u64 m_size { 0 };
+    };
+
+    // Reads from a byte range it doesn't own. Reading past the end sets a sticky error flag
+    // and returns zeroed data, so callers only need to check has_error() once at the end
+    class BinaryReader
+    {
+    public:
+        BinaryReader(u8 const* data, u64 size) :
+            m_data(data), m_size(size) { }
+
+        bool read(void* out, u64 size)
+        {
+            u8 const* data = read_in_place(size);
+            if (data == nullptr)
+            {
+                __builtin_memset(out, 0, size);
+                return false;
+            }
+            __builtin_memcpy(out, data, size);
+            return true;
+        }
+
+        template<typename T>
+        T read()
+        {
+            T value;
+            read(&value, sizeof(T));
+            return value;
+        }
+
+        u64 read_varint()
+        {
+            u64 value = 0;
+            for (u32 shift = 0; shift < 64; shift += 7)
+            {
+                u8 byte = read<u8>();
+                value |= (u64)(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                    return value;
+            }
+            m_error = true;
+            return 0;
+        }
+
+        // Returns a pointer into the underlying data and skips over it, or nullptr if there aren't enough bytes left
+        u8 const* read_in_place(u64 size)
+        {
+            if (m_error || size > m_size - m_offset)
+            {
+                m_error = true;
+                return nullptr;
+            }
+            u8 const* data = m_data + m_offset;
+            m_offset += size;
+            return data;
+        }
+
+        // Returns the characters in place, they are not null terminated
+        char const* read_string(u32& length)
+        {
+            length = read<u32>();
+            return (char const*)read_in_place(length);
+        }
+
+        // Skips the padding written by BinaryWriter::align
+        void align(u64 alignment)
+        {
+            read_in_place((alignment - m_offset % alignment) % alignment);
+        }
+
+        u64 offset() const
+        {
+            return m_offset;
+        }
+
+        u8 const* position() const
+        {
+            return m_data + m_offset;
+        }
+
+        u64 remaining() const
+        {
+            return m_size - m_offset;
+        }
+
+        bool has_error() const
+        {
+            return m_error;
+        }
+
+    private:
+        u8 const* m_data;
+        u64 m_size;
+        u64 m_offset { 0 };
+        bool m_error { false };
+    };
+
+    // Replaces the file at path with the data
+    bool write_file(char const* path, u8 const* data, u64 size);
+    // Reads the whole file at path, size receives its length
+    Optional<Buffer<u8>> read_file(char const* path, u64& size);
+}
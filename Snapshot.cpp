@@ -0,0 +1,209 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Snapshot.h"
+#include "Archetype.h"
+#include "Log.h"
+
+namespace vengine
+{
+    void detail::write_archetype_signature(Archetype* archetype, BinaryWriter& writer)
+    {
+        auto const& types = archetype->component_types();
+        writer.write<u32>(types.size());
+        for (Type const* type : types)
+        {
+            writer.write_string(type->name().data());
+            writer.write<u64>(type->size());
+            // Restore needs to know how the column was written even if the type changed in the meantime
+            writer.write<u8>(type->is_trivially_copyable());
+        }
+
+        auto const& shared_components = archetype->shared_components();
+        writer.write<u32>(shared_components.size());
+        for (auto* shared : shared_components)
+        {
+            writer.write_string(shared->type->name().data());
+            writer.write<u64>(shared->type->size());
+            writer.write(shared->data, shared->type->size());
+        }
+    }
+
+    bool detail::read_archetype_signature(BinaryReader& reader, ComponentList& stored_types, ArchetypeManager* archetype_manager, SharedComponentList* shared_components)
+    {
+        u32 type_count = reader.read<u32>();
+        for (u32 t = 0; t < type_count && !reader.has_error(); ++t)
+        {
+            u32 length;
+            char const* name = reader.read_string(length);
+            u64 size = reader.read<u64>();
+            bool trivially_copyable = reader.read<u8>();
+            Type const* type = name == nullptr ? nullptr : find_type_by_name(name, length);
+            if (type == nullptr || type->size() != size || type->is_trivially_copyable() != trivially_copyable)
+            {
+                log_debug("Image references an unknown or incompatible component type");
+                return false;
+            }
+            stored_types.append(type);
+        }
+
+        u32 shared_count = reader.read<u32>();
+        for (u32 s = 0; s < shared_count && !reader.has_error(); ++s)
+        {
+            u32 length;
+            char const* name = reader.read_string(length);
+            u64 size = reader.read<u64>();
+            u8 const* data = reader.read_in_place(size);
+            if (archetype_manager == nullptr || reader.has_error())
+                continue;
+
+            Type const* type = name == nullptr ? nullptr : find_type_by_name(name, length);
+            if (type == nullptr || type->size() != size || !type->is_trivially_copyable())
+            {
+                log_debug("Image references an unknown or incompatible shared component type");
+                return false;
+            }
+            shared_components->append(archetype_manager->intern_shared_component(type, data));
+        }
+        if (shared_components != nullptr)
+            sort(*shared_components, [](SharedComponent const* a, SharedComponent const* b)
+                { return a->type->id() < b->type->id(); });
+        return !reader.has_error();
+    }
+
+    u64 detail::minimum_row_size(ComponentList const& stored_types)
+    {
+        u64 size = sizeof(EntityID);
+        for (Type const* type : stored_types)
+        {
+            if (type->is_trivially_copyable())
+                size += type->size();
+        }
+        return size;
+    }
+
+    template<typename T>
+    static void write_column(ChunkedBuffer<T>& buffer, BinaryWriter& writer)
+    {
+        Type const* type = buffer.type();
+        if (type->is_trivially_copyable())
+        {
+            for (u64 chunk = 0; chunk * buffer.chunk_size() < buffer.size(); ++chunk)
+            {
+                u64 rows = buffer.size() - chunk * buffer.chunk_size();
+                if (rows > buffer.chunk_size())
+                    rows = buffer.chunk_size();
+                writer.write(buffer.get_buffer_data(chunk), rows * type->size());
+            }
+            return;
+        }
+
+        VERIFY(type->has_serialization_hooks());
+        for (u64 i = 0; i < buffer.size(); ++i)
+            type->serialize(buffer[i], writer);
+    }
+
+    template<typename T>
+    static void read_column(ChunkedBuffer<T>& buffer, u64 count, BinaryReader& reader)
+    {
+        Type const* type = buffer.type();
+        u64 first = buffer.size();
+        buffer.append_uninitialized(count);
+        if (type->is_trivially_copyable())
+        {
+            // Restored archetypes start empty, so rows line up with chunk boundaries
+            VERIFY(first == 0);
+            for (u64 chunk = 0; chunk * buffer.chunk_size() < count; ++chunk)
+            {
+                u64 rows = count - chunk * buffer.chunk_size();
+                if (rows > buffer.chunk_size())
+                    rows = buffer.chunk_size();
+                reader.read(buffer.get_buffer_data(chunk), rows * type->size());
+            }
+            return;
+        }
+
+        for (u64 i = first; i < first + count; ++i)
+            type->deserialize(reader, buffer[i]);
+    }
+
+    void WorldSnapshot::write(Context& context, BinaryWriter& writer)
+    {
+        auto& archetypes = context.archetype_manager().archetypes();
+        writer.write(MAGIC);
+        writer.write(VERSION);
+        writer.write<u64>(archetypes.size());
+
+        for (Archetype* archetype : archetypes)
+        {
+            writer.write(archetype->id());
+            detail::write_archetype_signature(archetype, writer);
+
+            writer.write<u64>(archetype->size());
+            write_column(archetype->entity_buffer(), writer);
+            for (size_t column = 0; column < archetype->component_types().size(); ++column)
+                write_column(archetype->component_buffer(column), writer);
+        }
+    }
+
+    bool WorldSnapshot::read(Context& context, BinaryReader& reader)
+    {
+        if (reader.read<u32>() != MAGIC || reader.read<u32>() != VERSION)
+            return false;
+
+        auto& archetype_manager = context.archetype_manager();
+        archetype_manager.clear();
+
+        u64 archetype_count = reader.read<u64>();
+        for (u64 a = 0; a < archetype_count && !reader.has_error(); ++a)
+        {
+            u64 id = reader.read<u64>();
+            ComponentList stored_types;
+            SharedComponentList shared_components;
+            if (!detail::read_archetype_signature(reader, stored_types, &archetype_manager, &shared_components))
+            {
+                archetype_manager.clear();
+                return false;
+            }
+
+            // A corrupt count must fail here rather than drive the column allocations
+            u64 entity_count = reader.read<u64>();
+            if (reader.has_error() || entity_count > reader.remaining() / detail::minimum_row_size(stored_types))
+            {
+                archetype_manager.clear();
+                return false;
+            }
+
+            // Type ids depend on instantiation order, so the column order may differ from the one in the image
+            ComponentList sorted_types = stored_types;
+            sort(sorted_types, [](Type const* a, Type const* b)
+                { return a->id() < b->id(); });
+            Archetype* archetype = archetype_manager.create_archetype_with_id(id, sorted_types, shared_components);
+
+            read_column(archetype->entity_buffer(), entity_count, reader);
+            for (Type const* type : stored_types)
+                read_column(archetype->component_buffer(archetype->index_of_type(type)), entity_count, reader);
+        }
+
+        if (reader.has_error())
+        {
+            archetype_manager.clear();
+            return false;
+        }
+        return true;
+    }
+}
\ No newline at end of file
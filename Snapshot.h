@@ -0,0 +1,55 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "Context.h"
+#include "Serialization.h"
+#include "Archetype.h"
+#include "Types.h"
+
+namespace vengine
+{
+    namespace detail
+    {
+        // Component signature shared by snapshots and save files: type name, size and whether it's trivially copyable,
+        // followed by the values of the archetype's shared components
+        void write_archetype_signature(Archetype* archetype, BinaryWriter& writer);
+        // Resolves the stored types in stored order. Returns false if any of them is unknown or has changed.
+        // Shared values are interned into shared_components if an archetype manager is given and skipped otherwise
+        bool read_archetype_signature(BinaryReader& reader, ComponentList& stored_types, ArchetypeManager* archetype_manager = nullptr, SharedComponentList* shared_components = nullptr);
+        // Fewest bytes a row of these columns takes in an image. Bounds entity counts read from untrusted data
+        u64 minimum_row_size(ComponentList const& stored_types);
+    }
+
+    // Binary image of every archetype in a world: its component signature, entity ids and component columns.
+    // Trivially copyable columns are copied a chunk at a time, everything else goes through the hooks set with
+    // register_serialization_hooks. Components are identified by type name, so restoring in another process only
+    // requires the same component types to have been instantiated with type_of.
+    // Stable entity references are runtime handles and aren't part of the image.
+    class WorldSnapshot
+    {
+    public:
+        static constexpr u32 MAGIC = 0x504e5356; // "VSNP"
+        static constexpr u32 VERSION = 2;
+
+        static void write(Context& context, BinaryWriter& writer);
+        // Replaces the contents of the world with the image. Returns false if the image is malformed or references
+        // unknown component types. The world is left untouched if the header doesn't match and empty otherwise
+        static bool read(Context& context, BinaryReader& reader);
+    };
+}
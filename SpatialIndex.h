@@ -0,0 +1,369 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <Buffer.h>
+#include <Atomic.h>
+#include "Tasks.h"
+
+namespace vengine
+{
+    // Uniform hash grid over every entity with an enabled TPosition component. TPosition needs float x, y and z members.
+    // Submitting it rebuilds the grid from the chunk data: every chunk is hashed in parallel into a flat entry array,
+    // and the worker that finishes last groups the entries by bucket with a counting sort.
+    // There is no change tracking yet, so the rebuild always covers every matched chunk, but it's O(n).
+    // Queries are valid once is_ready() returns true and until the next submit.
+    template<typename TPosition>
+    class SpatialHashGrid : public Task
+    {
+    public:
+        explicit SpatialHashGrid(float cell_size, u32 bucket_count_log2 = 16) :
+            m_cell_size(cell_size), m_bucket_mask((1u << bucket_count_log2) - 1)
+        {
+            Optional<Buffer<u32>> buffer = Buffer<u32>::create_uninitialized(m_bucket_mask + 2, ChunkedBuffer<u8>::DATA_ALIGNMENT);
+            ENSURE(buffer.has_value());
+            m_bucket_start_buffer = std::move(buffer);
+            m_bucket_start = m_bucket_start_buffer.value().data();
+            __builtin_memset(m_bucket_start, 0, (m_bucket_mask + 2) * sizeof(u32));
+        }
+
+        void schedule_self(Context& context, WorkQueue& queue) override
+        {
+            m_query.update(context.archetype_manager());
+            // Entities with TPosition disabled are left out of the grid
+            u64 chunk_count = 0;
+            m_count = 0;
+            detail::for_each_chunk(m_query, [&](auto const& match, size_t chunk, u64 rows)
+                {
+                u64 enabled = Query::enabled_row_count(match, chunk, rows);
+                chunk_count += enabled != 0;
+                m_count += enabled; });
+            ensure_capacity(m_count);
+            m_pending.store(chunk_count, MemoryOrder::Release);
+            if (chunk_count == 0)
+            {
+                build_buckets();
+                return;
+            }
+
+            u64 base_index = 0;
+            detail::for_each_chunk(m_query, [&](auto const& match, size_t chunk, u64 rows)
+                {
+                u64 enabled = Query::enabled_row_count(match, chunk, rows);
+                if (enabled == 0)
+                    return;
+                EntityID const* entities = Query::entities(match, chunk);
+                TPosition const* positions = Query::template buffer<TPosition>(match, chunk);
+                queue.enqueue([=, this]()
+                    {
+                    Entry* entry = m_entries + base_index;
+                    Query::for_each_enabled_row(match, chunk, 0, rows, [&](u64 i)
+                        {
+                        entry->entity = entities[i];
+                        entry->x = positions[i].x;
+                        entry->y = positions[i].y;
+                        entry->z = positions[i].z;
+                        entry->cell = cell_of(entry->x, entry->y, entry->z);
+                        entry++; });
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        build_buckets(); });
+                base_index += enabled; });
+        }
+
+        void component_access(Vector<ComponentAccess>& access) const override
+        {
+            access.append(ComponentAccess { type_of<TPosition>(), true });
+        }
+
+        bool is_ready() const
+        {
+            return is_complete();
+        }
+
+        // Appends every entity within radius of the point
+        void query_range(float x, float y, float z, float radius, Vector<EntityID>& out) const
+        {
+            Cell min = cell_of(x - radius, y - radius, z - radius);
+            Cell max = cell_of(x + radius, y + radius, z + radius);
+            float radius_squared = radius * radius;
+            for_each_cell(min, max, [&](Entry const& entry)
+                {
+                if (distance_squared(entry, x, y, z) <= radius_squared)
+                    out.append(entry.entity); });
+        }
+
+        // Appends the k entities closest to the point, closest first
+        void query_nearest(float x, float y, float z, u32 k, Vector<EntityID>& out) const
+        {
+            if (k == 0 || m_count == 0)
+                return;
+
+            // Past the cell limit the point isn't inside its cell and the ring bound below doesn't hold
+            if (!within_cell_limit(x, y, z))
+            {
+                nearest_linear(x, y, z, k, out);
+                return;
+            }
+
+            // Ring r is the shell of cells exactly r cells away from the center, so every cell is visited once
+            Cell center = cell_of(x, y, z);
+            Vector<Candidate> candidates;
+            u64 visited_cells = 0;
+            for (i32 ring = 0;; ++ring)
+            {
+                // Big sparse rings cost more than looking at every entry once
+                u64 side = 2 * (u64)ring + 1;
+                u64 shell_cells = ring == 0 ? 1 : side * side * side - (side - 2) * (side - 2) * (side - 2);
+                if (visited_cells + shell_cells > m_count + NEAREST_MIN_CELL_BUDGET)
+                {
+                    nearest_linear(x, y, z, k, out);
+                    return;
+                }
+                visited_cells += shell_cells;
+
+                for_each_shell_cell(center, ring, [&](Entry const& entry)
+                    { candidates.append(Candidate { distance_squared(entry, x, y, z), entry.entity }); });
+
+                // Anything outside the searched cube is more than ring cells away from the point
+                bool covers_grid = center.x - ring <= m_min_cell.x && center.y - ring <= m_min_cell.y && center.z - ring <= m_min_cell.z
+                    && center.x + ring >= m_max_cell.x && center.y + ring >= m_max_cell.y && center.z + ring >= m_max_cell.z;
+                if (covers_grid || candidates.size() == m_count)
+                    break;
+                if (candidates.size() < k)
+                    continue;
+                sort_candidates(candidates);
+                float searched_radius = ring * m_cell_size;
+                if (candidates[k - 1].distance_squared <= searched_radius * searched_radius)
+                    break;
+            }
+
+            sort_candidates(candidates);
+            for (size_t i = 0; i < candidates.size() && i < k; ++i)
+                out.append(candidates[i].entity);
+        }
+
+    private:
+        struct Cell
+        {
+            i32 x, y, z;
+
+            bool operator==(Cell const& other) const
+            {
+                return x == other.x && y == other.y && z == other.z;
+            }
+        };
+
+        struct Entry
+        {
+            EntityID entity;
+            float x, y, z;
+            Cell cell;
+        };
+
+        struct Candidate
+        {
+            float distance_squared;
+            EntityID entity;
+        };
+
+        // Cells are clamped to this so ring arithmetic can't overflow, NaN ends up on the lower limit
+        static constexpr float CELL_LIMIT = 1 << 20;
+        static constexpr u64 NEAREST_MIN_CELL_BUDGET = 64;
+
+        i32 cell_coordinate(float value) const
+        {
+            float cell = __builtin_floorf(value / m_cell_size);
+            if (!(cell > -CELL_LIMIT))
+                cell = -CELL_LIMIT;
+            if (!(cell < CELL_LIMIT))
+                cell = CELL_LIMIT;
+            return (i32)cell;
+        }
+
+        Cell cell_of(float x, float y, float z) const
+        {
+            return Cell { cell_coordinate(x), cell_coordinate(y), cell_coordinate(z) };
+        }
+
+        static Cell min_cell_of(Cell const& a, Cell const& b)
+        {
+            return Cell { a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z };
+        }
+
+        static Cell max_cell_of(Cell const& a, Cell const& b)
+        {
+            return Cell { a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z };
+        }
+
+        bool within_cell_limit(float x, float y, float z) const
+        {
+            auto within = [&](float value)
+                {
+                float cell = __builtin_floorf(value / m_cell_size);
+                return cell > -CELL_LIMIT && cell < CELL_LIMIT; };
+            return within(x) && within(y) && within(z);
+        }
+
+        static void sort_candidates(Vector<Candidate>& candidates)
+        {
+            sort(candidates, [](Candidate const& a, Candidate const& b)
+                { return a.distance_squared < b.distance_squared; });
+        }
+
+        void nearest_linear(float x, float y, float z, u32 k, Vector<EntityID>& out) const
+        {
+            Vector<Candidate> candidates;
+            for (u64 i = 0; i < m_count; ++i)
+                candidates.append(Candidate { distance_squared(m_sorted[i], x, y, z), m_sorted[i].entity });
+            sort_candidates(candidates);
+            for (size_t i = 0; i < candidates.size() && i < k; ++i)
+                out.append(candidates[i].entity);
+        }
+
+        u32 bucket_of(Cell const& cell) const
+        {
+            return ((u32)cell.x * 73856093u ^ (u32)cell.y * 19349663u ^ (u32)cell.z * 83492791u) & m_bucket_mask;
+        }
+
+        static float distance_squared(Entry const& entry, float x, float y, float z)
+        {
+            float dx = entry.x - x;
+            float dy = entry.y - y;
+            float dz = entry.z - z;
+            return dx * dx + dy * dy + dz * dz;
+        }
+
+        template<typename TCallback>
+        void for_each_entry_in_cell(Cell const& cell, TCallback& callback) const
+        {
+            u32 bucket = bucket_of(cell);
+            // Several cells can share a bucket, only report the entries of this one
+            for (u32 i = m_bucket_start[bucket]; i < m_bucket_start[bucket + 1]; ++i)
+            {
+                if (m_sorted[i].cell == cell)
+                    callback(m_sorted[i]);
+            }
+        }
+
+        // Visits the cells of the box, clipped to the occupied extent of the grid
+        template<typename TCallback>
+        void for_each_cell(Cell const& min, Cell const& max, TCallback&& callback) const
+        {
+            if (m_count == 0)
+                return;
+            Cell low = max_cell_of(min, m_min_cell);
+            Cell high = min_cell_of(max, m_max_cell);
+            for (i32 cx = low.x; cx <= high.x; ++cx)
+                for (i32 cy = low.y; cy <= high.y; ++cy)
+                    for (i32 cz = low.z; cz <= high.z; ++cz)
+                        for_each_entry_in_cell(Cell { cx, cy, cz }, callback);
+        }
+
+        // Visits the cells exactly ring cells away from the center, clipped to the occupied extent of the grid
+        template<typename TCallback>
+        void for_each_shell_cell(Cell const& center, i32 ring, TCallback&& callback) const
+        {
+            Cell low = max_cell_of(Cell { center.x - ring, center.y - ring, center.z - ring }, m_min_cell);
+            Cell high = min_cell_of(Cell { center.x + ring, center.y + ring, center.z + ring }, m_max_cell);
+            for (i32 cx = low.x; cx <= high.x; ++cx)
+                for (i32 cy = low.y; cy <= high.y; ++cy)
+                {
+                    bool on_shell = cx == center.x - ring || cx == center.x + ring || cy == center.y - ring || cy == center.y + ring;
+                    if (on_shell)
+                    {
+                        for (i32 cz = low.z; cz <= high.z; ++cz)
+                            for_each_entry_in_cell(Cell { cx, cy, cz }, callback);
+                        continue;
+                    }
+                    // Inside the shell only the two z faces are new
+                    if (center.z - ring >= low.z && center.z - ring <= high.z)
+                        for_each_entry_in_cell(Cell { cx, cy, center.z - ring }, callback);
+                    if (ring != 0 && center.z + ring >= low.z && center.z + ring <= high.z)
+                        for_each_entry_in_cell(Cell { cx, cy, center.z + ring }, callback);
+                }
+        }
+
+        void ensure_capacity(u64 count)
+        {
+            if (count <= m_capacity && m_entries != nullptr)
+                return;
+            u64 capacity = count > 1024 ? count + count / 2 : 1024;
+            Optional<Buffer<Entry>> entries = Buffer<Entry>::create_uninitialized(capacity, ChunkedBuffer<u8>::DATA_ALIGNMENT);
+            Optional<Buffer<Entry>> sorted = Buffer<Entry>::create_uninitialized(capacity, ChunkedBuffer<u8>::DATA_ALIGNMENT);
+            ENSURE(entries.has_value() && sorted.has_value());
+            m_entries_buffer = std::move(entries);
+            m_sorted_buffer = std::move(sorted);
+            m_entries = m_entries_buffer.value().data();
+            m_sorted = m_sorted_buffer.value().data();
+            m_capacity = capacity;
+        }
+
+        // Counting sort of the entries by bucket
+        void build_buckets()
+        {
+            u32* bucket_start = m_bucket_start;
+            u32 bucket_count = m_bucket_mask + 1;
+            __builtin_memset(bucket_start, 0, (bucket_count + 1) * sizeof(u32));
+
+            Entry const* entries = m_entries;
+            Entry* sorted = m_sorted;
+            Cell min_cell { 0, 0, 0 };
+            Cell max_cell { -1, -1, -1 };
+            if (m_count != 0)
+                min_cell = max_cell = entries[0].cell;
+            for (u64 i = 0; i < m_count; ++i)
+            {
+                Cell const& cell = entries[i].cell;
+                min_cell = min_cell_of(min_cell, cell);
+                max_cell = max_cell_of(max_cell, cell);
+                bucket_start[bucket_of(cell) + 1]++;
+            }
+            m_min_cell = min_cell;
+            m_max_cell = max_cell;
+            for (u32 bucket = 0; bucket < bucket_count; ++bucket)
+                bucket_start[bucket + 1] += bucket_start[bucket];
+            // bucket_start[b] is used as the insertion cursor of b and ends up pointing at the start of b + 1
+            for (u64 i = 0; i < m_count; ++i)
+                sorted[bucket_start[bucket_of(entries[i].cell)]++] = entries[i];
+            for (u32 bucket = bucket_count; bucket > 0; --bucket)
+                bucket_start[bucket] = bucket_start[bucket - 1];
+            bucket_start[0] = 0;
+
+            notify_complete();
+        }
+
+        using Query = detail::ArchetypeQuery<TPosition>;
+        Query m_query;
+        float m_cell_size;
+        u32 m_bucket_mask;
+        u64 m_count { 0 };
+        u64 m_capacity { 0 };
+        Optional<Buffer<Entry>> m_entries_buffer;
+        Optional<Buffer<Entry>> m_sorted_buffer;
+        Optional<Buffer<u32>> m_bucket_start_buffer;
+        // Enabled entities in query order, filled by the workers
+        Entry* m_entries { nullptr };
+        // m_entries grouped by bucket, bucket b spans [m_bucket_start[b], m_bucket_start[b + 1])
+        Entry* m_sorted { nullptr };
+        u32* m_bucket_start { nullptr };
+        // Occupied extent of the grid, queries don't look at cells outside of it
+        Cell m_min_cell { 0, 0, 0 };
+        Cell m_max_cell { -1, -1, -1 };
+        Atomic<u64> m_pending { 0 };
+    };
+}
@@ -21,6 +21,8 @@
 #include <SmartPtr.h>
 #include "System.h"
 #include "Context.h"
+#include "Log.h"
+#include "MemoryTracker.h"
 
 namespace vengine
 {
@@ -34,7 +36,7 @@ namespace vengine
         void on_update() override
         {
             if (m_counter++ % 50000 == 0)
-                __builtin_printf("Simulation %lu\n", m_counter);
+                log_info("Simulation %lu", m_counter);
         }
 
         u64 m_counter {0};
@@ -67,6 +69,7 @@ namespace vengine
         void insert_next(System* sys)
         {
             SystemList* new_node = create<SystemList>(next, this, sys).release_nonnull().release();
+            MemoryTracker::the().record_allocation({ MemorySubsystem::Systems }, sizeof(SystemList));
             next = new_node;
         }
 
@@ -109,6 +112,7 @@ namespace vengine
             m_context(context),
             m_first(create<SystemList>(nullptr, nullptr, create<SimulationUpdateStartSystem>(context).release_nonnull().release()).release_nonnull().release())
         {
+            MemoryTracker::the().record_allocation({ MemorySubsystem::Systems }, sizeof(SystemList));
         }
 
         void register_system(System* system, System* execute_before = nullptr)
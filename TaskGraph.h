@@ -0,0 +1,141 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Vector.h>
+#include <Hashmap.h>
+#include "Tasks.h"
+#include "Context.h"
+
+namespace vengine
+{
+    // Dependency graph that is built once and submitted every frame. The tasks are owned by the caller and reused,
+    // so a system creates and wires them in on_register, then only updates their parameters and calls submit().
+    // The dependency walk and the dependent lists are built once. submit only resets every task's pending dependency
+    // count and enqueues the tasks without dependencies, the rest are enqueued by the completion of their last
+    // dependency. Every task runs exactly once per submit, even when several tasks share a dependency.
+    // Tasks whose component_access conflicts are never run at the same time, see wire().
+    // Call invalidate() after changing a task's dependencies, and don't submit again before every task is complete
+    class TaskGraph
+    {
+    public:
+        template<ConvertibleTo<Task*>... TTasks>
+        void add(TTasks... tasks)
+        {
+            (m_roots.append(tasks), ...);
+            invalidate();
+        }
+
+        void invalidate()
+        {
+            m_built = false;
+        }
+
+        void submit(Context& context)
+        {
+            schedule(context, context.task_queue());
+        }
+
+        void schedule(Context& context, WorkQueue& queue)
+        {
+            if (!m_built)
+                build();
+            // A task scheduled on its own or by another graph in the meantime was rewired for that submission
+            for (Task* task : m_order)
+            {
+                if (task->m_wired_by != this)
+                {
+                    wire();
+                    break;
+                }
+            }
+            Task::arm(m_order);
+            Task::release(m_order, context, queue);
+        }
+
+        // Every task reachable from the roots, dependencies first
+        Vector<Task*> const& order()
+        {
+            if (!m_built)
+                build();
+            return m_order;
+        }
+
+    private:
+        enum class VisitState : u8
+        {
+            InProgress,
+            Done
+        };
+
+        void build()
+        {
+            m_order.clear();
+            Hashmap<Task*, VisitState> states(16, 64);
+            for (Task* root : m_roots)
+                visit(root, states);
+            wire();
+            m_built = true;
+        }
+
+        // Tasks that touch the same component, at least one of them writing it, would run at the same time unless
+        // one depends on the other. They're serialized in graph order instead, which can't introduce a cycle
+        void wire()
+        {
+            Task::wire(m_order, this);
+            for (size_t i = 0; i < m_order.size(); ++i)
+            {
+                for (size_t j = i + 1; j < m_order.size(); ++j)
+                {
+                    if (!depends_directly(m_order[j], m_order[i]) && m_order[i]->conflicts_with(*m_order[j]))
+                        Task::order_after(m_order[i], m_order[j]);
+                }
+            }
+        }
+
+        static bool depends_directly(Task const* task, Task const* dependency)
+        {
+            for (Task* candidate : task->dependencies())
+            {
+                if (candidate == dependency)
+                    return true;
+            }
+            return false;
+        }
+
+        void visit(Task* task, Hashmap<Task*, VisitState>& states)
+        {
+            auto state = states.get(task);
+            if (state.has_value())
+            {
+                // A task that is still in progress depends on itself
+                VERIFY(state.value() == VisitState::Done);
+                return;
+            }
+
+            states.insert(task, VisitState::InProgress);
+            for (Task* dependency : task->dependencies())
+                visit(dependency, states);
+            states.insert(task, VisitState::Done);
+            m_order.append(task);
+        }
+
+        Vector<Task*> m_roots;
+        Vector<Task*> m_order;
+        bool m_built { false };
+    };
+}
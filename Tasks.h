@@ -18,15 +18,138 @@
 
 #include <Vector.h>
 #include <Aligned.h>
+#include <Array.h>
+#include <Atomic.h>
 #include "WorkManager.h"
 #include "Archetype.h"
+#include "Context.h"
+#include "Clock.h"
 
 namespace vengine
 {
+    // Query terms. A plain T is a required component passed to execute as T&, T const is passed as T const&
+    // and tells the scheduler the task only reads it.
+    // Required, but not passed to execute
+    template<typename T>
+    struct With
+    {
+    };
+
+    // Archetypes that have T don't match
+    template<typename T>
+    struct Without
+    {
+    };
+
+    // Passed to execute as T*, null for every row of an archetype that doesn't have T
+    template<typename T>
+    struct OptionalComponent
+    {
+    };
+
+    // Matches archetypes with a shared T value, passed to execute as T const& pointing at the chunk's interned value
+    template<typename T>
+    struct Shared
+    {
+    };
+
+    struct ComponentAccess
+    {
+        Type const* type;
+        bool read_only;
+    };
+
+    class Task;
+
+    // Dependency list. The first few entries are stored inline so wiring a graph usually doesn't touch the heap,
+    // which also keeps tasks created in a FrameArena allocation free
+    class TaskList
+    {
+    public:
+        static constexpr size_t INLINE_CAPACITY = 4;
+
+        struct Iterator
+        {
+            TaskList const* list;
+            size_t index;
+
+            Task* operator*() const
+            {
+                return (*list)[index];
+            }
+
+            Iterator& operator++()
+            {
+                index++;
+                return *this;
+            }
+
+            bool operator!=(Iterator const& other) const
+            {
+                return index != other.index;
+            }
+        };
+
+        void append(Task* task)
+        {
+            if (m_size < INLINE_CAPACITY)
+                m_inline[m_size] = task;
+            else
+                m_overflow.append(task);
+            m_size++;
+        }
+
+        Task* operator[](size_t index) const
+        {
+            return index < INLINE_CAPACITY ? m_inline[index] : m_overflow[index - INLINE_CAPACITY];
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        Iterator begin() const
+        {
+            return { this, 0 };
+        }
+
+        Iterator end() const
+        {
+            return { this, m_size };
+        }
+
+        void clear()
+        {
+            m_overflow.clear();
+            m_size = 0;
+        }
+
+    private:
+        Array<Task*, INLINE_CAPACITY> m_inline {};
+        Vector<Task*> m_overflow;
+        size_t m_size { 0 };
+    };
+
     class Task
     {
     public:
-        virtual void schedule(Context&, WorkQueue&) = 0;
+        virtual ~Task() = default;
+
+        // Enqueues the task's own work. Implementations call notify_complete() once the last of it has run
+        virtual void schedule_self(Context&, WorkQueue&) = 0;
+
+        // Schedules the task and everything it depends on. A task is only enqueued once all of its dependencies have
+        // completed, and a dependency shared by several tasks runs once. Use a TaskGraph to avoid the dependency walk
+        // every frame. The tasks must not be scheduled again until they're complete
+        void schedule(Context& context, WorkQueue& queue)
+        {
+            Vector<Task*> tasks;
+            collect(tasks, s_next_submission.fetch_add(1, MemoryOrder::Relaxed) + 1);
+            wire(tasks, nullptr);
+            arm(tasks);
+            release(tasks, context, queue);
+        }
 
         template<ConvertibleTo<Task*>... Dependencies>
         void depends_on(Dependencies... dependencies)
@@ -34,225 +157,917 @@ namespace vengine
             (m_dependencies.append(dependencies), ...);
         }
 
+        TaskList const& dependencies() const
+        {
+            return m_dependencies;
+        }
+
         void submit(Context& context)
         {
-            schedule(context, context.work_manager().task_queue());
+            schedule(context, context.task_queue());
+        }
+
+        bool is_complete() const
+        {
+            return m_complete.load(MemoryOrder::Acquire);
+        }
+
+        // Components the task touches. Tasks that only read a component can run alongside each other
+        virtual void component_access(Vector<ComponentAccess>&) const
+        {
+        }
+
+        // True if one of the tasks writes a component the other one reads or writes. TaskGraph orders conflicting tasks
+        // that don't depend on each other, a plain schedule() only follows the declared dependencies
+        bool conflicts_with(Task const& other) const
+        {
+            Vector<ComponentAccess> ours;
+            Vector<ComponentAccess> theirs;
+            component_access(ours);
+            other.component_access(theirs);
+            for (auto const& a : ours)
+            {
+                for (auto const& b : theirs)
+                {
+                    if (a.type == b.type && (!a.read_only || !b.read_only))
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        // Called once, on the worker that completes the next submission. Must be set before the task is submitted
+        void on_complete(void (*callback)(void*), void* user_data)
+        {
+            m_on_complete = callback;
+            m_on_complete_data = user_data;
         }
 
     protected:
-        Vector<Task*> m_dependencies;
+        // Every schedule_self ends in exactly one call, after the task's results are written. Enqueues the dependents
+        // that were only waiting for this task. The task can be resubmitted as soon as is_complete() returns true,
+        // so nothing is touched after publishing it
+        void notify_complete()
+        {
+            for (Task* dependent : m_dependents)
+            {
+                if (dependent->m_pending_dependencies.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                    dependent->schedule_self(*dependent->m_context, *dependent->m_queue);
+            }
+            auto callback = m_on_complete;
+            void* user_data = m_on_complete_data;
+            m_on_complete = nullptr;
+            m_complete.store(true, MemoryOrder::Release);
+            if (callback)
+                callback(user_data);
+        }
+
+        // For tasks that fan out into jobs. The task holds one extra count while it enqueues, so it can't complete
+        // before the last job is in the queue: call begin_jobs(), add_job() per job, finish_job() at the end of every
+        // job and once more after enqueuing the last one
+        void begin_jobs()
+        {
+            m_pending_jobs.store(1, MemoryOrder::Relaxed);
+        }
+
+        void add_job()
+        {
+            m_pending_jobs.fetch_add(1, MemoryOrder::Relaxed);
+        }
+
+        void finish_job()
+        {
+            if (m_pending_jobs.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                notify_complete();
+        }
+
+        // Every task reachable from this one, dependencies first. A cycle would never be released
+        void collect(Vector<Task*>& tasks, u64 submission)
+        {
+            if (m_submission == submission)
+                return;
+            m_submission = submission;
+            for (Task* dependency : m_dependencies)
+                dependency->collect(tasks, submission);
+            tasks.append(this);
+        }
+
+        // Builds the dependent lists of a dependency closed set of tasks. owner identifies who wired them last
+        static void wire(Vector<Task*> const& tasks, void const* owner)
+        {
+            for (Task* task : tasks)
+            {
+                task->m_dependents.clear();
+                task->m_dependency_count = (u32)task->m_dependencies.size();
+                task->m_wired_by = owner;
+            }
+            for (Task* task : tasks)
+            {
+                for (Task* dependency : task->m_dependencies)
+                    dependency->m_dependents.append(task);
+            }
+        }
+
+        // Makes after wait for before as if it depended on it. Only valid between wire and arm
+        static void order_after(Task* before, Task* after)
+        {
+            before->m_dependents.append(after);
+            after->m_dependency_count++;
+        }
+
+        static void arm(Vector<Task*> const& tasks)
+        {
+            for (Task* task : tasks)
+            {
+                task->m_complete.store(false, MemoryOrder::Relaxed);
+                task->m_pending_dependencies.store(task->m_dependency_count, MemoryOrder::Relaxed);
+            }
+        }
+
+        // Every task gets its context before the first one starts, completions can release dependents right away
+        static void release(Vector<Task*> const& tasks, Context& context, WorkQueue& queue)
+        {
+            for (Task* task : tasks)
+            {
+                task->m_context = &context;
+                task->m_queue = &queue;
+            }
+            for (Task* task : tasks)
+            {
+                if (task->m_dependency_count == 0)
+                    task->schedule_self(context, queue);
+            }
+        }
+
+        TaskList m_dependencies;
+
+    private:
+        friend class TaskGraph;
+
+        static inline Atomic<u64> s_next_submission { 0 };
+
+        TaskList m_dependents;
+        // Declared dependencies plus the ordering a TaskGraph added
+        u32 m_dependency_count { 0 };
+        Atomic<u32> m_pending_dependencies { 0 };
+        Atomic<u32> m_pending_jobs { 0 };
+        Atomic<bool> m_complete { false };
+        Context* m_context { nullptr };
+        WorkQueue* m_queue { nullptr };
+        u64 m_submission { 0 };
+        void const* m_wired_by { nullptr };
+        void (*m_on_complete)(void*) { nullptr };
+        void* m_on_complete_data { nullptr };
     };
 
     template<typename TTask>
     class SingleTask : public Task
     {
     public:
-        void schedule(Context& context, WorkQueue& queue) override
+        void schedule_self(Context& context, WorkQueue& queue) override
         {
-            for (Task* task : m_dependencies)
-                task->schedule(context, queue);
-
             queue.enqueue([this]()
-                { static_cast<TTask*>(this)->execute(); });
+                {
+                static_cast<TTask*>(this)->execute();
+                notify_complete(); });
         }
     };
 
-    template<typename TTask, typename... TComponents>
-    class ParallelTask : public Task
+    // Low priority work split into resumable slices, e.g. streaming or pathfinding. TTask implements
+    //   bool run_slice(u64 deadline_ns)
+    // which works until monotonic_time_ns() reaches the deadline and returns true once everything is done.
+    // Slices run in the background lane, so only on workers with no frame-critical work and within the frame's
+    // background budget. An unfinished task is requeued and continues in a later slice, possibly in a later frame
+    template<typename TTask>
+    class BackgroundTask : public Task
     {
     public:
-        void schedule(Context& context, WorkQueue& queue) override
+        void schedule_self(Context&, WorkQueue& queue) override
+        {
+            enqueue_slice(queue);
+        }
+
+    protected:
+        // Upper bound for a single slice, the remaining budget can make it shorter
+        u64 m_slice_ns { 500'000 };
+
+    private:
+        void enqueue_slice(WorkQueue& queue)
+        {
+            WorkQueue* work_queue = &queue;
+            queue.enqueue_background([this, work_queue]()
+                {
+                u64 budget = work_queue->background_budget_remaining();
+                u64 slice = budget < m_slice_ns ? budget : m_slice_ns;
+                if (static_cast<TTask*>(this)->run_slice(monotonic_time_ns() + slice))
+                    notify_complete();
+                else
+                    enqueue_slice(*work_queue); });
+        }
+    };
+
+    namespace detail
+    {
+        template<typename T>
+        struct QueryTerm
+        {
+            using Component = T;
+            static constexpr bool required = true;
+            static constexpr bool excluded = false;
+            static constexpr bool passed = true;
+            static constexpr bool read_only = false;
+            static constexpr bool shared = false;
+
+            static T& argument(u8* column, u64 row)
+            {
+                return ((T*)column)[row];
+            }
+        };
+
+        template<typename T>
+        struct QueryTerm<T const> : QueryTerm<T>
+        {
+            static constexpr bool read_only = true;
+
+            static T const& argument(u8* column, u64 row)
+            {
+                return ((T const*)column)[row];
+            }
+        };
+
+        template<typename T>
+        struct QueryTerm<With<T>> : QueryTerm<T>
+        {
+            static constexpr bool passed = false;
+        };
+
+        template<typename T>
+        struct QueryTerm<Without<T>> : QueryTerm<T>
+        {
+            static constexpr bool required = false;
+            static constexpr bool excluded = true;
+            static constexpr bool passed = false;
+        };
+
+        template<typename T>
+        struct QueryTerm<OptionalComponent<T>> : QueryTerm<T>
         {
-            for (Task* task : m_dependencies)
-                task->schedule(context, queue);
+            static constexpr bool required = false;
 
-            auto system_execute_helper = [this](u64 iteration_start, u64 count, Aligned<TComponents*, 64>... components)
+            static T* argument(u8* column, u64 row)
             {
-                for (u64 i = iteration_start; i < count; ++i)
+                return column == nullptr ? nullptr : (T*)column + row;
+            }
+        };
+
+        // The column slot of the term holds the shared value itself, every row reads the same one
+        template<typename T>
+        struct QueryTerm<Shared<T>> : QueryTerm<T>
+        {
+            static constexpr bool required = false;
+            static constexpr bool shared = true;
+            static constexpr bool read_only = true;
+
+            static T const& argument(u8* column, u64)
+            {
+                return *(T const*)column;
+            }
+        };
+
+        // Calls callback(start, count) for every stride of a chunk. 0 iterations per stride means one stride per chunk
+        template<typename TCallback>
+        void for_each_stride(u64 count, u64 iterations_per_stride, TCallback&& callback)
+        {
+            if (iterations_per_stride == 0)
+                iterations_per_stride = count;
+            for (u64 start = 0; start < count; start += iterations_per_stride)
+                callback(start, count - start < iterations_per_stride ? count - start : iterations_per_stride);
+        }
+
+        // Archetypes matching a list of query terms, with the column of every component resolved once per archetype.
+        // Only rematches when the archetype manager reports a structural change.
+        template<typename... TTerms>
+        class ArchetypeQuery
+        {
+        public:
+            static constexpr size_t TERM_COUNT = sizeof...(TTerms);
+
+            struct Match
+            {
+                Archetype* archetype;
+                // INVALID_COLUMN for excluded terms and missing optional components
+                Array<u32, TERM_COUNT> columns;
+                // Interned value of Shared terms, null for the others
+                Array<u8 const*, TERM_COUNT> shared_values;
+            };
+
+            // Column buffers of one chunk in term order, null where there is no column
+            using ChunkColumns = Array<u8*, TERM_COUNT>;
+
+            // One stride of a chunk. base_index is the dense index of the chunk's first row across the whole query
+            struct WorkItem
+            {
+                u32 match;
+                u32 chunk;
+                u64 chunk_rows;
+                u64 start;
+                u64 count;
+                u64 base_index;
+            };
+
+            void update(ArchetypeManager& archetype_manager)
+            {
+                if (m_generation == archetype_manager.generation())
+                    return;
+
+                m_matches.clear();
+                for (Archetype* archetype : archetype_manager.archetypes())
                 {
-                    static_cast<TTask*>(this)->execute(components[i]...);
+                    if ((matches_term<TTerms>(archetype) && ...))
+                        m_matches.append(Match { archetype, { column_of_term<TTerms>(archetype)... }, { shared_value_of_term<TTerms>(archetype)... } });
                 }
-            };
-            for (Archetype* archetype : m_archetypes)
+                m_generation = archetype_manager.generation();
+            }
+
+            // Strides of every matched chunk, in archetype and chunk order. 0 iterations per stride means one stride per chunk.
+            // Kept across submits and only rebuilt when the matches, an archetype's entity count or the stride length change.
+            // Call update first
+            Vector<WorkItem> const& partition(u64 iterations_per_stride)
             {
-                const u64 chunk_size = Archetype::CHUNK_SIZE;
-                for (size_t chunk = 0; chunk < archetype->size() / Archetype::CHUNK_SIZE; ++chunk)
+                if (partition_is_valid(iterations_per_stride))
+                    return m_partition;
+
+                m_partition.clear();
+                m_partition_sizes.clear();
+                u64 base_index = 0;
+                for (size_t i = 0; i < m_matches.size(); ++i)
                 {
-                    u64 strides;
-                    u64 remaining_iterations;
-                    u64 iterations_per_stride;
-                    if (m_iterations_per_stride == 0)
-                    {
-                        strides = 1;
-                        remaining_iterations = 0;
-                        iterations_per_stride = chunk_size;
-                    }
-                    else
+                    const u64 size = m_matches[i].archetype->size();
+                    m_partition_sizes.append(size);
+                    for (size_t chunk = 0; chunk * Archetype::CHUNK_SIZE < size; ++chunk)
                     {
-                        strides = chunk_size / m_iterations_per_stride;
-                        remaining_iterations = chunk_size % m_iterations_per_stride;
-                        iterations_per_stride = m_iterations_per_stride;
+                        u64 remaining = size - chunk * Archetype::CHUNK_SIZE;
+                        u64 rows = remaining < Archetype::CHUNK_SIZE ? remaining : Archetype::CHUNK_SIZE;
+                        for_each_stride(rows, iterations_per_stride, [&](u64 start, u64 count)
+                            { m_partition.append(WorkItem { (u32)i, (u32)chunk, rows, start, count, base_index }); });
+                        base_index += rows;
                     }
+                }
+                m_partition_generation = m_generation;
+                m_partition_stride = iterations_per_stride;
+                m_partition_built = true;
+                return m_partition;
+            }
 
-                    for (u64 s = 0; s < strides; ++s)
-                    {
-                        queue.enqueue([=, this]()
-                            { system_execute_helper(s * iterations_per_stride, iterations_per_stride, archetype->template get_component_buffer<TComponents>(chunk)...); });
-                    }
-                    if (remaining_iterations > 0)
+            template<typename TComponent>
+            static TComponent* buffer(Match const& match, size_t chunk)
+            {
+                return (TComponent*)match.archetype->get_column_buffer(match.columns[PackIndex<TComponent, TTerms...>::value], chunk);
+            }
+
+            static EntityID* entities(Match const& match, size_t chunk)
+            {
+                return (EntityID*)match.archetype->entity_buffer().get_buffer_data(chunk);
+            }
+
+            static ChunkColumns chunk_columns(Match const& match, size_t chunk)
+            {
+                ChunkColumns columns;
+                for (size_t i = 0; i < TERM_COUNT; ++i)
+                    columns[i] = match.columns[i] == Archetype::INVALID_COLUMN || !s_passed[i] ? nullptr : match.archetype->get_column_buffer(match.columns[i], chunk);
+                for (size_t i = 0; i < TERM_COUNT; ++i)
+                {
+                    if (s_shared[i])
+                        columns[i] = (u8*)match.shared_values[i];
+                }
+                return columns;
+            }
+
+            // Calls callback with the arguments of the passed terms for the given row
+            template<typename TCallback>
+            static void invoke(ChunkColumns const& columns, u64 row, TCallback&& callback)
+            {
+                invoke_from<0, TTerms...>(columns, row, callback);
+            }
+
+            // False if one of the required components is disabled on every row of the chunk
+            static bool has_enabled_rows(Match const& match, size_t chunk, u64 count)
+            {
+                for (size_t i = 0; i < TERM_COUNT; ++i)
+                {
+                    if (s_required[i] && match.archetype->disabled_count(match.columns[i], chunk) == count)
+                        return false;
+                }
+                return true;
+            }
+
+            // Number of rows for_each_enabled_row visits in the first count rows of the chunk
+            static u64 enabled_row_count(Match const& match, size_t chunk, u64 count)
+            {
+                size_t masked_terms = 0;
+                u64 disabled = 0;
+                for (size_t i = 0; i < TERM_COUNT; ++i)
+                {
+                    if (!s_required[i] || match.archetype->disabled_count(match.columns[i], chunk) == 0)
+                        continue;
+                    masked_terms++;
+                    disabled = match.archetype->disabled_count(match.columns[i], chunk);
+                }
+                if (masked_terms == 0)
+                    return count;
+                // A single mask is counted by the archetype, several have to be intersected
+                if (masked_terms == 1)
+                    return count - disabled;
+                u64 enabled = 0;
+                for_each_enabled_row(match, chunk, 0, count, [&](u64)
+                    { enabled++; });
+                return enabled;
+            }
+
+            // Calls callback(row) for every row in [start, start + count) of the chunk where all required components are enabled.
+            // Chunks without disabled rows take a plain loop, the others AND the column masks and bit-scan them
+            template<typename TCallback>
+            static void for_each_enabled_row(Match const& match, size_t chunk, u64 start, u64 count, TCallback&& callback)
+            {
+                Array<u64 const*, TERM_COUNT> masks;
+                size_t mask_count = 0;
+                for (size_t i = 0; i < TERM_COUNT; ++i)
+                {
+                    if (!s_required[i])
+                        continue;
+                    if (u64 const* bits = match.archetype->enabled_bits(match.columns[i], chunk))
+                        masks[mask_count++] = bits;
+                }
+
+                u64 end = start + count;
+                if (mask_count == 0)
+                {
+                    for (u64 row = start; row < end; ++row)
+                        callback(row);
+                    return;
+                }
+
+                for (u64 word = start / 64; word * 64 < end; ++word)
+                {
+                    u64 first = word * 64;
+                    u64 bits = masks[0][word];
+                    for (size_t i = 1; i < mask_count; ++i)
+                        bits &= masks[i][word];
+                    if (start > first)
+                        bits &= ~0ull << (start - first);
+                    if (end - first < 64)
+                        bits &= (1ull << (end - first)) - 1;
+                    while (bits != 0)
                     {
-                        queue.enqueue([=, this]()
-                            { system_execute_helper(strides * iterations_per_stride, remaining_iterations, archetype->template get_component_buffer<TComponents>(chunk)...); });
+                        callback(first + __builtin_ctzll(bits));
+                        bits &= bits - 1;
                     }
                 }
-                u64 remaining_iterations_for_this_archetype = archetype->size() % chunk_size;
-                u64 strides;
-                u64 iterations_per_stride;
-                u64 remaining_iterations;
-                if (m_iterations_per_stride == 0)
+            }
+
+            // Components handed to execute, and whether they're only read
+            static void append_access(Vector<ComponentAccess>& access)
+            {
+                ((QueryTerm<TTerms>::passed ? access.append(ComponentAccess { type_of<typename QueryTerm<TTerms>::Component>(), QueryTerm<TTerms>::read_only }) : void()), ...);
+            }
+
+            Vector<Match> const& matches() const
+            {
+                return m_matches;
+            }
+
+            u64 entity_count() const
+            {
+                u64 count = 0;
+                for (auto const& match : m_matches)
+                    count += match.archetype->size();
+                return count;
+            }
+
+        private:
+            // The trailing entry keeps the arrays valid for an empty term list
+            static constexpr bool s_required[] = { QueryTerm<TTerms>::required..., false };
+            static constexpr bool s_passed[] = { QueryTerm<TTerms>::passed..., false };
+            static constexpr bool s_shared[] = { QueryTerm<TTerms>::shared..., false };
+
+            template<typename TTerm>
+            static u8 const* shared_value_of_term(Archetype* archetype)
+            {
+                if constexpr (QueryTerm<TTerm>::shared)
+                    return archetype->shared_component(type_of<typename QueryTerm<TTerm>::Component>())->data;
+                else
+                    return nullptr;
+            }
+
+            template<typename TTerm>
+            static bool matches_term(Archetype* archetype)
+            {
+                if constexpr (QueryTerm<TTerm>::shared)
+                    return archetype->shared_component(type_of<typename QueryTerm<TTerm>::Component>()) != nullptr;
+                bool has_type = archetype->has_type(type_of<typename QueryTerm<TTerm>::Component>());
+                if constexpr (QueryTerm<TTerm>::excluded)
+                    return !has_type;
+                else if constexpr (QueryTerm<TTerm>::required)
+                    return has_type;
+                else
+                    return true;
+            }
+
+            template<typename TTerm>
+            static u32 column_of_term(Archetype* archetype)
+            {
+                if constexpr (QueryTerm<TTerm>::excluded || QueryTerm<TTerm>::shared)
+                    return Archetype::INVALID_COLUMN;
+                else
+                    return archetype->column_of_type(type_of<typename QueryTerm<TTerm>::Component>());
+            }
+
+            template<size_t Index, typename TTerm, typename... TRest, typename TCallback, typename... TArguments>
+            static void invoke_from(ChunkColumns const& columns, u64 row, TCallback& callback, TArguments&&... arguments)
+            {
+                if constexpr (QueryTerm<TTerm>::passed)
                 {
-                    strides = 1;
-                    iterations_per_stride = remaining_iterations_for_this_archetype;
-                    remaining_iterations = 0;
+                    if constexpr (sizeof...(TRest) == 0)
+                        callback(static_cast<TArguments&&>(arguments)..., QueryTerm<TTerm>::argument(columns[Index], row));
+                    else
+                        invoke_from<Index + 1, TRest...>(columns, row, callback, static_cast<TArguments&&>(arguments)..., QueryTerm<TTerm>::argument(columns[Index], row));
                 }
                 else
                 {
-                    strides = remaining_iterations_for_this_archetype / m_iterations_per_stride;
-                    remaining_iterations = remaining_iterations_for_this_archetype % m_iterations_per_stride;
-                    iterations_per_stride = m_iterations_per_stride;
+                    if constexpr (sizeof...(TRest) == 0)
+                        callback(static_cast<TArguments&&>(arguments)...);
+                    else
+                        invoke_from<Index + 1, TRest...>(columns, row, callback, static_cast<TArguments&&>(arguments)...);
                 }
+            }
 
-                for (u64 s = 0; s < strides; ++s)
+            bool partition_is_valid(u64 iterations_per_stride) const
+            {
+                if (!m_partition_built || m_partition_generation != m_generation || m_partition_stride != iterations_per_stride)
+                    return false;
+                for (size_t i = 0; i < m_matches.size(); ++i)
                 {
-                    queue.enqueue([=, this]()
-                        { system_execute_helper(s * iterations_per_stride, iterations_per_stride, archetype->template get_component_buffer<TComponents>(archetype->size() / chunk_size)...); });
+                    if (m_partition_sizes[i] != m_matches[i].archetype->size())
+                        return false;
                 }
-                if (remaining_iterations > 0)
+                return true;
+            }
+
+            Vector<Match> m_matches;
+            u64 m_generation { 0 };
+            Vector<WorkItem> m_partition;
+            // Entity count of every match when the partition was built
+            Vector<u64> m_partition_sizes;
+            u64 m_partition_generation { 0 };
+            u64 m_partition_stride { 0 };
+            bool m_partition_built { false };
+        };
+
+        // Calls callback(match, chunk, count) for every chunk of every matched archetype
+        template<typename TQuery, typename TCallback>
+        void for_each_chunk(TQuery const& query, TCallback&& callback)
+        {
+            for (auto const& match : query.matches())
+            {
+                const u64 size = match.archetype->size();
+                for (size_t chunk = 0; chunk * Archetype::CHUNK_SIZE < size; ++chunk)
                 {
-                    queue.enqueue([=, this]()
-                        { system_execute_helper(strides * iterations_per_stride, remaining_iterations, archetype->template get_component_buffer<TComponents>(archetype->size() / chunk_size)...); });
+                    u64 remaining = size - chunk * Archetype::CHUNK_SIZE;
+                    callback(match, chunk, remaining < Archetype::CHUNK_SIZE ? remaining : Archetype::CHUNK_SIZE);
                 }
             }
         }
+    }
+
+    // TTerms is a list of query terms: components, T const, With<T>, Without<T>, OptionalComponent<T> and Shared<T>.
+    // TTask implements execute() taking the passed terms in order
+    template<typename TTask, typename... TTerms>
+    class ParallelTask : public Task
+    {
+    public:
+        void schedule_self(Context& context, WorkQueue& queue) override
+        {
+            auto system_execute_helper = [this](Match const& match, size_t chunk, u64 iteration_start, u64 count, ChunkColumns const& columns)
+            {
+                Query::for_each_enabled_row(match, chunk, iteration_start, count, [&](u64 i)
+                    { Query::invoke(columns, i, [this](auto&&... arguments)
+                          { static_cast<TTask*>(this)->execute(arguments...); }); });
+            };
+
+            m_query.update(context.archetype_manager());
+            begin_jobs();
+            for (auto const& item : m_query.partition(m_iterations_per_stride))
+            {
+                Match const& match = m_query.matches()[item.match];
+                if (!Query::has_enabled_rows(match, item.chunk, item.chunk_rows))
+                    continue;
+                ChunkColumns columns = Query::chunk_columns(match, item.chunk);
+                add_job();
+                queue.enqueue_on_node([=, this]()
+                    {
+                    system_execute_helper(match, item.chunk, item.start, item.count, columns);
+                    finish_job(); }, match.archetype->numa_node());
+            }
+            finish_job();
+        }
+
+        void component_access(Vector<ComponentAccess>& access) const override
+        {
+            Query::append_access(access);
+        }
 
     private:
-        Vector<Archetype*> m_archetypes;
+        using Query = detail::ArchetypeQuery<TTerms...>;
+        using Match = typename Query::Match;
+        using ChunkColumns = typename Query::ChunkColumns;
+        Query m_query;
         u64 m_iterations_per_stride { 0 };
     };
 
-    template<typename TTask, typename... TComponents>
+    // TTask implements either execute(u64 index, ...) or execute(u64 index, EntityID entity, ...) followed by the passed terms.
+    // index is dense across the whole query: archetypes and chunks are numbered in the order matched_entity_count()
+    // counts them, so it can be used directly to write into a preallocated output array.
+    template<typename TTask, typename... TTerms>
     class ParallelTaskWithIndex : public Task
     {
     public:
-        void schedule(Context& context, WorkQueue& queue) override
+        void schedule_self(Context& context, WorkQueue& queue) override
         {
-            for (Task* task : m_dependencies)
-                task->schedule(context, queue);
-            auto system_execute_helper = [this](u64 iteration_start, u64 count, Aligned<TComponents*, 64>... components)
+            auto system_execute_helper = [this](Match const& match, size_t chunk, u64 base_index, u64 iteration_start, u64 count, EntityID const* entities, ChunkColumns const& columns)
             {
-                for (u64 i = iteration_start; i < count; ++i)
-                {
-                    static_cast<TTask*>(this)->execute(i, components[i]...);
-                }
+                Query::for_each_enabled_row(match, chunk, iteration_start, count, [&](u64 i)
+                    { Query::invoke(columns, i, [&](auto&&... arguments)
+                          {
+                          TTask* task = static_cast<TTask*>(this);
+                          if constexpr (requires { task->execute(u64 {}, EntityID {}, arguments...); })
+                              task->execute(base_index + i, entities[i], arguments...);
+                          else
+                              task->execute(base_index + i, arguments...); }); });
             };
-            for (Archetype* archetype : m_archetypes)
+
+            m_query.update(context.archetype_manager());
+            begin_jobs();
+            // Chunk base offsets come from the cached partition so workers don't need to look anything up per entity
+            for (auto const& item : m_query.partition(m_iterations_per_stride))
             {
-                const u64 chunk_size = Archetype::CHUNK_SIZE;
-                for (size_t chunk = 0; chunk < archetype->size() / Archetype::CHUNK_SIZE; ++chunk)
-                {
-                    u64 strides;
-                    u64 remaining_iterations;
-                    u64 iterations_per_stride;
-                    if (m_iterations_per_stride == 0)
+                Match const& match = m_query.matches()[item.match];
+                if (!Query::has_enabled_rows(match, item.chunk, item.chunk_rows))
+                    continue;
+                EntityID const* entities = Query::entities(match, item.chunk);
+                ChunkColumns columns = Query::chunk_columns(match, item.chunk);
+                add_job();
+                queue.enqueue_on_node([=, this]()
                     {
-                        strides = 1;
-                        remaining_iterations = 0;
-                        iterations_per_stride = chunk_size;
-                    }
-                    else
-                    {
-                        strides = chunk_size / m_iterations_per_stride;
-                        remaining_iterations = chunk_size % m_iterations_per_stride;
-                        iterations_per_stride = m_iterations_per_stride;
-                    }
+                    system_execute_helper(match, item.chunk, item.base_index, item.start, item.count, entities, columns);
+                    finish_job(); }, match.archetype->numa_node());
+            }
+            finish_job();
+        }
 
-                    for (u64 s = 0; s < strides; ++s)
-                    {
-                        queue.enqueue([=, this]()
-                            { system_execute_helper(s * iterations_per_stride, iterations_per_stride, archetype->template get_component_buffer<TComponents>(chunk)...); });
-                    }
-                    if (remaining_iterations > 0)
-                    {
-                        queue.enqueue([=, this]()
-                            { system_execute_helper(strides * iterations_per_stride, remaining_iterations, archetype->template get_component_buffer<TComponents>(chunk)...); });
-                    }
-                }
-                u64 remaining_iterations_for_this_archetype = archetype->size() % chunk_size;
-                u64 strides;
-                u64 iterations_per_stride;
-                u64 remaining_iterations;
-                if (m_iterations_per_stride == 0)
-                {
-                    strides = 1;
-                    iterations_per_stride = remaining_iterations_for_this_archetype;
-                    remaining_iterations = 0;
-                }
-                else
-                {
-                    strides = remaining_iterations_for_this_archetype / m_iterations_per_stride;
-                    remaining_iterations = remaining_iterations_for_this_archetype % m_iterations_per_stride;
-                    iterations_per_stride = m_iterations_per_stride;
-                }
+        void component_access(Vector<ComponentAccess>& access) const override
+        {
+            Query::append_access(access);
+        }
 
-                for (u64 s = 0; s < strides; ++s)
-                {
-                    queue.enqueue([=, this]()
-                        { system_execute_helper(s * iterations_per_stride, iterations_per_stride, archetype->template get_component_buffer<TComponents>(archetype->size() / chunk_size)...); });
-                }
-                if (remaining_iterations > 0)
-                {
-                    queue.enqueue([=, this]()
-                        { system_execute_helper(strides * iterations_per_stride, remaining_iterations, archetype->template get_component_buffer<TComponents>(archetype->size() / chunk_size)...); });
-                }
-            }
+        // Number of indices the next submit will hand out, for sizing output arrays. Call it right before submitting
+        u64 matched_entity_count(Context& context)
+        {
+            m_query.update(context.archetype_manager());
+            return m_query.entity_count();
         }
 
     private:
-        Vector<Archetype*> m_archetypes;
-        u64 m_iterations_per_stride {0 };
+        using Query = detail::ArchetypeQuery<TTerms...>;
+        using Match = typename Query::Match;
+        using ChunkColumns = typename Query::ChunkColumns;
+        Query m_query;
+        u64 m_iterations_per_stride { 0 };
     };
 
     template<typename TTask>
     class CustomParallelTask : public Task
     {
     public:
-        void schedule(Context& context, WorkQueue& queue) override
+        void schedule_self(Context& context, WorkQueue& queue) override
         {
-            for (Task* task : m_dependencies)
-                task->schedule(context, queue);
-
             u64 iterations_per_stride = m_iterations / m_strides;
             u64 remaining_iterations = m_iterations % m_strides;
 
+            begin_jobs();
             for (u64 i = 0; i < m_strides; ++i)
             {
-                
+                add_job();
                 queue.enqueue([=, this]()
                     {
                     for(u64 c = i*iterations_per_stride; c < iterations_per_stride; ++c)
-                        static_cast<TTask*>(this)->execute(c); });
+                        static_cast<TTask*>(this)->execute(c);
+                    finish_job(); });
             }
             if (remaining_iterations > 0)
             {
+                add_job();
                 queue.enqueue([=, this]()
                     {
                     for(u64 c = iterations_per_stride * m_strides; c < remaining_iterations; ++c)
-                        static_cast<TTask*>(this)->execute(c); });
+                        static_cast<TTask*>(this)->execute(c);
+                    finish_job(); });
             }
+            finish_job();
         }
 
     private:
         u64 m_iterations { 0 };
         u32 m_strides {1 };
     };
+    // Reduces the rows matched by TTerms into a TResult. TTask implements
+    //   void execute(TResult& accumulator, <passed terms>...)
+    //   void combine(TResult& into, TResult const& from)
+    // and a default constructed TResult must be the identity. Every stride accumulates into its own partial result
+    // and the last stride to finish combines them in archetype and chunk order, so the result doesn't depend on
+    // how many workers ran the strides. TTask can optionally implement void finish(TResult const&),
+    // which runs on the worker that completes the reduction.
+    template<typename TTask, typename TResult, typename... TTerms>
+    class ParallelReduceTask : public Task
+    {
+    public:
+        void schedule_self(Context& context, WorkQueue& queue) override
+        {
+            m_query.update(context.archetype_manager());
+
+            // Partials are allocated up front so they never move while the workers write to them.
+            // They're only reallocated when the partition changes
+            auto const& partition = m_query.partition(m_iterations_per_stride);
+            u64 stride_count = partition.size();
+            if (m_partials.size() != stride_count)
+            {
+                m_partials.clear();
+                for (u64 i = 0; i < stride_count; ++i)
+                    m_partials.append(Partial {});
+            }
+            else
+            {
+                for (auto& partial : m_partials)
+                    partial.value = TResult {};
+            }
+            m_pending.store(stride_count, MemoryOrder::Release);
+            if (stride_count == 0)
+            {
+                merge();
+                return;
+            }
+
+            for (u64 index = 0; index < stride_count; ++index)
+            {
+                auto const& item = partition[index];
+                typename Query::Match const& match = m_query.matches()[item.match];
+                typename Query::ChunkColumns columns = Query::chunk_columns(match, item.chunk);
+                queue.enqueue_on_node([=, this]()
+                    {
+                    TResult& partial = m_partials[index].value;
+                    Query::for_each_enabled_row(match, item.chunk, item.start, item.count, [&](u64 i)
+                        { Query::invoke(columns, i, [&](auto&&... arguments)
+                              { static_cast<TTask*>(this)->execute(partial, arguments...); }); });
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        merge(); }, match.archetype->numa_node());
+            }
+        }
+
+        void component_access(Vector<ComponentAccess>& access) const override
+        {
+            Query::append_access(access);
+        }
+
+        // Only valid once is_complete() returns true
+        TResult const& result() const
+        {
+            return m_result;
+        }
+
+    private:
+        void merge()
+        {
+            TResult result {};
+            for (auto const& partial : m_partials)
+                static_cast<TTask*>(this)->combine(result, partial.value);
+            m_result = std::move(result);
+            if constexpr (requires(TTask& task, TResult const& r) { task.finish(r); })
+                static_cast<TTask*>(this)->finish(m_result);
+            notify_complete();
+        }
+
+        // Keeps partials of different strides in different cache lines
+        struct alignas(64) Partial
+        {
+            TResult value {};
+        };
+
+        using Query = detail::ArchetypeQuery<TTerms...>;
+        Query m_query;
+        Vector<Partial> m_partials;
+        TResult m_result {};
+        Atomic<u64> m_pending { 0 };
+        u64 m_iterations_per_stride { 0 };
+    };
+
+    // Exclusive prefix scan over [0, m_iterations). TTask implements
+    //   TValue value(u64 index)
+    //   void store(u64 index, TValue const& exclusive_prefix)
+    //   void combine(TValue& into, TValue const& from)
+    // and a default constructed TValue must be the identity. Runs in two parallel passes over fixed size blocks:
+    // the first sums every block, the last block to finish scans the block sums and enqueues the second pass,
+    // which rescans every block from its prefix and stores the results. The block size, not the worker count,
+    // decides the combine order, so the output is deterministic. store may overwrite the value at the same index.
+    template<typename TTask, typename TValue>
+    class ParallelExclusiveScanTask : public Task
+    {
+    public:
+        void schedule_self(Context& context, WorkQueue& queue) override
+        {
+            u64 block_count = (m_iterations + m_block_size - 1) / m_block_size;
+            m_block_sums.clear();
+            for (u64 i = 0; i < block_count; ++i)
+                m_block_sums.append(Partial {});
+            if (block_count == 0)
+            {
+                m_total = TValue {};
+                notify_complete();
+                return;
+            }
+
+            m_pending.store(block_count, MemoryOrder::Release);
+            WorkQueue* work_queue = &queue;
+            for (u64 block = 0; block < block_count; ++block)
+            {
+                queue.enqueue([=, this]()
+                    {
+                    TValue sum {};
+                    for (u64 i = block_start(block); i < block_end(block); ++i)
+                        static_cast<TTask*>(this)->combine(sum, static_cast<TTask*>(this)->value(i));
+                    m_block_sums[block].value = std::move(sum);
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        scan_blocks(*work_queue); });
+            }
+        }
+
+        // Combination of every value. Only valid once is_complete() returns true
+        TValue const& total() const
+        {
+            return m_total;
+        }
+
+    protected:
+        u64 m_iterations { 0 };
+        u64 m_block_size { 4096 };
+
+    private:
+        u64 block_start(u64 block) const
+        {
+            return block * m_block_size;
+        }
+
+        u64 block_end(u64 block) const
+        {
+            u64 end = (block + 1) * m_block_size;
+            return end < m_iterations ? end : m_iterations;
+        }
+
+        // Turns the block sums into exclusive block prefixes and starts the second pass
+        void scan_blocks(WorkQueue& queue)
+        {
+            TValue running {};
+            for (auto& block_sum : m_block_sums)
+            {
+                TValue sum = std::move(block_sum.value);
+                block_sum.value = running;
+                static_cast<TTask*>(this)->combine(running, sum);
+            }
+            m_total = std::move(running);
+
+            m_pending.store(m_block_sums.size(), MemoryOrder::Release);
+            for (u64 block = 0; block < m_block_sums.size(); ++block)
+            {
+                queue.enqueue([=, this]()
+                    {
+                    TValue prefix = m_block_sums[block].value;
+                    for (u64 i = block_start(block); i < block_end(block); ++i)
+                    {
+                        // Read before storing, so store can overwrite what value reads and scan in place
+                        TValue value = static_cast<TTask*>(this)->value(i);
+                        static_cast<TTask*>(this)->store(i, prefix);
+                        static_cast<TTask*>(this)->combine(prefix, value);
+                    }
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        notify_complete(); });
+            }
+        }
+
+        struct alignas(64) Partial
+        {
+            TValue value {};
+        };
+
+        Vector<Partial> m_block_sums;
+        TValue m_total {};
+        Atomic<u64> m_pending { 0 };
+    };
 }
\ No newline at end of file
@@ -24,6 +24,8 @@
 #include "../Input.h"
 #include "../vengine.h"
 #include "../modules/SDL.h"
+#include "../Log.h"
+#include "../TaskGraph.h"
 
 struct Position
 {
@@ -100,26 +102,36 @@ public:
         }
     };
     
+    void on_register() override
+    {
+        // The graph is wired once, every frame only updates parameters and resubmits it
+        m_task1.depends_on(&m_task2);
+        m_task2.depends_on(&m_task3, &m_task4);
+        m_graph.add(&m_task1);
+    }
+
     void on_update() override
     {
         if (m_context.input().get_key_down(KeyboardKey::Key0, KeyboardModifiers::None))
-            __builtin_printf("Key 0 pressed!\n");
+            log_info("Key 0 pressed!");
         
-        TaskThatIteratesOverEveryMatchingEntity* task1 = new TaskThatIteratesOverEveryMatchingEntity(); task1->delta_time = 0.02f;
-        Task* task2 = new TaskThatIteratesOverEveryMatchingEntityAndAlsoTakesAnIndex();
-        TaskThatIteratesOverAnUserProvidedBuffer* task3 = new TaskThatIteratesOverAnUserProvidedBuffer(); task3->positions = nullptr; task3->velocities = nullptr;
-        Task* task4 = new TaskThatExecutesOnce();
-        task1->depends_on(task2);
-        task2->depends_on(task3, task4);
-        
-        task1->submit(context());
+        m_task1.delta_time = 0.02f;
+        m_task3.positions = nullptr; m_task3.velocities = nullptr;
+        m_graph.submit(context());
     }
+
+private:
+    TaskThatIteratesOverEveryMatchingEntity m_task1;
+    TaskThatIteratesOverEveryMatchingEntityAndAlsoTakesAnIndex m_task2;
+    TaskThatIteratesOverAnUserProvidedBuffer m_task3;
+    TaskThatExecutesOnce m_task4;
+    TaskGraph m_graph;
 };
 
 int main()
 {
 #if DEBUG_ASSERTS == 1
-    __builtin_printf("Debug asserts enabled\n");
+    log_info("Debug asserts enabled");
 #endif
     
     if (vengine::setup().is_error())
@@ -131,7 +143,7 @@ int main()
     if (maybe_sdl_subsystems.has_error())
         return -1;
     Context ctx(std::move(maybe_sdl_subsystems.result()));
-    __builtin_printf("Hello!\n");
+    log_info("Hello!");
     UpdatePhysicsSystem k(ctx);
     ctx.system_manager().register_system(&k);
     vengine::EntityID id = ctx.entity_manager().create(Position{}, Velocity{});
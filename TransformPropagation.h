@@ -0,0 +1,184 @@
+/*
+    Copyright (C) 2022 iori (shortanemoia@protonmail.com)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <Vector.h>
+#include <Atomic.h>
+#include "Tasks.h"
+#include "EntityManager.h"
+
+namespace vengine
+{
+    // Propagates world transforms down the entity manager's hierarchy. TTask implements
+    //     void propagate(TWorld const* parent_world, TLocal const& local, TWorld& world)
+    // where parent_world is null for roots. Levels are processed one after another and the nodes of a level in parallel.
+    // Only subtrees below a node flagged with Hierarchy::mark_dirty since this task's last run are recomputed, so several
+    // propagation tasks can share a hierarchy. World transforms are cached in level order, so children read their
+    // parent's result from a contiguous array instead of looking the parent up, and the components of the changed
+    // nodes of a job are looked up in one batch grouped by archetype. A node with TLocal or TWorld disabled keeps its
+    // world transform and its children are propagated from that. A node missing TLocal is treated like a disabled one,
+    // and the children of a node missing TWorld are propagated from its parent's world transform.
+    // The hierarchy must not be modified until is_complete() returns true.
+    template<typename TTask, typename TLocal, typename TWorld>
+    class TransformPropagationTask : public Task
+    {
+    public:
+        void schedule_self(Context& context, WorkQueue& queue) override
+        {
+            m_entity_manager = &context.entity_manager();
+            auto& hierarchy = m_entity_manager->hierarchy();
+            hierarchy.update_levels();
+            // Another task may have rebuilt the levels, so the cache is checked on every submit. Rebuilding makes every
+            // node dirty, so stale entries are never read
+            size_t node_count = hierarchy.level_order().size();
+            if (m_world_cache.size() != node_count)
+            {
+                m_world_cache.clear();
+                m_changed.clear();
+                m_positions.clear();
+                m_entities.clear();
+                m_locals.clear();
+                m_worlds.clear();
+                m_local_enabled.clear();
+                m_world_enabled.clear();
+                for (size_t i = 0; i < node_count; ++i)
+                {
+                    m_world_cache.append(TWorld {});
+                    m_changed.append(0);
+                    m_positions.append(0);
+                    m_entities.append(0);
+                    m_locals.append(nullptr);
+                    m_worlds.append(nullptr);
+                    m_local_enabled.append(0);
+                    m_world_enabled.append(0);
+                }
+            }
+            // Jobs of a level run at the same time, each one sorts its batch in its own order vector
+            u32 job_count = 0;
+            for (u32 level = 0; level < hierarchy.level_count(); ++level)
+            {
+                u32 level_jobs = (hierarchy.level_start(level + 1) - hierarchy.level_start(level) + m_nodes_per_job - 1) / m_nodes_per_job;
+                job_count = level_jobs > job_count ? level_jobs : job_count;
+            }
+            while (m_job_orders.size() < job_count)
+                m_job_orders.append({});
+
+            m_target_version = hierarchy.version();
+            schedule_level(0, queue);
+        }
+
+        void component_access(Vector<ComponentAccess>& access) const override
+        {
+            access.append(ComponentAccess { type_of<TLocal>(), true });
+            access.append(ComponentAccess { type_of<TWorld>(), false });
+        }
+
+    protected:
+        u32 m_nodes_per_job { 256 };
+
+    private:
+        void schedule_level(u32 level, WorkQueue& queue)
+        {
+            auto& hierarchy = m_entity_manager->hierarchy();
+            if (level >= hierarchy.level_count())
+            {
+                m_processed_version = m_target_version;
+                notify_complete();
+                return;
+            }
+
+            u32 begin = hierarchy.level_start(level);
+            u32 end = hierarchy.level_start(level + 1);
+            u32 job_count = (end - begin + m_nodes_per_job - 1) / m_nodes_per_job;
+            m_pending.store(job_count, MemoryOrder::Release);
+            WorkQueue* work_queue = &queue;
+            for (u32 job = 0; job < job_count; ++job)
+            {
+                u32 job_begin = begin + job * m_nodes_per_job;
+                u32 job_end = job_begin + m_nodes_per_job < end ? job_begin + m_nodes_per_job : end;
+                queue.enqueue([=, this]()
+                    {
+                    update_range(job, job_begin, job_end);
+                    if (m_pending.fetch_sub(1, MemoryOrder::AcquireRelease) == 1)
+                        schedule_level(level + 1, *work_queue); });
+            }
+        }
+
+        // Each job owns the [begin, end) slice of the scratch arrays, so jobs never share one
+        void update_range(u32 job, u32 begin, u32 end)
+        {
+            auto& hierarchy = m_entity_manager->hierarchy();
+            auto const& order = hierarchy.level_order();
+            auto const& parent_positions = hierarchy.parent_positions();
+            u32* positions = m_positions.data() + begin;
+            EntityID* entities = m_entities.data() + begin;
+            u32 count = 0;
+            for (u32 position = begin; position < end; ++position)
+            {
+                HierarchyNode node = order[position];
+                u32 parent_position = parent_positions[position];
+                bool changed = hierarchy.is_dirty(node, m_processed_version) || (parent_position != Hierarchy::NO_PARENT && m_changed[parent_position]);
+                m_changed[position] = changed;
+                if (!changed)
+                    continue;
+                positions[count] = position;
+                entities[count] = hierarchy.entity_of(node);
+                ++count;
+            }
+            if (count == 0)
+                return;
+
+            TLocal** locals = m_locals.data() + begin;
+            TWorld** worlds = m_worlds.data() + begin;
+            u8* local_enabled = m_local_enabled.data() + begin;
+            u8* world_enabled = m_world_enabled.data() + begin;
+            m_entity_manager->get_many_pointers(entities, count, locals, local_enabled, m_job_orders[job]);
+            m_entity_manager->get_many_pointers(entities, count, worlds, world_enabled, m_job_orders[job]);
+
+            for (u32 i = 0; i < count; ++i)
+            {
+                u32 parent_position = parent_positions[positions[i]];
+                TWorld const* parent_world = parent_position == Hierarchy::NO_PARENT ? nullptr : &m_world_cache[parent_position];
+                if (worlds[i] == nullptr)
+                {
+                    m_world_cache[positions[i]] = parent_world != nullptr ? *parent_world : TWorld {};
+                    continue;
+                }
+                if (local_enabled[i] && world_enabled[i])
+                    static_cast<TTask*>(this)->propagate(parent_world, *locals[i], *worlds[i]);
+                m_world_cache[positions[i]] = *worlds[i];
+            }
+        }
+
+        EntityManager* m_entity_manager { nullptr };
+        Vector<TWorld> m_world_cache;
+        Vector<u8> m_changed;
+        // Scratch for the batched lookups, indexed by level order position
+        Vector<u32> m_positions;
+        Vector<EntityID> m_entities;
+        Vector<TLocal*> m_locals;
+        Vector<TWorld*> m_worlds;
+        Vector<u8> m_local_enabled;
+        Vector<u8> m_world_enabled;
+        Vector<Vector<u32>> m_job_orders;
+        // Hierarchy version this task has propagated up to, and the one the running submission will reach
+        u64 m_processed_version { 0 };
+        u64 m_target_version { 0 };
+        Atomic<u32> m_pending { 0 };
+    };
+}
\ No newline at end of file
@@ -20,28 +20,92 @@
 #include <CircularBuffer.h>
 #include <Mutex.h>
 #include <Thread.h>
+#include <Memory.h>
+#include "MemoryTracker.h"
+#include "CpuTopology.h"
+#include "Clock.h"
+#include <Optional.h>
 
 namespace vengine
 {
+    // Tasks can be tagged with the NUMA node whose memory they touch. Workers pinned to that node take them first,
+    // then the untagged and the other nodes' tasks in turn so nobody idles while work is queued.
+    // Background tasks form a separate lane: workers only take them when every queue has run out of frame-critical work,
+    // and only while the frame's background time budget lasts. They don't hold up the end of the frame
     class WorkQueue
     {
     public:
+        static constexpr u64 DEFAULT_BACKGROUND_BUDGET_NS = 2'000'000;
+        static constexpr size_t LANE_CAPACITY = 1024;
+
+        // The lanes are fixed size rings, their storage is recorded once instead of per task
+        WorkQueue()
+        {
+            u32 node_count = CpuTopology::the().node_count();
+            if (node_count >= 2)
+            {
+                for (u32 i = 0; i < node_count; ++i)
+                    m_node_buffers.append(neo::create<CircularBuffer<Function<void>>>(LANE_CAPACITY).release_nonnull());
+            }
+            MemoryTracker::the().record_allocation({ MemorySubsystem::WorkQueues }, lane_bytes());
+        }
+
+        ~WorkQueue()
+        {
+            MemoryTracker::the().record_free({ MemorySubsystem::WorkQueues }, lane_bytes());
+        }
+
         void enqueue(Function<void>&& task)
         {
+            m_unfinished.fetch_add(1, MemoryOrder::Relaxed);
             ScopedLock lock(m_mutex);
             m_buffer.enqueue(std::move(task));
         }
 
+        // Same as enqueue on machines with a single node
+        void enqueue_on_node(Function<void>&& task, u32 node)
+        {
+            if (node >= m_node_buffers.size())
+            {
+                enqueue(std::move(task));
+                return;
+            }
+            m_unfinished.fetch_add(1, MemoryOrder::Relaxed);
+            ScopedLock lock(m_mutex);
+            m_node_buffers[node]->enqueue(std::move(task));
+        }
+
         Function<void> dequeue()
         {
             ScopedLock lock(m_mutex);
             return std::move(m_buffer.dequeue().value());
         }
+
+        Optional<Function<void>> try_dequeue(u32 preferred_node = CpuTopology::NO_NODE)
+        {
+            ScopedLock lock(m_mutex);
+            Optional<Function<void>> task;
+            if (preferred_node < m_node_buffers.size())
+                task = m_node_buffers[preferred_node]->dequeue();
+            // The other lanes are taken in turn, so node tagged tasks don't wait for the untagged lane to run dry.
+            // Ordering between tasks never depends on this, dependents are only enqueued once their dependencies complete
+            size_t lane_count = m_node_buffers.size() + 1;
+            for (size_t i = 0; i < lane_count && !task.has_value(); ++i)
+            {
+                size_t lane = (m_next_lane + i) % lane_count;
+                task = lane == 0 ? m_buffer.dequeue() : m_node_buffers[lane - 1]->dequeue();
+            }
+            m_next_lane++;
+            return task;
+        }
         
         size_t tasks_available()
         {
             ScopedLock lock(m_mutex);
-            return m_buffer.size();
+            size_t count = m_buffer.size();
+            for (auto& buffer : m_node_buffers)
+                count += buffer->size();
+            return count;
         }
         
         void wait()
@@ -50,44 +114,317 @@ namespace vengine
             m_mutex.unlock();
         }
 
+        // Whoever dequeued a task calls this once it has run
+        void task_finished()
+        {
+            m_unfinished.fetch_sub(1, MemoryOrder::Release);
+        }
+
+        // Spins until every enqueued task, including ones enqueued by running tasks, has finished. Ignores background tasks
+        void wait_until_idle()
+        {
+            while (m_unfinished.load(MemoryOrder::Acquire) != 0)
+                __builtin_ia32_pause();
+        }
+
+        void enqueue_background(Function<void>&& task)
+        {
+            m_background_unfinished.fetch_add(1, MemoryOrder::Relaxed);
+            ScopedLock lock(m_mutex);
+            m_background_buffer.enqueue(std::move(task));
+        }
+
+        // Empty once the budget is spent or while the lane is paused
+        Optional<Function<void>> try_dequeue_background()
+        {
+            if (m_background_budget_ns.load(MemoryOrder::Relaxed) <= 0)
+                return {};
+            ScopedLock lock(m_mutex);
+            if (m_background_paused)
+                return {};
+            auto task = m_background_buffer.dequeue();
+            if (task.has_value())
+                m_background_running.fetch_add(1, MemoryOrder::Relaxed);
+            return task;
+        }
+
+        // Whoever dequeued a background task calls this once it has run. The time is charged to the budget
+        void background_task_finished(u64 elapsed_ns)
+        {
+            m_background_budget_ns.fetch_sub((i64)elapsed_ns, MemoryOrder::Relaxed);
+            m_background_running.fetch_sub(1, MemoryOrder::Release);
+            m_background_unfinished.fetch_sub(1, MemoryOrder::Release);
+        }
+
+        // Background work done outside a task, like compaction in Context::end_frame
+        void charge_background(u64 elapsed_ns)
+        {
+            m_background_budget_ns.fetch_sub((i64)elapsed_ns, MemoryOrder::Relaxed);
+        }
+
+        // Stops workers from taking background tasks and waits for the ones already running.
+        // Queued tasks stay queued until resume_background
+        void pause_background()
+        {
+            {
+                ScopedLock lock(m_mutex);
+                m_background_paused = true;
+            }
+            while (m_background_running.load(MemoryOrder::Acquire) != 0)
+                __builtin_ia32_pause();
+        }
+
+        void resume_background()
+        {
+            ScopedLock lock(m_mutex);
+            m_background_paused = false;
+        }
+
+        // Worker time background tasks may use until the next call, summed over all workers
+        void set_background_budget(u64 budget_ns)
+        {
+            m_background_budget_ns.store((i64)budget_ns, MemoryOrder::Relaxed);
+        }
+
+        // Starts the next frame's budget. Whatever the last frame overspent is taken out of it
+        void refill_background_budget(u64 budget_ns)
+        {
+            i64 remaining = m_background_budget_ns.load(MemoryOrder::Relaxed);
+            // Added rather than stored so time charged concurrently isn't lost
+            m_background_budget_ns.fetch_add((i64)budget_ns - (remaining > 0 ? remaining : 0), MemoryOrder::Relaxed);
+        }
+
+        u64 background_budget_remaining() const
+        {
+            i64 remaining = m_background_budget_ns.load(MemoryOrder::Relaxed);
+            return remaining > 0 ? (u64)remaining : 0;
+        }
+
+        // Background tasks only progress while there is budget left
+        void wait_for_background()
+        {
+            while (m_background_unfinished.load(MemoryOrder::Acquire) != 0)
+                __builtin_ia32_pause();
+        }
+
     private:
-        CircularBuffer<Function<void>> m_buffer { 1024 };
+        u64 lane_bytes() const
+        {
+            return (m_node_buffers.size() + 2) * LANE_CAPACITY * sizeof(Function<void>);
+        }
+
+        CircularBuffer<Function<void>> m_buffer { LANE_CAPACITY };
+        // One per NUMA node, empty on single node machines
+        Vector<OwnPtr<CircularBuffer<Function<void>>>> m_node_buffers;
+        CircularBuffer<Function<void>> m_background_buffer { LANE_CAPACITY };
+        // Lane try_dequeue looks at first after the preferred node, 0 is m_buffer. Guarded by m_mutex
+        size_t m_next_lane { 0 };
         neo::SpinlockMutex m_mutex {};
+        Atomic<u64> m_unfinished { 0 };
+        Atomic<u64> m_background_unfinished { 0 };
+        // Background tasks dequeued and not finished yet
+        Atomic<u64> m_background_running { 0 };
+        // Guarded by m_mutex
+        bool m_background_paused { false };
+        Atomic<i64> m_background_budget_ns { (i64)DEFAULT_BACKGROUND_BUDGET_NS };
+    };
+
+    // Thread pool that can be shared by several Contexts (worlds).
+    enum class WorkerPlacement : u8
+    {
+        // Left to the OS scheduler
+        Unpinned,
+        // Worker i may run on any CPU of node i % node_count
+        SpreadAcrossNodes,
+        // Worker i gets its own CPU, alternating between nodes
+        OneCpuPerWorker
     };
 
+    // Every Context registers its own queue and the workers take one task from each queue in turn,
+    // so a busy world can't starve the others. Workers probe the queues without a shared lock, the registry lock is
+    // only taken when a world is added or removed.
     class WorkManager
     {
     public:
-        WorkManager(Context& context, detail::ContextBadge) : m_context(context), m_threads()
+        static constexpr u32 MAX_QUEUES = 64;
+
+        explicit WorkManager(u32 worker_count, WorkerPlacement placement = WorkerPlacement::Unpinned) : m_threads(), m_worker_count(worker_count)
         {
-            auto thread  = Thread::create([this](){
-                while(true)
-                {
-                    m_task_queue.wait();
-                    while (m_task_queue.tasks_available())
+            m_running_workers.store(worker_count, MemoryOrder::Release);
+            for (u32 i = 0; i < worker_count; ++i)
+                m_workers.append(neo::create<WorkerState>().release_nonnull());
+            for (u32 i = 0; i < worker_count; ++i)
+            {
+                auto thread = Thread::create([this, i, placement]()
+                    {
+                    place_worker(i, placement);
+                    u32 node = current_thread_node();
+                    WorkerState& state = *m_workers[i];
+                    // Workers start at different queues so they don't all contend on the first one
+                    size_t cursor = i;
+                    while (!m_stop.load(MemoryOrder::Acquire))
                     {
-                        m_task_queue.dequeue()();
+                        WorkQueue* source = nullptr;
+                        auto task = take_next_task(cursor, source, node, state);
+                        if (task.has_value())
+                        {
+                            task.value()();
+                            source->task_finished();
+                            continue;
+                        }
+
+                        auto background_task = take_background_task(cursor, source, state);
+                        if (background_task.has_value())
+                        {
+                            u64 start = monotonic_time_ns();
+                            background_task.value()();
+                            source->background_task_finished(monotonic_time_ns() - start);
+                        }
+                        else
+                            __builtin_ia32_pause();
                     }
+                    m_running_workers.fetch_sub(1, MemoryOrder::Release); });
+
+                m_threads.append(std::move(thread.result()));
+            }
+        }
+
+        // Workers finish the task they're running and exit. Queued tasks are dropped
+        ~WorkManager()
+        {
+            m_stop.store(true, MemoryOrder::Release);
+            while (m_running_workers.load(MemoryOrder::Acquire) != 0)
+                __builtin_ia32_pause();
+        }
+
+        void register_queue(WorkQueue* queue)
+        {
+            ScopedLock lock(m_queues_mutex);
+            u32 slot_count = m_slot_count.load(MemoryOrder::Relaxed);
+            for (u32 slot = 0; slot < slot_count; ++slot)
+            {
+                if (m_queues[slot].load(MemoryOrder::Relaxed) == nullptr)
+                {
+                    m_queues[slot].store(queue, MemoryOrder::Release);
+                    return;
                 }
-            });
-            
-            m_threads.append(std::move(thread.result()));
+            }
+            VERIFY(slot_count < MAX_QUEUES);
+            m_queues[slot_count].store(queue, MemoryOrder::Release);
+            m_slot_count.store(slot_count + 1, MemoryOrder::Release);
         }
 
-        WorkQueue& task_queue()
+        // Once this returns no worker touches the queue anymore
+        void unregister_queue(WorkQueue* queue)
         {
-            return m_task_queue;
+            {
+                ScopedLock lock(m_queues_mutex);
+                u32 slot_count = m_slot_count.load(MemoryOrder::Relaxed);
+                for (u32 slot = 0; slot < slot_count; ++slot)
+                {
+                    if (m_queues[slot].load(MemoryOrder::Relaxed) == queue)
+                        m_queues[slot].store(nullptr, MemoryOrder::SequentiallyConsistent);
+                }
+            }
+            for (auto& worker : m_workers)
+            {
+                while (worker->probing.load(MemoryOrder::SequentiallyConsistent) == queue)
+                    __builtin_ia32_pause();
+            }
         }
 
         u32 worker_count()
         {
-            return 8;
-            //FIXME
+            return m_worker_count;
         }
 
     private:
-        WorkQueue m_task_queue;
-        Context& m_context;
+        static void place_worker(u32 index, WorkerPlacement placement)
+        {
+            auto const& topology = CpuTopology::the();
+            u32 node = index % topology.node_count();
+            switch (placement)
+            {
+                case WorkerPlacement::Unpinned:
+                    break;
+                case WorkerPlacement::SpreadAcrossNodes:
+                    pin_current_thread_to_node(node);
+                    break;
+                case WorkerPlacement::OneCpuPerWorker:
+                {
+                    auto const& cpus = topology.node(node).cpus;
+                    pin_current_thread_to_cpu(cpus[(index / topology.node_count()) % cpus.size()]);
+                    break;
+                }
+            }
+        }
+
+        // The queue a worker is probing, published so unregister_queue can wait for it. One cache line per worker
+        struct alignas(64) WorkerState
+        {
+            Atomic<WorkQueue*> probing { nullptr };
+        };
+
+        // Null if the slot is empty or the queue was unregistered before the worker could publish it
+        WorkQueue* acquire_queue(u32 slot, WorkerState& state)
+        {
+            WorkQueue* queue = m_queues[slot].load(MemoryOrder::Acquire);
+            if (queue == nullptr)
+                return nullptr;
+            state.probing.store(queue, MemoryOrder::SequentiallyConsistent);
+            if (m_queues[slot].load(MemoryOrder::SequentiallyConsistent) != queue)
+            {
+                state.probing.store(nullptr, MemoryOrder::Release);
+                return nullptr;
+            }
+            return queue;
+        }
+
+        // A dequeued task keeps its queue alive through the queue's unfinished count, Context waits for it
+        template<typename TDequeue>
+        Optional<Function<void>> take_from_queues(size_t& cursor, WorkQueue*& source, WorkerState& state, TDequeue&& dequeue)
+        {
+            u32 slot_count = m_slot_count.load(MemoryOrder::Acquire);
+            for (u32 i = 0; i < slot_count; ++i)
+            {
+                u32 slot = (cursor + i) % slot_count;
+                WorkQueue* queue = acquire_queue(slot, state);
+                if (queue == nullptr)
+                    continue;
+                auto task = dequeue(*queue);
+                state.probing.store(nullptr, MemoryOrder::Release);
+                if (task.has_value())
+                {
+                    cursor = slot + 1;
+                    source = queue;
+                    return task;
+                }
+            }
+            return {};
+        }
+
+        Optional<Function<void>> take_next_task(size_t& cursor, WorkQueue*& source, u32 node, WorkerState& state)
+        {
+            return take_from_queues(cursor, source, state, [node](WorkQueue& queue)
+                { return queue.try_dequeue(node); });
+        }
+
+        // Only called once every queue is out of frame-critical tasks
+        Optional<Function<void>> take_background_task(size_t& cursor, WorkQueue*& source, WorkerState& state)
+        {
+            return take_from_queues(cursor, source, state, [](WorkQueue& queue)
+                { return queue.try_dequeue_background(); });
+        }
+
+        Atomic<WorkQueue*> m_queues[MAX_QUEUES] {};
+        // Slots in use, never shrinks. Unregistered slots are null until a new queue takes them
+        Atomic<u32> m_slot_count { 0 };
+        // Only serializes registration
+        neo::SpinlockMutex m_queues_mutex {};
+        Vector<OwnPtr<WorkerState>> m_workers;
         Vector<RefPtr<Thread>> m_threads;
+        u32 m_worker_count;
+        Atomic<bool> m_stop { false };
+        Atomic<u32> m_running_workers { 0 };
     };
 }
\ No newline at end of file
@@ -18,6 +18,7 @@
 #include "Mutex.h"
 #define NEO_DO_NOT_DEFINE_STD
 #include "String.h"
+#include "../../Clock.h"
 
 namespace vengine
 {
@@ -29,6 +30,76 @@ namespace vengine
                 return SDLK_0;
             case input::KeyboardKey::Key1:
                 return SDLK_1;
+            case input::KeyboardKey::Key2:
+                return SDLK_2;
+            case input::KeyboardKey::Key3:
+                return SDLK_3;
+            case input::KeyboardKey::Key4:
+                return SDLK_4;
+            case input::KeyboardKey::Key5:
+                return SDLK_5;
+            case input::KeyboardKey::Key6:
+                return SDLK_6;
+            case input::KeyboardKey::Key7:
+                return SDLK_7;
+            case input::KeyboardKey::Key8:
+                return SDLK_8;
+            case input::KeyboardKey::Key9:
+                return SDLK_9;
+            case input::KeyboardKey::KeyA:
+                return SDLK_a;
+            case input::KeyboardKey::KeyB:
+                return SDLK_b;
+            case input::KeyboardKey::KeyC:
+                return SDLK_c;
+            case input::KeyboardKey::KeyD:
+                return SDLK_d;
+            case input::KeyboardKey::KeyE:
+                return SDLK_e;
+            case input::KeyboardKey::KeyF:
+                return SDLK_f;
+            case input::KeyboardKey::KeyG:
+                return SDLK_g;
+            case input::KeyboardKey::KeyH:
+                return SDLK_h;
+            case input::KeyboardKey::KeyI:
+                return SDLK_i;
+            case input::KeyboardKey::KeyJ:
+                return SDLK_j;
+            case input::KeyboardKey::KeyK:
+                return SDLK_k;
+            case input::KeyboardKey::KeyL:
+                return SDLK_l;
+            case input::KeyboardKey::KeyM:
+                return SDLK_m;
+            case input::KeyboardKey::KeyN:
+                return SDLK_n;
+            case input::KeyboardKey::KeyO:
+                return SDLK_o;
+            case input::KeyboardKey::KeyP:
+                return SDLK_p;
+            case input::KeyboardKey::KeyQ:
+                return SDLK_q;
+            case input::KeyboardKey::KeyR:
+                return SDLK_r;
+            case input::KeyboardKey::KeyS:
+                return SDLK_s;
+            case input::KeyboardKey::KeyT:
+                return SDLK_t;
+            case input::KeyboardKey::KeyU:
+                return SDLK_u;
+            case input::KeyboardKey::KeyV:
+                return SDLK_v;
+            case input::KeyboardKey::KeyW:
+                return SDLK_w;
+            case input::KeyboardKey::KeyX:
+                return SDLK_x;
+            case input::KeyboardKey::KeyY:
+                return SDLK_y;
+            case input::KeyboardKey::KeyZ:
+                return SDLK_z;
+            default:
+                break;
         }
         VERIFY_NOT_REACHED();
     }
@@ -41,103 +112,258 @@ namespace vengine
                 return SDL_SCANCODE_0;
             case input::KeyboardScancode::Key1:
                 return SDL_SCANCODE_1;
+            case input::KeyboardScancode::Key2:
+                return SDL_SCANCODE_2;
+            case input::KeyboardScancode::Key3:
+                return SDL_SCANCODE_3;
+            case input::KeyboardScancode::Key4:
+                return SDL_SCANCODE_4;
+            case input::KeyboardScancode::Key5:
+                return SDL_SCANCODE_5;
+            case input::KeyboardScancode::Key6:
+                return SDL_SCANCODE_6;
+            case input::KeyboardScancode::Key7:
+                return SDL_SCANCODE_7;
+            case input::KeyboardScancode::Key8:
+                return SDL_SCANCODE_8;
+            case input::KeyboardScancode::Key9:
+                return SDL_SCANCODE_9;
+            case input::KeyboardScancode::KeyA:
+                return SDL_SCANCODE_A;
+            case input::KeyboardScancode::KeyB:
+                return SDL_SCANCODE_B;
+            case input::KeyboardScancode::KeyC:
+                return SDL_SCANCODE_C;
+            case input::KeyboardScancode::KeyD:
+                return SDL_SCANCODE_D;
+            case input::KeyboardScancode::KeyE:
+                return SDL_SCANCODE_E;
+            case input::KeyboardScancode::KeyF:
+                return SDL_SCANCODE_F;
+            case input::KeyboardScancode::KeyG:
+                return SDL_SCANCODE_G;
+            case input::KeyboardScancode::KeyH:
+                return SDL_SCANCODE_H;
+            case input::KeyboardScancode::KeyI:
+                return SDL_SCANCODE_I;
+            case input::KeyboardScancode::KeyJ:
+                return SDL_SCANCODE_J;
+            case input::KeyboardScancode::KeyK:
+                return SDL_SCANCODE_K;
+            case input::KeyboardScancode::KeyL:
+                return SDL_SCANCODE_L;
+            case input::KeyboardScancode::KeyM:
+                return SDL_SCANCODE_M;
+            case input::KeyboardScancode::KeyN:
+                return SDL_SCANCODE_N;
+            case input::KeyboardScancode::KeyO:
+                return SDL_SCANCODE_O;
+            case input::KeyboardScancode::KeyP:
+                return SDL_SCANCODE_P;
+            case input::KeyboardScancode::KeyQ:
+                return SDL_SCANCODE_Q;
+            case input::KeyboardScancode::KeyR:
+                return SDL_SCANCODE_R;
+            case input::KeyboardScancode::KeyS:
+                return SDL_SCANCODE_S;
+            case input::KeyboardScancode::KeyT:
+                return SDL_SCANCODE_T;
+            case input::KeyboardScancode::KeyU:
+                return SDL_SCANCODE_U;
+            case input::KeyboardScancode::KeyV:
+                return SDL_SCANCODE_V;
+            case input::KeyboardScancode::KeyW:
+                return SDL_SCANCODE_W;
+            case input::KeyboardScancode::KeyX:
+                return SDL_SCANCODE_X;
+            case input::KeyboardScancode::KeyY:
+                return SDL_SCANCODE_Y;
+            case input::KeyboardScancode::KeyZ:
+                return SDL_SCANCODE_Z;
+            default:
+                break;
         }
         VERIFY_NOT_REACHED();
     }
     
-    SDL_Keymod keymod_to_sdl_keymod(KeyboardModifiers mod)
+    u16 sdl_keymod_to_modifiers(u16 mod)
     {
-        return static_cast<SDL_Keymod>(0);
+        u16 modifiers = 0;
+        auto map = [&](u16 sdl_mod, KeyboardModifiers modifier)
+        {
+            if (mod & sdl_mod)
+                modifiers |= static_cast<u16>(modifier);
+        };
+        map(KMOD_LSHIFT, KeyboardModifiers::LeftShift);
+        map(KMOD_RSHIFT, KeyboardModifiers::RightShift);
+        map(KMOD_LCTRL, KeyboardModifiers::LeftControl);
+        map(KMOD_RCTRL, KeyboardModifiers::RightControl);
+        map(KMOD_LALT, KeyboardModifiers::LeftAlt);
+        map(KMOD_RALT, KeyboardModifiers::RightAlt);
+        map(KMOD_LGUI, KeyboardModifiers::LeftCommand);
+        map(KMOD_RGUI, KeyboardModifiers::RightCommand);
+        map(KMOD_NUM, KeyboardModifiers::NumLock);
+        map(KMOD_CAPS, KeyboardModifiers::CapsLock);
+        map(KMOD_MODE, KeyboardModifiers::AltGr);
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+        map(KMOD_SCROLL, KeyboardModifiers::Scroll);
+#endif
+        return modifiers;
     }
     
+    SDLInput::SDLInput()
+    {
+        for (auto& key : m_key_by_sdl_key)
+            key = InputEvent::NO_KEY;
+        for (auto& scancode : m_scancode_by_sdl_scancode)
+            scancode = InputEvent::NO_KEY;
+        for (u8 key = 0; key < static_cast<u8>(KeyboardKey::Count); ++key)
+            m_key_by_sdl_key[key_to_sdl_key(static_cast<KeyboardKey>(key))] = key;
+        for (u8 scancode = 0; scancode < static_cast<u8>(KeyboardScancode::Count); ++scancode)
+            m_scancode_by_sdl_scancode[scancode_to_sdl_scancode(static_cast<KeyboardScancode>(scancode))] = scancode;
+    }
     
-    void SDLInput::update_inputs()
+    SDLInput::~SDLInput()
     {
-        m_keyboard_events.clear();
-        SDL_Event event {};
-        while(SDL_PollEvent(&event))
-        {
-            switch (event.type)
-            {
-                case SDL_KEYUP:
-                case SDL_KEYDOWN:
-                {
-                    m_keyboard_events.append(event.key);
-                }
-            }
-        }
+        if (!m_polling.load(MemoryOrder::Acquire))
+            return;
+        m_stop_polling.store(true, MemoryOrder::Release);
+        while (m_polling.load(MemoryOrder::Acquire))
+            __builtin_ia32_pause();
     }
     
-    bool SDLInput::get_key_down(KeyboardKey key, KeyboardModifiers modifiers)
+    bool SDLInput::translate(SDL_Event const& event, InputEvent& translated) const
     {
-        auto k = key_to_sdl_key(key);
-        auto mod = keymod_to_sdl_keymod(modifiers);
-        for(auto const& event : m_keyboard_events)
-        {
-            if (event.type == SDL_KEYDOWN && event.keysym.sym == k && event.keysym.mod == mod && event.repeat == 0)
-                return true;
-        }
-        return false;
+        if (event.type != SDL_KEYDOWN && event.type != SDL_KEYUP)
+            return false;
+
+        SDL_Keycode sym = event.key.keysym.sym;
+        SDL_Scancode code = event.key.keysym.scancode;
+        translated.timestamp_ns = monotonic_time_ns();
+        translated.modifiers = sdl_keymod_to_modifiers(event.key.keysym.mod);
+        translated.key = sym >= 0 && sym < KEY_TABLE_SIZE ? m_key_by_sdl_key[sym] : InputEvent::NO_KEY;
+        translated.scancode = code < SDL_NUM_SCANCODES ? m_scancode_by_sdl_scancode[code] : InputEvent::NO_KEY;
+        translated.down = event.type == SDL_KEYDOWN;
+        translated.repeat = event.key.repeat != 0;
+        return true;
     }
     
-    bool SDLInput::get_key_up(KeyboardKey key, KeyboardModifiers modifiers)
+    bool SDLInput::start_async_polling()
     {
-        auto k = key_to_sdl_key(key);
-        auto mod = keymod_to_sdl_keymod(modifiers);
-        for(auto const& event : m_keyboard_events)
-        {
-            if (event.type == SDL_KEYUP && event.keysym.sym == k && event.keysym.mod == mod && event.repeat == 0)
-                return true;
-        }
-        return false;
+        if (m_polling.load(MemoryOrder::Acquire))
+            return true;
+
+        m_stop_polling.store(false, MemoryOrder::Release);
+        m_polling.store(true, MemoryOrder::Release);
+        auto thread = Thread::create([this]()
+            { poll_events_async(); });
+        m_polling_thread = std::move(thread.result());
+        return true;
     }
     
-    bool SDLInput::get_key(KeyboardKey key, KeyboardModifiers modifiers)
+    // Runs on the polling thread, which is the only producer of m_event_ring
+    void SDLInput::poll_events_async()
     {
-        auto k = key_to_sdl_key(key);
-        auto mod = keymod_to_sdl_keymod(modifiers);
-        for(auto const& event : m_keyboard_events)
+        SDL_Event event {};
+        while (!m_stop_polling.load(MemoryOrder::Acquire))
         {
-            if (event.type == SDL_KEYDOWN && event.keysym.sym == k && event.keysym.mod == mod && event.repeat == 1)
-                return true;
+            // The timeout bounds how long shutdown waits for the thread
+            if (!SDL_WaitEventTimeout(&event, 10))
+                continue;
+
+            InputEvent translated;
+            if (!translate(event, translated))
+                continue;
+            // Presses and repeats leave RELEASE_HEADROOM slots free for releases
+            bool pushed = false;
+            if (!translated.down || m_event_ring.size() + RELEASE_HEADROOM < EVENT_RING_CAPACITY)
+                pushed = m_event_ring.try_push(translated);
+            if (pushed)
+                continue;
+            m_dropped_events.fetch_add(1, MemoryOrder::Relaxed);
+            if (!translated.down)
+                m_resync_keyboard.store(true, MemoryOrder::Release);
         }
-        return false;
+        m_polling.store(false, MemoryOrder::Release);
     }
     
-    bool SDLInput::get_physical_key_down(KeyboardScancode scancode, KeyboardModifiers modifiers)
+    // Fills the state that isn't published yet and then swaps it in, so tasks reading the current one never see a partial frame.
+    // In async mode the events were already pumped and timestamped by the polling thread and only need draining
+    void SDLInput::update_inputs()
     {
-        auto mod = keymod_to_sdl_keymod(modifiers);
-        auto code = scancode_to_sdl_scancode(scancode);
-        for(auto const& event : m_keyboard_events)
+        u32 next_index = 1 - m_current_state.load(MemoryOrder::Relaxed);
+        KeyboardState& next = m_states[next_index];
+        Vector<InputEvent>& events = m_events[next_index];
+        next.begin_frame(m_states[1 - next_index]);
+        events.clear();
+
+        InputEvent translated;
+        bool resync = false;
+        if (m_polling.load(MemoryOrder::Acquire))
+        {
+            // Read before draining, so a release dropped after the drain waits for the next update
+            resync = m_resync_keyboard.exchange(false, MemoryOrder::Acquire);
+            while (m_event_ring.try_pop(translated))
+                events.append(translated);
+        }
+        else
         {
-            if (event.type == SDL_KEYDOWN && event.keysym.scancode == code && event.keysym.mod == mod && event.repeat == 0)
-                return true;
+            SDL_Event event {};
+            while (SDL_PollEvent(&event))
+            {
+                if (translate(event, translated))
+                    events.append(translated);
+            }
         }
-        return false;
+
+        for (auto const& event : events)
+            next.apply(event);
+        if (resync)
+            resync_keyboard(next, events);
+        m_current_state.store(next_index, MemoryOrder::Release);
     }
-    
-    bool SDLInput::get_physical_key_up(KeyboardScancode scancode, KeyboardModifiers modifiers)
+
+    // Makes the held scancodes match SDL's own keyboard state, with events for every key that changed
+    void SDLInput::resync_keyboard(KeyboardState& state, Vector<InputEvent>& events) const
     {
-        auto mod = keymod_to_sdl_keymod(modifiers);
-        auto code = scancode_to_sdl_scancode(scancode);
-        for(auto const& event : m_keyboard_events)
+        int count = 0;
+        Uint8 const* sdl_state = SDL_GetKeyboardState(&count);
+        u16 modifiers = sdl_keymod_to_modifiers(SDL_GetModState());
+        for (int code = 0; code < count && code < SDL_NUM_SCANCODES; ++code)
         {
-            if (event.type == SDL_KEYUP && event.keysym.scancode == code && event.keysym.mod == mod && event.repeat == 0)
-                return true;
+            u8 scancode = m_scancode_by_sdl_scancode[code];
+            if (scancode == InputEvent::NO_KEY)
+                continue;
+            bool down = sdl_state[code] != 0;
+            if (KeyboardState::test(state.held_scancodes, scancode) == down)
+                continue;
+
+            SDL_Keycode sym = SDL_GetKeyFromScancode((SDL_Scancode)code);
+            InputEvent event;
+            event.timestamp_ns = monotonic_time_ns();
+            event.modifiers = modifiers;
+            event.key = sym >= 0 && sym < KEY_TABLE_SIZE ? m_key_by_sdl_key[sym] : InputEvent::NO_KEY;
+            event.scancode = scancode;
+            event.down = down;
+            event.repeat = false;
+            state.apply(event);
+            events.append(event);
         }
-        return false;
     }
     
-    bool SDLInput::get_physical_key(KeyboardScancode scancode, KeyboardModifiers modifiers)
+    KeyboardState const& SDLInput::keyboard_state() const
     {
-        auto mod = keymod_to_sdl_keymod(modifiers);
-        auto code = scancode_to_sdl_scancode(scancode);
-        for(auto const& event : m_keyboard_events)
-        {
-            if (event.type == SDL_KEYDOWN && event.keysym.scancode == code && event.keysym.mod == mod && event.repeat == 1)
-                return true;
-        }
-        return false;
+        return m_states[m_current_state.load(MemoryOrder::Acquire)];
+    }
+    
+    Vector<InputEvent> const& SDLInput::frame_events() const
+    {
+        return m_events[m_current_state.load(MemoryOrder::Acquire)];
+    }
+    
+    u64 SDLInput::dropped_events() const
+    {
+        return m_dropped_events.load(MemoryOrder::Relaxed);
     }
     
     String SDLInput::get_key_name(KeyboardKey key)
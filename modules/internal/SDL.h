@@ -18,6 +18,9 @@
 #include <SDL2/SDL.h>
 #define NEO_DO_NOT_DEFINE_STD
 #include <String.h>
+#include <Atomic.h>
+#include <Thread.h>
+#include "../../SPSCRing.h"
 #include "../../Input.h"
 #include "../../Window.h"
 #include "../SDLStructs.h"
@@ -28,16 +31,43 @@ namespace vengine
     private:
         void update_inputs() override;
     public:
-        virtual bool get_key_down(KeyboardKey key, KeyboardModifiers modifiers) override;
-        virtual bool get_key_up(KeyboardKey key, KeyboardModifiers modifiers) override;
-        virtual bool get_key(KeyboardKey key, KeyboardModifiers modifiers) override;
-        virtual bool get_physical_key_down(KeyboardScancode scancode, KeyboardModifiers modifiers) override;
-        virtual bool get_physical_key_up(KeyboardScancode scancode, KeyboardModifiers modifiers) override;
-        virtual bool get_physical_key(KeyboardScancode scancode, KeyboardModifiers modifiers) override;
+        SDLInput();
+        ~SDLInput() override;
+        virtual KeyboardState const& keyboard_state() const override;
+        virtual Vector<InputEvent> const& frame_events() const override;
+        // SDL only allows pumping events on the thread that initialized video on some platforms (notably macOS),
+        // so only use this where that restriction doesn't apply
+        virtual bool start_async_polling() override;
+        // Events lost because the ring was full while the simulation didn't drain it. Releases are kept as long as possible,
+        // and if one is lost anyway the next update resyncs the held keys with SDL
+        u64 dropped_events() const;
         virtual String get_key_name(KeyboardKey key) override;
         virtual String get_scancode_name(KeyboardScancode scancode) override;
     private:
-        Vector<SDL_KeyboardEvent> m_keyboard_events;
+        // Every mapped SDL keycode is printable ASCII
+        static constexpr i32 KEY_TABLE_SIZE = 128;
+        static constexpr u32 EVENT_RING_CAPACITY = 1024;
+        // Slots only key releases may use, so a flood of presses and repeats can't leave keys stuck down
+        static constexpr u32 RELEASE_HEADROOM = 64;
+
+        bool translate(SDL_Event const& event, InputEvent& translated) const;
+        void poll_events_async();
+        void resync_keyboard(KeyboardState& state, Vector<InputEvent>& events) const;
+
+        // Double buffered: workers read the published state while update_inputs fills the other one
+        KeyboardState m_states[2];
+        Vector<InputEvent> m_events[2];
+        Atomic<u32> m_current_state { 0 };
+        SPSCRing<InputEvent, EVENT_RING_CAPACITY> m_event_ring;
+        RefPtr<Thread> m_polling_thread;
+        Atomic<bool> m_polling { false };
+        Atomic<bool> m_stop_polling { false };
+        Atomic<u64> m_dropped_events { 0 };
+        // Set by the polling thread when it had to drop a release
+        Atomic<bool> m_resync_keyboard { false };
+        // InputEvent::NO_KEY for SDL keys without a KeyboardKey or KeyboardScancode
+        u8 m_key_by_sdl_key[KEY_TABLE_SIZE];
+        u8 m_scancode_by_sdl_scancode[SDL_NUM_SCANCODES];
         HybridMutex m_get_key_name_mutex;
         HybridMutex m_get_scancode_name_mutex;
     };